@@ -0,0 +1,156 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "adc.h"
+
+/* the signals on the analog inputs ADC0..15, as the ADC of the emulator samples them: each is a
+   file that is mapped into memory and indexed by the time since the start of the run, so that
+   hours of recordings cost no more than the pages that are looked at.
+
+     channel:file.csv         lines "seconds,value", in order of time; every value holds until
+                              the time of the next one (the first from the start). lines that
+                              don't start with a number (a header, comments) are skipped
+     channel:file:rate        raw samples, 16 bits little endian each, at rate per second
+
+   values are what the ADC converts them to (0..1023, whatever the reference); after the end of
+   a recording, its last value holds. channels without a recording read 0 */
+
+#define NEVER (~0ull)
+
+static struct stream {
+	const unsigned char *data;
+	size_t size;
+	unsigned long rate;           /* samples per second of a raw file, or 0 for csv */
+	size_t line, next;            /* csv: the line in effect, and the one after it */
+	unsigned long long from, until; /* when they take effect (ns) */
+	unsigned value;
+} streams[ADC_CHANNELS];
+
+static const unsigned char *map_file(const char *file, size_t *size)
+{
+	struct stat st;
+	void *mem;
+	int fd = open(file, O_RDONLY);
+	if(fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size > 1<<30) {
+		fprintf(stderr, "%s: could not open recording (at most 1GB)\n", file);
+		if(fd >= 0) close(fd);
+		return NULL;
+	}
+	mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(mem == MAP_FAILED) {
+		perror(file);
+		return NULL;
+	}
+	madvise(mem, st.st_size, MADV_SEQUENTIAL);
+	*size = st.st_size;
+	return mem;
+}
+
+static int digit(const unsigned char *p, const unsigned char *end)
+{
+	return p < end && *p >= '0' && *p <= '9';
+}
+
+/* parses the line at pos; returns 0 if it isn't "seconds,value" */
+static int parse_line(const struct stream *s, size_t pos, unsigned long long *ns, unsigned *value)
+{
+	const unsigned char *p = s->data + pos, *end = s->data + s->size;
+	unsigned long long sec = 0, frac = 0, scale = 1000000000;
+	unsigned long v = 0;
+	if(!digit(p, end))
+		return 0;
+	while(digit(p, end))
+		sec = sec*10 + (*p++ - '0');
+	if(p < end && *p == '.')
+		for(p++; digit(p, end); p++)
+			if(scale > 1)
+				frac += (*p - '0') * (scale /= 10);
+	while(p < end && (*p == ',' || *p == ';' || *p == ' ' || *p == '\t'))
+		p++;
+	if(!digit(p, end))
+		return 0;
+	while(digit(p, end))
+		if((v = v*10 + (*p++ - '0')) > 1023)
+			v = 1023;
+	*ns = sec*1000000000 + frac;
+	*value = v;
+	return 1;
+}
+
+static size_t next_line(const struct stream *s, size_t pos)
+{
+	const unsigned char *p = memchr(s->data + pos, '\n', s->size - pos);
+	return p? p+1 - s->data : s->size;
+}
+
+/* finds the first line from pos on that has a value, and when it takes effect */
+static size_t find_line(struct stream *s, size_t pos, unsigned long long *ns, unsigned *value)
+{
+	for(; pos < s->size; pos = next_line(s, pos))
+		if(parse_line(s, pos, ns, value))
+			return pos;
+	*ns = NEVER;
+	return pos;
+}
+
+static void csv_rewind(struct stream *s)
+{
+	unsigned value;
+	s->value = 0;
+	s->from  = 0;
+	s->line  = find_line(s, 0, &s->until, &s->value);
+	s->next  = s->line < s->size? find_line(s, next_line(s, s->line), &s->until, &value) : s->size;
+}
+
+/* see the top of this file */
+int adc_stream(const char *spec)
+{
+	char file[256];
+	unsigned long rate = 0;
+	int channel, n;
+	struct stream *s;
+	if(sscanf(spec, "%d:%255[^:]%n", &channel, file, &n) < 2 || channel < 0 || channel >= ADC_CHANNELS)
+		return -1;
+	if(spec[n] == ':' && (rate = strtoul(spec+n+1, NULL, 0)) == 0)
+		return -1;
+	s = &streams[channel];
+	if(!(s->data = map_file(file, &s->size)))
+		return -1;
+	if(rate && s->size < 2)
+		return -1;
+	s->rate = rate;
+	if(!rate)
+		csv_rewind(s);
+	return 0;
+}
+
+/* the value of a channel at a time (ns); it is meant to be asked for in order of time */
+unsigned adc_sample(int channel, unsigned long long ns)
+{
+	struct stream *s = &streams[channel];
+	unsigned value;
+	if(!s->data)
+		return 0;
+	if(s->rate) {
+		const unsigned char *p;
+		unsigned long long i = ns / 1000000000 * s->rate + ns % 1000000000 * s->rate / 1000000000;
+		if(i >= s->size/2)
+			i = s->size/2 - 1;
+		p = s->data + 2*i;
+		return (p[0] | p[1] << 8) > 1023? 1023 : p[0] | p[1] << 8;
+	}
+	if(ns < s->from)
+		csv_rewind(s);
+	while(ns >= s->until) {
+		s->line = s->next;
+		parse_line(s, s->line, &s->from, &s->value);
+		s->next = find_line(s, next_line(s, s->line), &s->until, &value);
+	}
+	return s->value;
+}
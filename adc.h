@@ -0,0 +1,6 @@
+/* recorded signals on the analog inputs (see adc.c) */
+
+#define ADC_CHANNELS 16
+
+extern int adc_stream(const char *spec);
+extern unsigned adc_sample(int channel, unsigned long long ns);
@@ -34,26 +34,41 @@ FLASHEND = 0x1FFFF
 IOEND    = 0x1FF
 
 /* functional options */
+.ifndef ABORTDETECT
 ABORTDETECT=0	# detect RJMP -1 as a halting condition?
+.endif
 INTR=1		# enable interrupt functionality? (turn this off to get a little bit more speed)
 
 /* debugging switch; used for debugging the simulator itself -- produces traces by calls to avr_debug */
 DEBUG=0
 
+/* data watchpoints: check avr_WATCH before data stores/loads and call avr_watch if needed */
+.ifndef WATCH
+WATCH=0
+.endif
+
+/* sanitizer: assemble a second, checked copy of the core (see below) that only exports
+   avr_run_checked and avr_step_checked, and uses the data of the normal core */
+.ifndef SANITIZE
+SANITIZE=0
+.endif
+
+/* coverage: record executed instructions and branch edges in avr_COVER; without SANITIZE, this
+   assembles a copy of the core that exports avr_run_coverage and avr_step_coverage instead */
+.ifndef COVERAGE
+COVERAGE=0
+.endif
+PRIMARY = !(SANITIZE|COVERAGE)
+
 /* optimization options */
 FASTRESUME=1	# eliminate a constant jump from the instruction decoding cycle -- keep this on!
 FASTFLAG=1	# use a lookup table to convert x86 flags to AVR
 FASTLDST=1	# use a different sequence of CMOVcc for deciding between loads and stores
 
-/* branch prediction options; set to 0 if a predictable choice can be made, 1 for mixed code */
-PAR_LDS=1	# use branchless code to distinguish LD/ST from LDS/STS?
-PAR_STK=1	# use branchless code to distinguish PUSH/POP from LD/ST?
-PAR_SBIW=1	# use branchless code to distinguish ADIW and SBIW?
-
 /* don't touch these */
-SFLAG    = 1    # correct emulation of the S flag (avoids double-conversions of flags)
+SFLAG    = 1    # don't convert the flags again if they haven't changed since the last time
 RAMEND   = SRAM + IOEND
-BIGPC    = FLASHEND > 0xFFFF
+BIGPC    = FLASHEND > 0xFFFF   # -1 if true (a comparison in as), so 3-BIGPC is 4 with a 3-byte PC
 
 /* user interface:
 
@@ -62,6 +77,25 @@ BIGPC    = FLASHEND > 0xFFFF
    byte avr_DATA[]	the data-addressable space of the AVR (including CPU registers, I/O registeres)
    byte avr_IO[]	the I/O-addressable space of the AVR (aliassed with avr_DATA)
    byte avr_INT		set this to 1 to trigger an interrupt in avr_run()
+   qword avr_IRQ	pending interrupt requests; avr_INT is ignored if this is zero; bit n requests
+			the interrupt at vector 2n, the lowest bit having the highest priority;
+			the emulator vectors these itself, except for bit 0 (reset), which
+			is not masked by the I flag
+   byte avr_HALT	set this (and avr_INT) to 1 to make avr_run() return at the next instruction;
+			the host should clear it again afterwards
+   byte avr_MAIL	set this (and avr_INT) to 1 to make avr_run() call avr_mail() before the next
+			instruction; it is cleared before the call
+   byte avr_ASYNC	set this to 1 if other threads or signal handlers write to avr_IO while
+			avr_run is active: OUT, SBI and CBI then use locked instructions; if it is 0
+			(the default), they are plain, and others should post their writes through
+			avr_MAIL instead
+   qword avr_DEADLINE	avr_deadline() is called before the instruction at which avr_cycle reaches
+			this value; only the lower 32 bits are compared, so it should never be more
+			than 2^31 cycles ahead (cleared by avr_reset); when it is set outside of
+			avr_deadline(), it should not be set past avr_LIMIT
+   qword avr_LIMIT	the cycle limit of avr_run_until() (all ones for avr_run); read-only
+   dword avr_IO_PC	while avr_io_in/avr_io_out (or the _bit versions) is called: the word address
+			that follows the instruction accessing the port; read-only
 
    the following are not guaranteed to be meaningful when accessed/modified when avr_run is active:
 
@@ -72,10 +106,16 @@ BIGPC    = FLASHEND > 0xFFFF
    callable functions:
 
    void avr_reset()	resets the avr (doesn't clear the SRAM/registers/etc), resume execution at avr_BOOT_PC
-   int avr_run()	runs the avr until sleep/break or an interrupt occurs
+   int avr_run()	runs the avr until sleep/break or a reset is requested
    int avr_step()	as avr_run(), but executes only a single instruction
+   int avr_run_until(qword cycle)
+			as avr_run(), but also returns before the first instruction that would start
+			when avr_cycle >= cycle (requires INTR)
+   int avr_run_for(dword cycles)
+			avr_run_until(avr_cycle + cycles)
 
-	return status: 0=interrupt, 1=sleep, 2=break, 3=rjmp -1, else: unhandled
+	return status: 0=reset requested, 1=sleep, 2=break, 3=rjmp -1, 4=halted by host,
+		       5=cycle limit reached, else: unhandled
 
    the following optional functions, if defined by the user, will be used as follows:
 
@@ -94,11 +134,80 @@ BIGPC    = FLASHEND > 0xFFFF
 
    void avr_des_round(byte* data, byte* key, int round, int decrypt)
    			called when a DES instruction is executed (default: abort)
+
+   void avr_deadline()	called when avr_cycle reaches avr_DEADLINE; should move avr_DEADLINE forward,
+			and can set avr_INT to request an interrupt (default: wait 2^30 cycles)
+
+   void avr_mail()	called at an instruction boundary when avr_MAIL was set (default: do nothing)
+
+   void avr_interrupt(int n)
+			called when the mcu takes the interrupt requested by bit n of avr_IRQ, after
+			the return address has been pushed and IF cleared; should acknowledge the
+			request, e.g. by clearing its interrupt flag (default: clear the bit)
+
+   if a copy of this file assembled with SANITIZE=1 is linked in:
+
+   byte avr_CHECKED	set this to 1 to make avr_run()/avr_step() use the checked core
+   byte avr_SHADOW[]	shadow memory for avr_DATA; bit 0 (1) is set for every byte that has
+			been written by the mcu, bit 1 (2) should be set by the host for unmapped I/O
+   word avr_STACK_LIMIT	the lowest value SP may attain on a push/call (default: IOEND)
+
+   void avr_fault(int kind, int address)
+			called by the checked core if it detects a problem; kind is one of
+			1=read of uninitialised SRAM, 2=access above RAMEND, 3=unmapped I/O,
+			4=stack overflow (SP below avr_STACK_LIMIT), 5=stack underflow (SP above RAMEND);
+			to stop the emulator after the instruction, set avr_HALT and avr_INT
+
+   if a copy of this file assembled with COVERAGE=1 is linked in (the checked core can be as well):
+
+   byte avr_CHECKED	set this to 2 to use the coverage core
+   byte avr_COVER[]	for every word of avr_FLASH, bit 0 (1) is set when an instruction starts
+			there; for a branch or skip instruction, bit 1 (2) is set when it has
+			been taken, bit 2 (4) when it has not
+
+   if assembled with WATCH=1:
+
+   byte avr_WATCH[256]	for every 256-byte block of avr_DATA, bit 0 (1) is set if a read
+			watchpoint exists, bit 1 (2) if a write watchpoint exists in it
+
+   void avr_watch(int address, int kind)
+			called before a LD/ST/LDD/STD/PUSH/POP/LDS/STS (or a register write by
+			an ALU instruction) accesses a block marked in avr_WATCH (kind: 1=read, 2=write);
+			to stop the emulator after the instruction, set avr_HALT and avr_INT
 */
 
+.if SANITIZE
+.global avr_run_checked
+.global avr_step_checked
+.global avr_SHADOW
+.global avr_STACK_LIMIT
+.global avr_run_limited_checked
+avr_run_checked  = avr_run
+avr_step_checked = avr_step
+avr_run_limited_checked = run_limited
+.elseif COVERAGE
+.global avr_run_coverage
+.global avr_step_coverage
+.global avr_run_limited_coverage
+avr_run_coverage  = avr_run
+avr_step_coverage = avr_step
+avr_run_limited_coverage = run_limited
+.else
 .global avr_reset
 .global avr_run
+.global avr_run_for
+.global avr_run_until
 .global avr_step
+.global avr_CHECKED
+.global avr_COVER
+.weak avr_run_checked
+.weak avr_step_checked
+.weak avr_run_limited_checked
+.weak avr_run_coverage
+.weak avr_step_coverage
+.weak avr_run_limited_coverage
+.endif
+.global avr_INTR
 .global avr_PC
 .global avr_BOOT_PC
 .global avr_ADDR
@@ -107,6 +216,13 @@ BIGPC    = FLASHEND > 0xFFFF
 .global avr_cycle
 .global avr_last_wdr
 .global avr_INT
+.global avr_IRQ
+.global avr_HALT
+.global avr_MAIL
+.global avr_ASYNC
+.global avr_DEADLINE
+.global avr_LIMIT
+.global avr_IO_PC
 .global avr_SP
 .global avr_SREG
 
@@ -116,6 +232,14 @@ BIGPC    = FLASHEND > 0xFFFF
 .weak avr_io_out_bit
 .weak avr_self_program
 .weak avr_des_round
+.weak avr_deadline
+.weak avr_interrupt
+.weak avr_mail
+.weak avr_watch
+.weak avr_fault
+.if WATCH
+.global avr_WATCH
+.endif
 
 .text
 
@@ -151,6 +275,7 @@ SF = 1<<7
 ZF = 1<<6
 CF = 1<<0
 RF = 1<<1  # reserved flag, always set to 1 by x86
+SX = 1<<15 # reserved flag, always 0 on x86: we use it for S^N^V
 
 .if FASTFLAG
 .data
@@ -173,8 +298,11 @@ flagcvt:
 .text
 .endif
 
-# TODO: this emulated cpu doesn't have an actual "sign" flag; this means
-# that writes to it (via SES/CLS or SBI/CBI/OUT/ST) get ignored.
+# the flags are kept in ebx in the form that the x86 ALU instructions leave them: C, Z, N, V and H
+# are CF, ZF, SF, OF and AF, and S is N^V, unless SX is set (after SES/CLS or a write to SREG).
+# avr_SREG is only brought up to date by avr_flags when it is needed; a branch tests ebx directly.
+# if RF is clear, ebx hasn't changed since avr_SREG was last written or brought up to date.
+
 # converts ebx from x86 FLAGS to avr avr_SREG -> eax
 .macro avr_flags ebx
 local skip
@@ -184,11 +312,15 @@ local skip
     jz skip
     .endif
     .if FASTFLAG
-    and ebx, 0x8d1
+    and ebx, 0x8d1+SX
     lea eax, [ebx*8+ebx]
     xor al, ah
     and eax, 0x1F
     mov al, [flagcvt+eax]
+    mov ah, bh
+    shr ah, 3
+    and ah, 0x10                    # SX
+    xor al, ah
     mov ah, [avr_SREG]
     and ah, 0xC0
     or al, ah
@@ -207,6 +339,10 @@ local skip
     add al, al
     and al, 0x10
     or ah, al
+    mov al, bh
+    shr al, 3
+    and al, 0x10                    # SX
+    xor ah, al
     mov al, [avr_SREG]
     and al, 0xC0
     or al, ah
@@ -221,10 +357,45 @@ skip:
     mov ecx, eax
     shl cl, 2
     shr ecx, 3
-    and ecx, 0xD0
+    and ecx, 0xD8                   # S is put in bit 3 for now
     and eax, 0x801
     lea bx, [ecx+eax]
     # note: bit 2 of flags will be cleared after load_flags, but should be 1 on 'real' x86 flags
+    mov ecx, ebx
+    shr ecx, 4                      # N in bit 3, V in bit 7
+    mov eax, ecx
+    shr eax, 4                      # V in bit 3
+    xor ecx, eax
+    xor ecx, ebx                    # S^N^V in bit 3
+    and ecx, 8
+    shl ecx, 12                     # SX
+    and bl, ~8
+    or ebx, ecx
+.endm
+
+# gets the flag at the given bit of SREG in CF (clobbers eax and esi)
+.macro test_flag bit
+.if \bit == 0
+    bt ebx, 0                       # CF
+.elseif \bit == 1
+    bt ebx, 6                       # ZF
+.elseif \bit == 2
+    bt ebx, 7                       # SF
+.elseif \bit == 3
+    bt ebx, 11                      # OF
+.elseif \bit == 4
+    mov eax, ebx
+    mov esi, ebx
+    shr eax, 4
+    shr esi, 8
+    xor eax, ebx
+    xor eax, esi
+    bt eax, 7                       # SF^OF^SX
+.elseif \bit == 5
+    bt ebx, 4                       # AF
+.else
+    bt dword ptr [avr_SREG], \bit
+.endif
 .endm
 
 .macro imm
@@ -236,8 +407,46 @@ skip:
 .endm
 
 .macro transfer edx, esi
+local skip
     # don't use jumps, just read the locations
     # if CF, store, otherwise, load
+.if WATCH
+    setc cl
+    and ecx, 1
+    inc ecx      # ecx = 1 (read) or 2 (write)
+    mov eax, esi
+    shr eax, 8
+    test cl, [avr_WATCH+eax]
+    jz skip
+    pusha
+    push ecx
+    push esi
+    call avr_watch
+    add esp, 8
+    popa
+skip:
+    bt ecx, 1    # restore CF
+.endif
+.if SANITIZE
+local inrange, store, ok
+    pushf
+    cmp esi, RAMEND
+    jbe inrange
+    fault 2, [esi]
+inrange:
+    popf
+    pushf
+    jc store
+    cmp esi, IOEND
+    jbe ok
+    test byte ptr [avr_SHADOW+esi], 1
+    jnz ok
+    fault 1, [esi]
+    jmp ok
+store:
+    or byte ptr [avr_SHADOW+esi], 1
+ok: popf
+.endif
 .if FASTLDST
     mov eax, edx
     cmovc edx, esi
@@ -254,7 +463,120 @@ skip:
 .endif
 .endm
 
+# for the ALU instructions: check for a write watchpoint on a register (preserving all flags)
+.macro watchreg reg
+local skip
+.if WATCH
+    pushf
+    test byte ptr [avr_WATCH], 2
+    jz skip
+    pusha
+    lea eax, reg
+    push 2
+    push eax
+    call avr_watch
+    add esp, 8
+    popa
+skip:
+    popf
+.endif
+.endm
+
+# sanitizer checks; these preserve all registers and flags
+.macro fault kind, addr
+    pushf
+    pusha
+    lea eax, addr
+    push eax
+    push kind
+    call avr_fault
+    add esp, 8
+    popa
+    popf
+.endm
+
+# check an I/O port (in the data address space) against the shadow memory
+.macro check_port addr
+local ok
+.if SANITIZE
+    test byte ptr [avr_SHADOW+addr], 2
+    jz ok
+    fault 3, [addr]
+ok:
+.endif
+.endm
+
+# check the stack pointer after a push of the given number of bytes, and mark them as written
+.macro check_push bytes, unless=
+local ok, bad, done
+.if SANITIZE
+    .ifnc <unless>, <>
+    unless done    # skip the check if the instruction did not push anything
+    .endif
+    pushf
+    push eax
+    movzx eax, word ptr [avr_SP]
+    cmp eax, RAMEND
+    ja bad
+    cmp ax, [avr_STACK_LIMIT]
+    jb bad
+    .rept bytes
+    or byte ptr [avr_SHADOW+eax+1], 1
+    inc eax
+    .endr
+    jmp ok
+bad:
+    fault 4, [eax]
+ok: pop eax
+    popf
+done:
+.endif
+.endm
+
+# check the stack pointer (the full register, before truncating it) after a pop
+.macro check_pop sp
+local ok
+.if SANITIZE
+    pushf
+    cmp sp, RAMEND
+    jbe ok
+    fault 5, [sp]
+ok: popf
+.endif
+.endm
+
+# write dl to the I/O register at avr_IO+port, leaving its previous value in dl (clobbers al)
+.macro io_write port
+local locked, done
+    cmp byte ptr [avr_ASYNC], 0
+    jne locked
+    mov al, [avr_IO+\port]
+    mov [avr_IO+\port], dl
+    mov dl, al
+    jmp done
+locked:
+    lock xchg [avr_IO+\port], dl
+done:
+.endm
+
+# the same for SBI/CBI: op (bts/btr) bit ecx of the I/O register at avr_IO+edx, leaving the old bit in CF
+# (clobbers eax, but clears all bits above al, so that setc makes it the old bit)
+.macro io_write_bit op
+local locked, done
+    cmp byte ptr [avr_ASYNC], 0
+    jne locked
+    movzx eax, byte ptr [avr_IO+edx]
+    \op eax, ecx
+    mov [avr_IO+edx], al
+    jmp done
+locked:
+    xor eax, eax
+    lock \op [avr_IO+edx], ecx
+done:
+.endm
+
 .macro iosignal dir, port
+    mov [avr_IO_PC], edi
     push ecx
     push edx
     lea eax, port
@@ -265,8 +587,65 @@ skip:
     pop ecx
 .endm
 
+# the normal core passes the call on to a copy assembled with SANITIZE or COVERAGE if the host asks for it
+.macro select_core entry
+    cmp byte ptr [avr_CHECKED], 1
+    je avr_\entry\()_checked
+    ja avr_\entry\()_coverage
+.endm
+
+# coverage: the edge of a branch, after "lea eax, [edi+edx]" and cl = taken
+.macro branch_edge
+.if COVERAGE
+    sub eax, edx                    # the address after the branch
+    mov dl, 4
+    shr dl, cl                      # 2 if taken, 4 if not
+    or [avr_COVER+eax-1], dl
+.endif
+.endm
+
+# skip the next instruction if cc holds (clobbers al and cl)
+.macro skip_if cc
+.if COVERAGE
+    set\cc cl
+    mov al, 4
+    shr al, cl
+    or [avr_COVER+edi-1], al
+    test cl, cl
+    jnz skipins
+.else
+    j\cc skipins
+.endif
+.endm
+
+# make sure avr_deadline's stub is entered once the limit of avr_run_until is passed
+.macro clamp_deadline
+    push eax
+    push edx
+    mov eax, [avr_LIMIT]
+    mov edx, [avr_LIMIT+4]
+    sub eax, [avr_cycle]
+    sbb edx, [avr_cycle+4]
+    jc 2f                           # already passed
+    jnz 1f                          # still far away
+    test eax, eax
+    js 1f
+    mov edx, [avr_DEADLINE]
+    sub edx, [avr_cycle]
+    cmp edx, eax
+    jle 1f
+2:  mov eax, [avr_LIMIT]
+    inc eax
+    mov [avr_DEADLINE], eax
+1:  pop edx
+    pop eax
+.endm
+
 .macro decode_next_instr service_ints=INTR
     and edi, FLASHEND
+.if COVERAGE
+    or byte ptr [avr_COVER+edi], 1
+.endif
     movzx eax, word ptr [avr_FLASH+edi*2]
 
     # begin decoding the r/d, so the pipeline has something to do while jumping
@@ -276,7 +655,7 @@ skip:
     lea ecx, [esi+0x10]
     shr edx, 4
     and edx, 0x1F
-    shr eax, 10
+    bt eax, 9
     cmovnc ecx, esi
 
 .if DEBUG
@@ -292,11 +671,13 @@ popa
     adc dword ptr [avr_cycle+4], 0
     inc edi
 .if service_ints
-    mov ebp, [avr_INTR]
-    jmp [decode_table+eax*4+ebp]
-.else
-    jmp [decode_table+eax*4]
+    mov ebp, [avr_cycle]
+    sub ebp, [avr_DEADLINE]
+    jns deadline
+    cmp byte ptr [avr_INT], 0       # rarely taken, so it predicts well
+    jne interrupt
 .endif
+    jmp [decode_table+eax*4]
 .endm
 
 .macro resume
@@ -314,12 +695,15 @@ popa
 
 .macro direct op, flags=, imm=, special=
     .ifc <imm>, <>
+    watchreg [edx]
     mov al, [avr_ADDR+ecx]
     op [avr_ADDR+edx], al
     .else
 	.ifc <imm>, <1>
+    watchreg [edx]
     op byte ptr [avr_ADDR+edx], imm
 	.else
+    watchreg [edx+16]
     op byte ptr [avr_ADDR+edx+16], imm
 	.endif
     .endif
@@ -331,7 +715,7 @@ popa
     .endif
     .else
     pop eax
-    and ebx, ~(flags)
+    and ebx, ~((flags)|SX)          # an instruction that changes N or V makes S N^V again
     .ifnc <special>, <shift>
     and eax, (flags)|RF  # make sure the 'reserved bit' is preserved
     or ebx, eax
@@ -349,13 +733,14 @@ popa
 .endm
 
 .macro direct1 op, flags=
+    watchreg [edx]
     op byte ptr [avr_ADDR+edx]
     pushf
     .ifc <flags>, <>
     pop ebx
     .else
     pop eax
-    and ebx, ~(flags)
+    and ebx, ~((flags)|SX)
     and eax,  (flags)|RF
     or ebx, eax
     .endif
@@ -376,11 +761,34 @@ avr_reset:
     mov [avr_cycle], eax
     mov [avr_cycle+4], eax
     mov [avr_last_wdr], eax
+    mov [avr_DEADLINE], eax
+    mov [avr_DEADLINE+4], eax
     mov word ptr [avr_SP], RAMEND
     ret
 
 .p2align 3
+avr_run_for:
+    mov eax, [esp+4]
+    xor edx, edx
+    add eax, [avr_cycle]
+    adc edx, [avr_cycle+4]
+    jmp run_limited
+.p2align 3
+avr_run_until:
+    mov eax, [esp+4]
+    mov edx, [esp+8]
+    jmp run_limited
+.p2align 3
 avr_run:
+    or eax, -1
+    or edx, -1
+run_limited:
+.if PRIMARY
+    select_core run_limited
+.endif
+    mov [avr_LIMIT], eax
+    mov [avr_LIMIT+4], edx
+    clamp_deadline
     push ebp
     push ebx
     push edi
@@ -397,9 +805,11 @@ fetch:
     decode_next_instr
 
 .p2align 3
-nop_movw_mul:
-    test cl, 0x10
-    jnz smult
+e_nop:
+    resume
+
+.p2align 3
+e_movw:
     and edx, 0xF
     mov cx, [avr_ADDR+ecx*2]
     mov [avr_ADDR+edx*2], cx
@@ -485,20 +895,26 @@ e_cpi:
     direct cmp, , cl
 
 .p2align 3
-e_sbrcs:
-    mov edx, [avr_ADDR+edx]
-    btr ecx, 4 # CF=0 <=> skip if clear
-    sbb eax, eax
-    xor edx, eax
+e_sbrc:
+    movzx edx, byte ptr [avr_ADDR+edx]
+    and ecx, 7
+    bt edx, ecx
+    skip_if nc
+    resume
+
+.p2align 3
+e_sbrs:
+    movzx edx, byte ptr [avr_ADDR+edx]
+    and ecx, 7
     bt edx, ecx
-    jnc skipins
+    skip_if c
     resume
 
 .p2align 3
 e_cpse:
     mov al, [avr_ADDR+edx]
     cmp al, [avr_ADDR+ecx]
-    je skipins
+    skip_if e
     resume
 skipins:
     mov esi, edi
@@ -521,35 +937,32 @@ skipins:
     adc dword ptr [avr_cycle+4], 0
     resume
 
-.p2align 3
-e_brbs:
-    avr_flags ebx
-    movzx edx, word ptr [avr_FLASH+(edi-1)*2]
+# a BRBS/BRBC for each flag, which only looks at that one
+.macro branch bit, set
+    mov edx, eax
     shl edx, 6+16
     sar edx, 9+16
-    and cl, 7
-    bt eax, ecx
+    test_flag \bit
     lea eax, [edi+edx]
+.if \set
     cmovc edi, eax
     setc cl
-    add [avr_cycle], ecx
-    adc dword ptr [avr_cycle+4], 0
-    resume
-
-.p2align 3
-e_brbc:
-    avr_flags ebx
-    movzx edx, word ptr [avr_FLASH+(edi-1)*2]
-    shl edx, 6+16
-    sar edx, 9+16
-    and cl, 7
-    bt eax, ecx
-    lea eax, [edi+edx]
+.else
     cmovnc edi, eax
     setnc cl
+.endif
+    branch_edge
     add [avr_cycle], ecx
     adc dword ptr [avr_cycle+4], 0
     resume
+.endm
+
+.irp bit, 0,1,2,3,4,5,6,7
+.p2align 3
+brbs_\bit: branch \bit, 1
+.p2align 3
+brbc_\bit: branch \bit, 0
+.endr
 
 .p2align 3
 rcall:
@@ -566,21 +979,17 @@ rcall:
     sub edx, 2
 .endif
     mov [avr_SP], dx
+    check_push 2-BIGPC
+    add dword ptr [avr_cycle], 1-BIGPC
+    adc dword ptr [avr_cycle+4], 0
 
 .p2align 3
 rjmp:
-    movzx edx, word ptr [avr_FLASH+(edi-1)*2]
+    mov edx, eax
     shl edx, 4+16
     sar edx, 4+16
     lea edi, [edi+edx]
-    shr eax, 3
-.if BIGPC
-    setc al
-    lea eax, [eax*2+1]
-    add dword ptr [avr_cycle], eax
-.else
-    adc dword ptr [avr_cycle], 1
-.endif
+    add dword ptr [avr_cycle], 1
     adc dword ptr [avr_cycle+4], 0
 .if ABORTDETECT
     cmp edx, -1
@@ -590,11 +999,8 @@ rjmp:
     resume
 
 .p2align 3
-e_bst_bld:
-    test cl, 0x10
-    jnz e_bst
 e_bld:
-    mov al, [avr_SREG]
+    movzx eax, byte ptr [avr_SREG]
     and cl, 7
     shr al, 6
     and al, 1
@@ -621,12 +1027,15 @@ e_bst:
 .p2align 3
 io_in1:
     avr_flags ebx      # might read sreg
+io_in_upper:           # IN of a port other than SREG
+    check_port [ecx+0x40]
     iosignal in, [ecx+0x20]
     mov al, [avr_IO+ecx+0x20]
     mov [avr_ADDR+edx], al
     resume
 .p2align 3
 io_in:
+    check_port [ecx+0x20]
     iosignal in, [ecx]
     mov al, [avr_IO+ecx]
     mov [avr_ADDR+edx], al
@@ -634,17 +1043,26 @@ io_in:
 
 .p2align 3
 io_out1:
+    check_port [ecx+0x40]
     avr_flags ebx      # might modify sreg
     mov dl, [avr_ADDR+edx]
-    lock xchg [avr_IO+ecx+0x20], dl
+    io_write ecx+0x20
     iosignal out, [ecx+0x20]
     mov al, [avr_SREG]
     load_flags ebx
     resume
 .p2align 3
+io_out_upper:
+    check_port [ecx+0x40]
+    mov dl, [avr_ADDR+edx]
+    io_write ecx+0x20
+    iosignal out, [ecx+0x20]
+    resume
+.p2align 3
 io_out:
+    check_port [ecx+0x20]
     mov dl, byte ptr [avr_ADDR+edx]
-    lock xchg [avr_IO+ecx], dl
+    io_write ecx
     iosignal out, [ecx]
     resume
 
@@ -652,47 +1070,49 @@ io_out:
 # 1001 1010 AAAA Abbb SBI
 # 1001 1001 AAAA Abbb SBIC
 # 1001 1011 AAAA Abbb SBIS
-.p2align 3
-io_bit:
-    btr ecx, 3
-    rcl edx, 1
-    btr edx, 5 # CF <-> skip-ins
-    jc io_bit_skip
+.macro io_port_bit
+    mov edx, eax
+    shr edx, 3
+    and edx, 0x1F
+    and ecx, 7
+.endm
+
+.macro io_bit_write op
     add dword ptr [avr_cycle], 1
     adc dword ptr [avr_cycle+4], 0
-    btr ecx, 4 # CF = set
-    jc 1f
-    lock btr [avr_IO+edx], ecx
-    setc al
-    push eax
-    push ecx
-    push edx
-    call avr_io_out_bit
-    add esp, 12
-    resume
-1:  lock bts [avr_IO+edx], ecx
+    io_port_bit
+    io_write_bit \op
     setc al
+    mov [avr_IO_PC], edi
     push eax
     push ecx
     push edx
     call avr_io_out_bit
     add esp, 12
     resume
+.endm
 
-io_bit_skip:
-    btr ecx, 4 # CF = skip if set
-    setc al
-    push eax
+.macro io_bit_skip cc
+    io_port_bit
+    mov [avr_IO_PC], edi
     push ecx
     push edx
     call avr_io_in_bit
     pop edx
     pop ecx
-    pop eax
     bt [avr_IO+edx], ecx
-    sbb al, 0  # ZF = condition matched
-    jz skipins
+    skip_if \cc
     resume
+.endm
+
+.p2align 3
+io_cbi:  io_bit_write btr
+.p2align 3
+io_sbi:  io_bit_write bts
+.p2align 3
+io_sbic: io_bit_skip nc
+.p2align 3
+io_sbis: io_bit_skip c
 
 /*
 
@@ -717,219 +1137,227 @@ io_bit_skip:
 
 1111 pop / push
 
-*/
+10q0 qqsd dddd yqqq LDD/STD
 
-# this code is optimized for the 'happy path' (ld/st)
-# with tweaks added to support lpm, lds and pop/push
-.p2align 3
-ld_st:
-    add dword ptr [avr_cycle], 1
-    adc dword ptr [avr_cycle+4], 0
-    mov eax, ecx
-    xor eax, 0xC
-    and eax, 0xF
-    shr eax, 3
-    jnbe e_lpm
-    adc eax, 0
-    # eax -> 0/1/2 = use X/Y/Z
-    lea eax, [X+eax*2]
-
-    # switch eax with immediate if LDS
-    mov esi, 0xF
-    and esi, ecx
-    .if PAR_LDS
-    lea esi, [avr_FLASH+edi*2]
-    cmovz eax, esi
-    lea esi, [edi+1]
-    cmovz edi, esi
-    .else
-    jnz 1f
-    lea eax, [avr_FLASH+edi*2]
-    inc edi
-1:
-    .endif
+*/
 
-    # test for push/pop - use SP instead of X/Y/Z
-    # this is a hack but saves jumps
-    # if push/pop: xx01 -> pre-incremented, xx10 -> post-decremented
-    inc word ptr [avr_SP]
-    lea esi, [ecx+1]
-    .if PAR_STK
-    mov ebp, esi
-    shr ebp, 4       # ebp: 10b if push, 01b if pop
-    lea ebp, [ecx+0x11+ebp]
-
-    test esi, 0xF    # switch esi/ecx if push/pop
-    lea esi, [avr_SP]
-    cmovz eax, esi
-    cmovz ecx, ebp
-    .else
-    test esi, 0xF
-    jnz 1f
-    mov ebp, esi
-    shr ebp, 4       # ebp: 10b if push, 01b if pop
-    lea ecx, [ecx+0x11+ebp]
-    lea eax, [avr_SP]
-1:
-    .endif
+# the end of every LD/ST: load the register at edx from (or store it at) the data address in esi
+.macro access store
+local mem, io
+    cmp esi, IOEND
+    jbe io
+mem:
+.if \store
+    stc
+.else
+    clc
+.endif
+    transfer edx, esi
+    resume
+io: cmp esi, 0x20
+    jb mem
+    lea ecx, [esi-0x40]
+.if \store
+    jmp io_out1
+.else
+    jmp io_in1
+.endif
+.endm
 
-    mov bp, [eax]
-    bt ecx, 1   # handle pre-decrement/post-increment here
-    sbb bp, 0
-    mov esi, ebp
-    bt ecx, 0
-    adc bp, 0
+# the address in the pointer register at preg -> esi; step is -1 to pre-decrement it,
+# 1 to post-increment it, and 0 to leave it alone
+.macro pointer preg, step
 .if RAMEND < 256
-    mov cx, bp
-    mov [eax], cl
-    and si, 0xFF
+    movzx esi, byte ptr [\preg]
+    .if \step < 0
+    dec esi
+    and esi, 0xFF
+    mov eax, esi
+    mov [\preg], al
+    .elseif \step > 0
+    lea eax, [esi+1]
+    mov [\preg], al
+    .endif
 .else
-    mov [eax], bp
+    movzx esi, word ptr [\preg]
+    .if \step < 0
+    dec si
+    mov [\preg], si
+    .elseif \step > 0
+    lea eax, [esi+1]
+    mov [\preg], ax
+    .endif
 .endif
+.endm
 
-    dec word ptr [avr_SP]  # final stacktweak
+.macro ld_st preg, step, store
+    add dword ptr [avr_cycle], 1
+    adc dword ptr [avr_cycle+4], 0
+    pointer \preg, \step
+    access \store
+.endm
 
-    # check if we may be accessing the I/O space
-    cmp esi, IOEND
-    jbe check_io
+.macro ldd preg, store
+    add dword ptr [avr_cycle], 1
+    adc dword ptr [avr_cycle+4], 0
+    mov esi, eax
+    shr esi, 7
+    mov ecx, esi
+    and esi, 0x18
+    shr ecx, 1
+    and ecx, 0x20
+    and eax, 7
+    or esi, ecx
+    or esi, eax
+    movzx eax, word ptr [\preg]
+    add esi, eax
+    access \store
+.endm
 
-    # if CF, store, otherwise, load
-1:  bt ecx, 4
-    transfer edx, esi
-    resume
+# every addressing mode gets a handler of its own, for loads (_0) and stores (_1)
+.irp store, 0,1
+.p2align 3
+ld_x_\store:  ld_st X, 0, \store
+.p2align 3
+ld_xp_\store: ld_st X, 1, \store
+.p2align 3
+ld_mx_\store: ld_st X, -1, \store
+.p2align 3
+ld_yp_\store: ld_st Y, 1, \store
+.p2align 3
+ld_my_\store: ld_st Y, -1, \store
+.p2align 3
+ld_zp_\store: ld_st Z, 1, \store
+.p2align 3
+ld_mz_\store: ld_st Z, -1, \store
 
-check_io:
-    cmp esi, 0x20
-    jb 1b
-    bt ecx, 4
-    lea ecx, [esi-0x40]
-    jc io_out1
-    jmp io_in1
+# 10q0 qqsd dddd yqqq: q is gathered from bits 0-2, 10-11 and 13
+.p2align 3
+ldd_y_\store: ldd Y, \store
+.p2align 3
+ldd_z_\store: ldd Z, \store
+
+.p2align 3
+lds_\store:
+    add dword ptr [avr_cycle], 1
+    adc dword ptr [avr_cycle+4], 0
+    movzx esi, word ptr [avr_FLASH+edi*2]
+    inc edi
+    access \store
+.endr
 
-# TODO: only (E)LPM and (E)LPM+  implemented yet
-e_lpm:
-    test ecx, 0x10
-    jnz e_xch_la
+.p2align 3
+e_push:
     add dword ptr [avr_cycle], 1
     adc dword ptr [avr_cycle+4], 0
+    pointer avr_SP, 0
+    lea eax, [esi-1]
+.if RAMEND < 256
+    mov [avr_SP], al
+.else
+    mov [avr_SP], ax
+.endif
+    check_push 0
+    access 1
+
+.p2align 3
+e_pop:
+    add dword ptr [avr_cycle], 1
+    adc dword ptr [avr_cycle+4], 0
+    pointer avr_SP, 0
+.if RAMEND < 256
+    inc esi
+    and esi, 0xFF
+    mov eax, esi
+    mov [avr_SP], al
+.else
+    inc si
+    mov [avr_SP], si
+.endif
+    check_pop esi
+    access 0
+
+# (E)LPM Rd, Z(+); the forms without operands load r0
+.macro lpm ext, step
+    add dword ptr [avr_cycle], 2
+    adc dword ptr [avr_cycle+4], 0
     movzx esi, word ptr [Z]
-.if BIGPC
-    mov al, [RAMPZ]
+.if \ext && BIGPC
+    movzx eax, byte ptr [RAMPZ]
     shl eax, 16
-    or eax, esi
-    test ecx, 2
-    cmovnz esi, eax
+    or esi, eax
 .endif
     #and esi, (FLASHEND<<1)+1   # unsure if (E)LPM should exhibit wrap-around behaviour
-    mov al, [avr_FLASH+esi]
-    bt ecx, 0
-    adc esi, 0
+    mov cl, [avr_FLASH+esi]
+.if \step
+    inc esi
     mov [Z], si
-.if BIGPC
-    test ecx, 2
-    mov ecx, esi
-    cmovz ecx, eax
-    shr ecx, 16
-    mov [RAMPZ], cl
+    .if \ext && BIGPC
+    shr esi, 16
+    mov eax, esi
+    mov [RAMPZ], al
+    .endif
 .endif
-    mov [avr_ADDR+edx], al
+    mov [avr_ADDR+edx], cl
     resume
+.endm
+
+.p2align 3
+lpm_r0:
+    xor edx, edx
+lpm_z:   lpm 0, 0
+.p2align 3
+lpm_zp:  lpm 0, 1
+.p2align 3
+elpm_r0:
+    xor edx, edx
+elpm_z:  lpm 1, 0
+.p2align 3
+elpm_zp: lpm 1, 1
 
 # these instructions are probably geared towards a multicore AVR,
-# but it won't hurt to have them.
-e_xch_la:
-    movzx esi, word ptr [Z]
-    mov ah, [avr_ADDR+esi]
-    mov al, [avr_ADDR+edx]
-    mov [avr_ADDR+edx], ah
-    and ecx, 3
-    mov edx, eax
-    mov dl, dh
-    not al
-    and dl, al
-    not al
-    mov ebp, edx
-    or dl, al
-    xor dh, al
-    # dl=las, dh=lat, bp=lac
-    # Z&NC -> xch, Z&C->las, NZ&NC->lac, NZ&C->lat
-    shr ecx, 1
-    cmovc eax, edx
-    mov dl, dh
-    cmovnc edx, ebp
-    cmovnz eax, edx
-    mov [avr_ADDR+esi], al
-    add dword ptr [avr_cycle], 1
+# but it won't hurt to have them. Rd gets the old contents of (Z) in any case
+.macro xch_la op=, invert=0
+    add dword ptr [avr_cycle], 2
     adc dword ptr [avr_cycle+4], 0
+    movzx esi, word ptr [Z]
+    mov al, [avr_ADDR+esi]
+    mov cl, [avr_ADDR+edx]
+    mov [avr_ADDR+edx], al
+.if \invert
+    not cl
+.endif
+.ifnc <op>, <>
+    \op cl, al
+.endif
+    mov [avr_ADDR+esi], cl
+.if SANITIZE
+    or byte ptr [avr_SHADOW+esi], 1
+.endif
     resume
+.endm
 
-/*
-sd dddd 0000 LDS
-sd dddd 0001 ld Z+
-sd dddd 0010 ld -Z
-????????????????????
-
-sd dddd 0100 lpm Z / xch Z
-sd dddd 0101 lpm Z+ / las Z
-sd dddd 0110 elpm Z / lac Z
-sd dddd 0111 elpm Z+ / lat Z
-
-??????????????????
-sd dddd 1001 ld Y+
-sd dddd 1010 ld -Y
-??????????????????
-
-sd dddd 1100 ld X
-sd dddd 1101 ld X+
-sd dddd 1110 ld -X
-sd dddd 1111 pop/push
-
-*/
-
-#------------------
 .p2align 3
-ldd_std:
-    add dword ptr [avr_cycle], 1
-    adc dword ptr [avr_cycle+4], 0
-    mov esi, eax
-    and eax, 0xF
-    and esi, 0x3
-    add esi, eax
-    btr ecx, 3
-    setnc al
-    mov ax, [Y+eax*2]
-    btr ecx, 4
-    lea eax, [ecx+eax]
-    lea esi, [esi*4+eax]
-    # eax = use Z?
-    # edx = reg
-    # esi = index
-
-    # check if we may be accessing io (without altering cf)
-    lea ecx, [esi-IOEND]
-    dec ecx
-    js check_io_2
-
-1:  transfer edx, esi
-    resume
-
-check_io_2:
-    lea ecx, [esi-0x1F]
-    dec ecx
-    js 1b
-    lea ecx, [ecx-0x20]
-    jc io_out1
-    jmp io_in1
+e_xch: xch_la
+.p2align 3
+e_las: xch_la or
+.p2align 3
+e_lac: xch_la and, 1
+.p2align 3
+e_lat: xch_la xor
 
 .p2align 3
 umult:
     mov al, [avr_ADDR+edx]
     mul byte ptr [avr_ADDR+ecx]
-1:  test ax, ax
+mul_flags:
+    test ax, ax
     sets cl
-2:  mov [avr_ADDR], ax
+mul_store:                          # ZF and cl = C are set from the result in ax
+    mov [avr_ADDR], ax
     setz al
     shl al, 6
+    or al, RF
     and bl, ~(ZF+CF)
     or bl, cl
     or bl, al
@@ -937,157 +1365,127 @@ umult:
     adc dword ptr [avr_cycle+4], 0
     resume
 
+# 0000 0010 dddd rrrr - MULS
 .p2align 3
-smult:
-    test dl, 0x10
-    jnz exotic_mult
-    and ecx, 0xF
+e_muls:
     mov al, [avr_ADDR+edx+16]
-    imul byte ptr [avr_ADDR+ecx+16]
-    jmp 1b
-
-/* 0ddd 0rrr - MULSU
-   0ddd 1rrr - FMUL
-   1ddd 0rrr - FMULS
-   1ddd 1rrr - FMULSU */
-exotic_mult:
-    mov al, dl
-    xor al, cl
-    shl al, 5   # CF set -> FMUL(S), otherwise (F)MULSU
-    jc fmul
-    and cl, 0x7
-    and dl, 0xF
-    btr edx, 3  # CF set -> FMULSU, otherwise MULSU
+    imul byte ptr [avr_ADDR+ecx]
+    jmp mul_flags
+
+/* 0000 0011 0ddd 0rrr - MULSU
+   0000 0011 0ddd 1rrr - FMUL
+   0000 0011 1ddd 0rrr - FMULS
+   0000 0011 1ddd 1rrr - FMULSU */
+.p2align 3
+e_mulsu:
+    and ecx, 7
+    and edx, 7
     mov al, [avr_ADDR+edx+16]
-    mov dl, [avr_ADDR+ecx+16]
-    setc cl
+    movzx edx, byte ptr [avr_ADDR+ecx+16]
     cbw
     imul dx
-    test ax, ax   # probe ax for ZF
-    mov dx, ax
-    rol dx, 1     # probe ax for CF (for MULSU)
-    shl ax, cl    # otherwise use the result of shl (won't affect flags if cl=0)
-    setc cl
-    jmp 2b
+    jmp mul_flags
 
-# SF=c | ~       (mulsu | fmulsu)
-# CF=0 | c
+.p2align 3
+e_fmulsu:
+    and ecx, 7
+    and edx, 7
+    mov al, [avr_ADDR+edx+16]
+    movzx edx, byte ptr [avr_ADDR+ecx+16]
+    cbw
+    imul dx
+    shl ax, 1
+    setc cl
+    jmp mul_store
 
-fmul:
-    test cl, 0x8
-    jz fmuls
-    and cl, 0x7
-    and dl, 0x7
+.p2align 3
+e_fmul:
+    and ecx, 7
+    and edx, 7
     mov al, [avr_ADDR+ecx+16]
     mul byte ptr [avr_ADDR+edx+16]
     shl ax, 1
     setc cl
-    jmp 2b
+    jmp mul_store
 
-fmuls:
-    and cl, 0x7
-    and dl, 0x7
+.p2align 3
+e_fmuls:
+    and ecx, 7
+    and edx, 7
     mov al, [avr_ADDR+ecx+16]
     imul byte ptr [avr_ADDR+edx+16]
     shl ax, 1
     setc cl
-    jmp 2b
+    jmp mul_store
 
 /*
-0ddddd0??? -> 1 operand
-00Bbbb1000 -> SEx/CLx
-01????1000 -> MISC
-0c000?1001 -> indirect jumps
-0ddddd1010 -> decrement rd
-00kkkk1011 -> DES
-0kkkkk11ck -> abs jumps
-1sKKddKKKK -> adiw/sbiw
+1001 010d dddd 0??? -> 1 operand
+1001 0100 Bbbb 1000 -> SEx/CLx
+1001 0101 ???? 1000 -> MISC
+1001 010c 000e 1001 -> indirect jumps
+1001 010d dddd 1010 -> decrement rd
+1001 0100 kkkk 1011 -> DES
+1001 010k kkkk 11ck -> abs jumps
+1001 011s KKdd KKKK -> adiw/sbiw
 */
-.p2align 3
-e_1op_misc:
-    mov eax, ecx
-    and eax, 0xF
-    btr ecx, 4
-    jc e_sbiw_adiw
-    jmp [subdecode_table+eax*4]
 
-# this is a bit painful to write without using any further conditional jumps
-e_sbiw_adiw:
+.macro adiw_sbiw op, pair
     add dword ptr [avr_cycle], 1
     adc dword ptr [avr_cycle+4], 0
-    mov eax, edx
-    and eax, 0xC
-    and edx, 0x13
-    lea ecx, [eax*4+ecx]
-    btr edx, 4           # CF set -> sbiw instruction
-    mov si, [avr_ADDR+edx*2+24]
-.if PAR_SBIW
-    setc al
-    sub si, cx
-    pushf
-    add cx, [avr_ADDR+edx*2+24]
-    pushf
-    test eax, eax
-    mov eax, [esp+eax*4] # load the appropriate flags in eax
-    cmovnz ecx, esi      # and the appropriate result in ecx
-    mov [avr_ADDR+edx*2+24], cx
-    add esp, 8
-    and ebx, ~(SF+OF+ZF+CF)
-    and eax, SF+OF+ZF+CF+RF
-    or ebx, eax
-    resume
-.else
-    jc 1f
-    add si, cx
-    mov [avr_ADDR+edx*2+24], si
+    mov esi, eax
+    shr esi, 2
+    and esi, 0x30
+    and ecx, 0xF
+    or ecx, esi
+    \op word ptr [avr_ADDR+24+2*\pair], cx
     pushf
     pop eax
-    and ebx, ~(SF+OF+ZF+CF)
+    and ebx, ~(SF+OF+ZF+CF+SX)
     and eax, SF+OF+ZF+CF+RF
     or ebx, eax
     resume
-1:  sub si, cx
-    mov [avr_ADDR+edx*2+24], si
-    pushf
-    pop eax
-    and ebx, ~(SF+OF+ZF+CF)
-    and eax, SF+OF+ZF+CF+RF
-    or ebx, eax
+.endm
+
+.irp pair, 0,1,2,3
+.p2align 3
+adiw_\pair: adiw_sbiw add, \pair
+.p2align 3
+sbiw_\pair: adiw_sbiw sub, \pair
+.endr
+
+# the I and T flags are not kept in ebx
+.irp bit, 6,7
+.p2align 3
+bset_\bit:
+    or byte ptr [avr_SREG], 1<<\bit
     resume
-.endif
+.p2align 3
+bclr_\bit:
+    and byte ptr [avr_SREG], ~(1<<\bit)
+    resume
+.endr
 
+.irp bit, 0,1,2,3,4,5
 .p2align 3
-f_flag_misc:
+bset_\bit:
     avr_flags ebx
-    btr edx, 4
-    jc f_ret
-f_set_clr:
-    mov ecx, edx
-    xor edx, edx
-    btr ecx, 3 # if CF, clear, otherwise set flag
-    adc edx, 0x100
-    shl edx, cl
-    not dl
-    or al, dh  # al contains avr_SREG
-    and al, dl
+    or al, 1<<\bit
     mov [avr_SREG], al
     load_flags ebx
     resume
-
 .p2align 3
-f_ret:
-# 0000  -> ret
-# 0001  -> reti
-# 1000  -> sleep
-# 1001  -> break
-# 1010  -> wdr
-# 11s0  -> lpm/spm implied r0 freak instruction
-# 11s1  -> elpm/spm z+ implied r0 freak instruction
-    btr edx, 3
-    jc f_misc
+bclr_\bit:
+    avr_flags ebx
+    and al, ~(1<<\bit)
+    mov [avr_SREG], al
+    load_flags ebx
+    resume
+.endr
 
-    shl dl, 7
-    or [avr_SREG], dl    # set the IF in SREG if RETI
+.macro return reti
+.if \reti
+    or byte ptr [avr_SREG], 0x80
+.endif
     movzx eax, word ptr [avr_SP]
 # if avr_SP wraps around (undefined behaviour), reads portion of avr_FLASH
 .if BIGPC
@@ -1099,45 +1497,46 @@ f_ret:
     rol di, 8
     add eax, 2
 .endif
+    check_pop eax
     mov [avr_SP], ax
 
     add dword ptr [avr_cycle], 3-BIGPC
     adc dword ptr [avr_cycle+4], 0
     resume
+.endm
 
 .p2align 3
-f_misc:
+e_ret:  return 0
+.p2align 3
+e_reti: return 1
+
 # treat sleep/break and wdr as exit conditions; let the caller decide what to do
-# 000  -> sleep
-# 001  -> break
-# 010  -> wdr
-    test edx, 0x4
-    jnz f_lpm_spm_r0
-    mov esi, edx
-    inc esi
-    jnp exit
+.p2align 3
+e_sleep:
+    mov esi, 1
+    jmp exit
+.p2align 3
+e_break:
+    mov esi, 2
+    jmp exit
 
+.p2align 3
+e_wdr:
     # watchdog reset
     mov eax, [avr_cycle]
     mov [avr_last_wdr], eax
     resume
 
-.p2align 3
-f_lpm_spm_r0:
+.macro spm step
     add dword ptr [avr_cycle], 1
     adc dword ptr [avr_cycle+4], 0
-    lea ecx, [edx*2-4] # 100->100, 101->110, so (e)lpm->(e)lpm r0
-    xor edx, edx
-    cmp ecx, 0x8
-    jb e_lpm
-    # zf clear -> post-incremented spm
-
     movzx esi, word ptr [Z]
+.if \step
     lea ecx, [esi+1]
-    cmovz ecx, esi
     mov [Z], cx
+.endif
 .if BIGPC
-    mov al, [RAMPZ]
+    movzx eax, byte ptr [RAMPZ]
     shl eax, 16
     or esi, eax
 .endif
@@ -1147,6 +1546,12 @@ f_lpm_spm_r0:
     call avr_self_program
     add esp, 8
     resume
+.endm
+
+.p2align 3
+e_spm:    spm 0
+.p2align 3
+e_spm_zp: spm 1
 
 .p2align 3
 f_com:
@@ -1192,100 +1597,90 @@ f_inc:
 f_dec:
     direct1 dec, OF+SF+ZF
 
-# 0c 000e eicall
-.p2align 3
-f_ind_jump:
+# push the return address in edi (clobbers eax and ecx)
+.macro push_pc
     movzx eax, word ptr [avr_SP]
+    mov ecx, edi
 .if BIGPC
-    bswap edi
-    bt edx, 4    # if icall, modify stack
-    mov ecx, [avr_ADDR+eax-3]
-    cmovc ecx, edi
-    mov cl, [avr_ADDR+eax-3]
+    bswap ecx
+    mov cl, [avr_ADDR+eax-3]   # keep the byte at SP
     mov [avr_ADDR+eax-3], ecx
-
-    xor edi, edi
-    mov cl, [EIND]
-    shl ecx, 16
-    test edx, 1
-    cmovnz edi, ecx
-    lea edx, [edx*2+edx] # make sure 3 bytes are subtracted in EICALL
-    shr edx, 4
+    sub eax, 3
 .else
-    rol di, 8
-    bt edx, 4    # if icall, modify stack
-    mov si, [avr_ADDR+eax-1]
-    cmovc esi, edi
-    mov [avr_ADDR+eax-1], si
-    shr edx, 3
+    rol cx, 8
+    mov [avr_ADDR+eax-1], cx
+    sub eax, 2
 .endif
-    sub eax, edx
     mov [avr_SP], ax
+    check_push 2-BIGPC
+.endm
 
-.if BIGPC
-    mov di, word ptr [Z]
-    or edx, 1
-    add dword ptr [avr_cycle], edx
-.else
+# 1001 010c 000e 1001: (E)IJMP/(E)ICALL
+.macro ind_jump link, ext
+.if \link
+    push_pc
+.endif
     movzx edi, word ptr [Z]
-    shr edx, 2
-    adc dword ptr [avr_cycle], 1
+.if \ext && BIGPC
+    movzx eax, byte ptr [EIND]
+    shl eax, 16
+    or edi, eax
 .endif
+    add dword ptr [avr_cycle], 1+\link*(1-BIGPC)
     adc dword ptr [avr_cycle+4], 0
     resume
+.endm
 
+.p2align 3
+e_ijmp:   ind_jump 0, 0
+.p2align 3
+e_eijmp:  ind_jump 0, 1
+.p2align 3
+e_icall:  ind_jump 1, 0
+.p2align 3
+e_eicall: ind_jump 1, 1
 
 /* XFR: 1001 010k kkkk 11ck */
-.p2align 3
-f_abs_jump:
-    movzx eax, word ptr [avr_SP]
+.macro abs_jump link
     shr ecx, 1
     rcl edx, 1
     shl edx, 16
     mov dx, [avr_FLASH+edi*2]
     inc edi
-.if BIGPC
-    bswap edi
-.else
-    rol di, 8
+.if \link
+    push_pc
 .endif
-
-    shr ecx, 1
-.if BIGPC
-    mov ecx, [avr_ADDR+eax-3]
-    cmovc ecx, edi
-    mov cl, [avr_ADDR+eax-3]
-    mov [avr_ADDR+eax-3], ecx
-.else
-    mov si, [avr_ADDR+eax-1]
-    cmovc esi, edi
-    mov [avr_ADDR+eax-1], si
-.endif
-    lea esi, [eax-2+BIGPC]
-    cmovc eax, esi
-    mov [avr_SP], ax
-
     mov edi, edx
-.if BIGPC
-    mov al, -1
-    adc al, 0
-    adc al, 3
-    movzx eax, al
-    add dword ptr [avr_cycle], eax
-.else
-    adc dword ptr [avr_cycle], 2
-.endif
+    add dword ptr [avr_cycle], 2+\link*(1-BIGPC)
     adc dword ptr [avr_cycle+4], 0
     resume
+.endm
+
+.p2align 3
+e_jmp:  abs_jump 0
+.p2align 3
+e_call: abs_jump 1
 
 .if INTR
 .p2align 3
 interrupt:
     xor esi, esi
     cmp [avr_PC], esi               # were we in single-step mode?
-    jl redo_exit
-    btr dword ptr [avr_SREG], 7     # if IF is clear, ignore the interrupt
+    jl step_exit
+    cmp [avr_HALT], esi             # did the host ask us to stop?
+    jne halt_exit
+    cmp [avr_MAIL], esi             # has anyone posted changes to the I/O registers?
+    jne mail
+requests:
+    bsf ebp, dword ptr [avr_IRQ]    # find the pending request with the highest priority
+    jnz 1f
+    bsf ebp, dword ptr [avr_IRQ+4]
+    jz spurious                     # nothing pending at all
+    add ebp, 32
+1:  btr dword ptr [avr_SREG], 7     # if IF is clear, ignore the interrupt, unless it is a reset
     jc 1f
+    test ebp, ebp
+    jz 1f
     jmp [decode_table+eax*4]
 1:  add dword ptr [avr_cycle], 3-BIGPC
     adc dword ptr [avr_cycle+4], 0
@@ -1304,7 +1699,72 @@ interrupt:
     sub edx, 2
 .endif
     mov [avr_SP], dx
-    jmp exit
+    check_push 2-BIGPC
+    test ebp, ebp                   # a reset is left to the host
+    jz exit
+    pusha
+    push ebp
+    call avr_interrupt
+    add esp, 4
+    popa
+    lea edi, [ebp+ebp]              # vectors are two words apart
+    mov ebp, [avr_IRQ]              # anything left over will be taken as soon as IF is set
+    or ebp, [avr_IRQ+4]
+    or ebp, [avr_MAIL]
+    or ebp, [avr_HALT]              # a stop asked for since the check above
+    jz 1f
+    mov byte ptr [avr_INT], 1
+1:  resume
+
+spurious:
+    xchg [avr_INTR], esi            # (a locked operation) clear the request, then check again
+    mov ebp, [avr_IRQ]
+    or ebp, [avr_IRQ+4]
+    or ebp, [avr_MAIL]
+    or ebp, [avr_HALT]
+    jz 1f
+    mov byte ptr [avr_INT], 1
+    jmp interrupt
+1:  jmp [decode_table+eax*4]
+
+mail:
+    xchg [avr_MAIL], esi            # (a locked operation) anything posted after this comes with a new request
+    xor esi, esi
+    pusha
+    call avr_mail
+    popa
+    jmp requests
+
+halt_exit:
+    mov esi, 4
+step_exit:                          # requests that are still pending are taken by the next run
+    xor ebp, ebp
+    mov [avr_INTR], ebp
+    mov ebp, [avr_IRQ]
+    or ebp, [avr_IRQ+4]
+    or ebp, [avr_MAIL]
+    jz undo_fetch
+    mov byte ptr [avr_INT], 1
+    jmp undo_fetch
+
+.p2align 3
+deadline:
+    mov ebp, [avr_LIMIT]            # has the cycle budget run out?
+    cmp ebp, [avr_cycle]
+    mov ebp, [avr_LIMIT+4]
+    sbb ebp, [avr_cycle+4]
+    jc limit_exit
+    pusha
+    call avr_deadline
+    popa
+    clamp_deadline
+    cmp byte ptr [avr_INT], 0
+    jne interrupt
+    jmp [decode_table+eax*4]
+
+limit_exit:
+    mov esi, 5
+    jmp undo_fetch
 .endif
 
 .p2align 3
@@ -1328,12 +1788,13 @@ unhandled:
 
 .p2align 3
 redo_exit:
+    mov [avr_INTR], esi
+undo_fetch:
     sub dword ptr [avr_cycle], 1
     sbb dword ptr [avr_cycle+4], 0
     dec edi
-    mov [avr_INTR], esi
 
-# return status: 0 = interrupted, 1 = sleep, 2 = break, 3 = rjmp -1, else: unhandled
+# return status: 0 = interrupted, 1 = sleep, 2 = break, 3 = rjmp -1, 4 = halted, 5 = cycle limit, else: unhandled
 exit:
     # wrap-up
     avr_flags ebx
@@ -1348,6 +1809,11 @@ exit:
 .if INTR
 .p2align 3
 avr_step:
+.if PRIMARY
+    select_core step
+.endif
+    or dword ptr [avr_LIMIT], -1
+    or dword ptr [avr_LIMIT+4], -1
     push ebp
     push ebx
     push edi
@@ -1383,99 +1849,267 @@ avr_io_out_bit:
 avr_self_program:
 avr_des_round:
     jmp abort
+.p2align 3
+avr_deadline:
+    mov eax, [avr_cycle]
+    add eax, 1<<30
+    mov [avr_DEADLINE], eax
+    ret
+.p2align 3
+avr_interrupt:
+    mov eax, [esp+4]
+    lock btr dword ptr [avr_IRQ], eax
+    ret
+.p2align 3
+avr_mail:
+    ret
+.p2align 3
+avr_watch:
+avr_fault:
+    ret
 
 .data
 
+# an entry for every opcode, pointing to a handler for its exact form (reserved opcodes are
+# unhandled)
+
+.macro handler name, n
+    .long \name\n
+.endm
+
 .p2align 2
 decode_table:
-/* 0000 00 */ .long nop_movw_mul
-/* 0000 01 */ .long e_cpc
-/* 0000 10 */ .long e_sbc
-/* 0000 11 */ .long e_add
-/* 0001 00 */ .long e_cpse
-/* 0001 01 */ .long e_cp
-/* 0001 10 */ .long e_sub
-/* 0001 11 */ .long e_adc
-/* 0010 00 */ .long e_and
-/* 0010 01 */ .long e_eor
-/* 0010 10 */ .long e_or
-/* 0010 11 */ .long e_mov
-/* 0011 00 */ .long e_cpi
-/* 0011 01 */ .long e_cpi
-/* 0011 10 */ .long e_cpi
-/* 0011 11 */ .long e_cpi
-/* 0100 00 */ .long e_sbci
-/* 0100 01 */ .long e_sbci
-/* 0100 10 */ .long e_sbci
-/* 0100 11 */ .long e_sbci
-/* 0101 00 */ .long e_subi
-/* 0101 01 */ .long e_subi
-/* 0101 10 */ .long e_subi
-/* 0101 11 */ .long e_subi
-/* 0110 00 */ .long e_ori
-/* 0110 01 */ .long e_ori
-/* 0110 10 */ .long e_ori
-/* 0110 11 */ .long e_ori
-/* 0111 00 */ .long e_andi
-/* 0111 01 */ .long e_andi
-/* 0111 10 */ .long e_andi
-/* 0111 11 */ .long e_andi
-/* 1000 00 */ .long ldd_std
-/* 1000 01 */ .long ldd_std
-/* 1000 10 */ .long ldd_std
-/* 1000 11 */ .long ldd_std
-/* 1001 00 */ .long ld_st
-/* 1001 01 */ .long e_1op_misc
-/* 1001 10 */ .long io_bit
-/* 1001 11 */ .long umult
-/* 1010 00 */ .long ldd_std
-/* 1010 01 */ .long ldd_std
-/* 1010 10 */ .long ldd_std
-/* 1010 11 */ .long ldd_std
-/* 1011 00 */ .long io_in
-/* 1011 01 */ .long io_in1
-/* 1011 10 */ .long io_out
-/* 1011 11 */ .long io_out1
-/* 1100 00 */ .long rjmp
-/* 1100 01 */ .long rjmp
-/* 1100 10 */ .long rjmp
-/* 1100 11 */ .long rjmp
-/* 1101 00 */ .long rcall
-/* 1101 01 */ .long rcall
-/* 1101 10 */ .long rcall
-/* 1101 11 */ .long rcall
-/* 1110 00 */ .long e_ldi
-/* 1110 01 */ .long e_ldi
-/* 1110 10 */ .long e_ldi
-/* 1110 11 */ .long e_ldi
-/* 1111 00 */ .long e_brbs
-/* 1111 01 */ .long e_brbc
-/* 1111 10 */ .long e_bst_bld
-/* 1111 11 */ .long e_sbrcs
-.rept INTR*64
-/* INT     */ .long interrupt
+opc = 0
+.rept 0x10000
+hi  = opc >> 12
+mid = (opc >> 10) & 3
+s   = (opc >> 9) & 1            # store, or another variant
+.if hi == 0x0
+    .if mid == 1
+    .long e_cpc
+    .elseif mid == 2
+    .long e_sbc
+    .elseif mid == 3
+    .long e_add
+    .elseif opc == 0
+    .long e_nop
+    .elseif opc < 0x100
+    .long unhandled
+    .elseif opc < 0x200
+    .long e_movw
+    .elseif opc < 0x300
+    .long e_muls
+    .elseif (opc & 0x88) == 0
+    .long e_mulsu
+    .elseif (opc & 0x88) == 0x08
+    .long e_fmul
+    .elseif (opc & 0x88) == 0x80
+    .long e_fmuls
+    .else
+    .long e_fmulsu
+    .endif
+.elseif hi == 0x1
+    .if mid == 0
+    .long e_cpse
+    .elseif mid == 1
+    .long e_cp
+    .elseif mid == 2
+    .long e_sub
+    .else
+    .long e_adc
+    .endif
+.elseif hi == 0x2
+    .if mid == 0
+    .long e_and
+    .elseif mid == 1
+    .long e_eor
+    .elseif mid == 2
+    .long e_or
+    .else
+    .long e_mov
+    .endif
+.elseif hi == 0x3
+    .long e_cpi
+.elseif hi == 0x4
+    .long e_sbci
+.elseif hi == 0x5
+    .long e_subi
+.elseif hi == 0x6
+    .long e_ori
+.elseif hi == 0x7
+    .long e_andi
+.elseif (hi & 0xD) == 0x8
+    .if opc & 8
+    handler ldd_y_, %s
+    .else
+    handler ldd_z_, %s
+    .endif
+.elseif hi == 0x9 && mid == 0
+    x = opc & 0xF
+    .if x == 0x0
+    handler lds_, %s
+    .elseif x == 0x1
+    handler ld_zp_, %s
+    .elseif x == 0x2
+    handler ld_mz_, %s
+    .elseif x == 0x9
+    handler ld_yp_, %s
+    .elseif x == 0xA
+    handler ld_my_, %s
+    .elseif x == 0xC
+    handler ld_x_, %s
+    .elseif x == 0xD
+    handler ld_xp_, %s
+    .elseif x == 0xE
+    handler ld_mx_, %s
+    .elseif s && x == 0x4
+    .long e_xch
+    .elseif s && x == 0x5
+    .long e_las
+    .elseif s && x == 0x6
+    .long e_lac
+    .elseif s && x == 0x7
+    .long e_lat
+    .elseif s && x == 0xF
+    .long e_push
+    .elseif x == 0x4
+    .long lpm_z
+    .elseif x == 0x5
+    .long lpm_zp
+    .elseif x == 0x6
+    .long elpm_z
+    .elseif x == 0x7
+    .long elpm_zp
+    .elseif x == 0xF
+    .long e_pop
+    .else
+    .long unhandled
+    .endif
+.elseif hi == 0x9 && mid == 1 && s
+    .if opc & 0x100
+    handler sbiw_, %((opc >> 4) & 3)
+    .else
+    handler adiw_, %((opc >> 4) & 3)
+    .endif
+.elseif hi == 0x9 && mid == 1
+    x = opc & 0xF
+    .if x == 0x0
+    .long f_com
+    .elseif x == 0x1
+    .long f_neg
+    .elseif x == 0x2
+    .long f_swap
+    .elseif x == 0x3
+    .long f_inc
+    .elseif x == 0x5
+    .long f_asr
+    .elseif x == 0x6
+    .long f_lsr
+    .elseif x == 0x7
+    .long f_ror
+    .elseif x == 0xA
+    .long f_dec
+    .elseif x >= 0xC && x <= 0xD
+    .long e_jmp
+    .elseif x >= 0xE
+    .long e_call
+    .elseif x == 0xB && (opc & 0x100) == 0
+    .long f_des
+    .elseif x == 0x8 && (opc & 0x180) == 0
+    handler bset_, %((opc >> 4) & 7)
+    .elseif x == 0x8 && (opc & 0x180) == 0x80
+    handler bclr_, %((opc >> 4) & 7)
+    .elseif opc == 0x9508
+    .long e_ret
+    .elseif opc == 0x9518
+    .long e_reti
+    .elseif opc == 0x9588
+    .long e_sleep
+    .elseif opc == 0x9598
+    .long e_break
+    .elseif opc == 0x95A8
+    .long e_wdr
+    .elseif opc == 0x95C8
+    .long lpm_r0
+    .elseif opc == 0x95D8
+    .long elpm_r0
+    .elseif opc == 0x95E8
+    .long e_spm
+    .elseif opc == 0x95F8
+    .long e_spm_zp
+    .elseif opc == 0x9409
+    .long e_ijmp
+    .elseif opc == 0x9419
+    .long e_eijmp
+    .elseif opc == 0x9509
+    .long e_icall
+    .elseif opc == 0x9519
+    .long e_eicall
+    .else
+    .long unhandled
+    .endif
+.elseif hi == 0x9 && mid == 2
+    x = (opc >> 8) & 3
+    .if x == 0
+    .long io_cbi
+    .elseif x == 1
+    .long io_sbic
+    .elseif x == 2
+    .long io_sbi
+    .else
+    .long io_sbis
+    .endif
+.elseif hi == 0x9
+    .long umult
+.elseif hi == 0xB
+    .if (opc & 0x400) == 0 && (opc & 0x800) == 0
+    .long io_in
+    .elseif (opc & 0x400) == 0
+    .long io_out
+    .elseif (opc & 0x60F) == 0x60F && (opc & 0x800) == 0
+    .long io_in1                # SREG
+    .elseif (opc & 0x60F) == 0x60F
+    .long io_out1
+    .elseif (opc & 0x800) == 0
+    .long io_in_upper
+    .else
+    .long io_out_upper
+    .endif
+.elseif hi == 0xC
+    .long rjmp
+.elseif hi == 0xD
+    .long rcall
+.elseif hi == 0xE
+    .long e_ldi
+.elseif mid == 0
+    handler brbs_, %(opc & 7)
+.elseif mid == 1
+    handler brbc_, %(opc & 7)
+.elseif opc & 8
+    .long unhandled
+.elseif mid == 2 && s
+    .long e_bst
+.elseif mid == 2
+    .long e_bld
+.elseif s
+    .long e_sbrs
+.else
+    .long e_sbrc
+.endif
+opc = opc + 1
 .endr
 
-subdecode_table:
-/* 0000 */ .long f_com
-/* 0001 */ .long f_neg
-/* 0010 */ .long f_swap
-/* 0011 */ .long f_inc
-/* 0100 */ .long unhandled # illegal instruction
-/* 0101 */ .long f_asr
-/* 0110 */ .long f_lsr
-/* 0111 */ .long f_ror
-/* 1000 */ .long f_flag_misc
-/* 1001 */ .long f_ind_jump
-/* 1010 */ .long f_dec
-/* 1011 */ .long f_des
-/* 11xx */ .long f_abs_jump
-/* 11xx */ .long f_abs_jump
-/* 11xx */ .long f_abs_jump
-/* 11xx */ .long f_abs_jump
-
 .bss
 
+.if SANITIZE
+.p2align 3
+avr_SHADOW:
+    .space 0x10000+64   # ldd/std can reach past 0xFFFF
+.data
+avr_STACK_LIMIT:
+    .long IOEND
+.endif
+.if PRIMARY
 .p2align 3
 avr_cycle:
     .long 0
@@ -1492,6 +2126,34 @@ avr_INTR:
     .long 0
 avr_BOOT_PC:
     .long 0
+avr_HALT:
+    .long 0
+avr_MAIL:
+    .long 0
+avr_ASYNC:
+    .long 0
+avr_DEADLINE:
+    .long 0
+    .long 0
+avr_LIMIT:
+    .long 0
+    .long 0
+avr_IO_PC:
+    .long 0
+avr_IRQ:
+    .long 0
+    .long 0
+avr_CHECKED:
+    .long 0
+avr_COVER:
+    .space FLASHEND+1
+.endif
+
+.bss
+.if WATCH
+avr_WATCH:
+    .space 256
+.endif
 
 avr_INT  = avr_INTR+1
 avr_IO   = avr_ADDR+0x20
@@ -0,0 +1,231 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <elf.h>
+#include <sys/wait.h>
+
+/* avrcov: turns the coverage maps written by "tester -coverage:file" into a report.
+
+     avrcov merge out.cov in.cov...         combine the maps of several runs
+     avrcov lcov firmware.elf in.cov...     write lcov tracefile data to stdout (for genhtml)
+
+   a map has one byte for every word of flash (see avr_COVER in avr_core_x86.s), so maps are
+   merged by OR-ing them. the line numbers come from the debug information of the elf file, by
+   way of avr-addr2line (or whatever $ADDR2LINE names) */
+
+#define FLASH_WORDS 0x20000
+
+enum { EXECUTED = 1, TAKEN = 2, NOT_TAKEN = 4 };
+
+static unsigned char map[FLASH_WORDS];
+
+static struct instr {
+	unsigned addr;                /* byte address */
+	unsigned char cover, branch;
+	char *file;
+	unsigned line;
+} *instr;
+static unsigned instrs;
+
+static int read_map(const char *name)
+{
+	unsigned char buf[4096];
+	size_t n, i, pos = 0;
+	FILE *f = fopen(name, "rb");
+	if(!f) {
+		perror(name);
+		return -1;
+	}
+	while((n = fread(buf, 1, sizeof buf, f)) > 0 && pos < FLASH_WORDS)
+		for(i=0; i < n && pos < FLASH_WORDS; i++)
+			map[pos++] |= buf[i];
+	fclose(f);
+	return 0;
+}
+
+static int is_branch(unsigned op)
+{
+	return (op & 0xF800) == 0xF000     /* brbs, brbc */
+	    || (op & 0xFC08) == 0xFC00     /* sbrc, sbrs */
+	    || (op & 0xFC00) == 0x1000     /* cpse */
+	    || (op & 0xFD00) == 0x9900;    /* sbic, sbis */
+}
+
+static int is_long(unsigned op)
+{
+	return (op & 0xFC0F) == 0x9000     /* lds, sts */
+	    || (op & 0xFE0C) == 0x940C;    /* jmp, call */
+}
+
+/* collects the instructions of the executable sections */
+static int read_elf(const char *name)
+{
+	Elf32_Ehdr eh;
+	Elf32_Shdr sh;
+	unsigned char *text;
+	unsigned i, pc;
+	FILE *f = fopen(name, "rb");
+	if(!f) {
+		perror(name);
+		return -1;
+	}
+	if(fread(&eh, sizeof eh, 1, f) != 1 || memcmp(eh.e_ident, ELFMAG, SELFMAG) != 0
+	 || eh.e_ident[EI_CLASS] != ELFCLASS32 || eh.e_machine != EM_AVR) {
+		fprintf(stderr, "%s: not an avr elf file\n", name);
+		fclose(f);
+		return -1;
+	}
+	for(i=0; i < eh.e_shnum; i++) {
+		if(fseek(f, eh.e_shoff + i*eh.e_shentsize, SEEK_SET) != 0 || fread(&sh, sizeof sh, 1, f) != 1)
+			break;
+		if(sh.sh_type != SHT_PROGBITS || !(sh.sh_flags & SHF_EXECINSTR) || sh.sh_addr+sh.sh_size > 2*FLASH_WORDS)
+			continue;
+		text = malloc(sh.sh_size+2);
+		instr = realloc(instr, (instrs + sh.sh_size/2) * sizeof *instr);
+		if(!text || !instr || fseek(f, sh.sh_offset, SEEK_SET) != 0 || fread(text, 1, sh.sh_size, f) != sh.sh_size) {
+			fprintf(stderr, "%s: could not read section %u\n", name, i);
+			fclose(f);
+			return -1;
+		}
+		text[sh.sh_size] = text[sh.sh_size+1] = 0;
+		for(pc=0; pc+1 < sh.sh_size; pc += 2) {
+			unsigned op = text[pc] | text[pc+1]<<8;
+			struct instr *p = &instr[instrs++];
+			p->addr   = sh.sh_addr + pc;
+			p->cover  = map[p->addr/2];
+			p->branch = is_branch(op);
+			p->file   = NULL;
+			if(is_long(op))
+				pc += 2;
+		}
+		free(text);
+	}
+	fclose(f);
+	return 0;
+}
+
+/* runs addr2line on all instructions at once */
+static int find_lines(const char *elf)
+{
+	const char *tool = getenv("ADDR2LINE");
+	char path[] = "/tmp/avrcovXXXXXX", line[4096], *p;
+	int fd = mkstemp(path), out[2], status;
+	unsigned i;
+	pid_t pid;
+	FILE *f;
+	if(fd < 0 || !(f = fdopen(fd, "w+"))) {
+		perror("temporary file");
+		return -1;
+	}
+	unlink(path);
+	for(i=0; i < instrs; i++)
+		fprintf(f, "0x%x\n", instr[i].addr);
+	fflush(f);
+	lseek(fd, 0, SEEK_SET);
+	if(pipe(out) != 0 || (pid = fork()) < 0) {
+		perror("addr2line");
+		return -1;
+	}
+	if(pid == 0) {
+		dup2(fd, STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		close(out[0]);
+		execlp(tool? tool : "avr-addr2line", "addr2line", "-e", elf, (char*)NULL);
+		perror(tool? tool : "avr-addr2line");
+		_exit(127);
+	}
+	fclose(f);
+	close(out[1]);
+	f = fdopen(out[0], "r");
+	for(i=0; i < instrs && fgets(line, sizeof line, f); i++) {
+		/* file:line, possibly followed by " (discriminator n)"; ?? if unknown */
+		if((p = strchr(line, ' ')) != NULL)
+			*p = '\0';
+		if((p = strrchr(line, ':')) == NULL || line[0] == '?' || (instr[i].line = strtoul(p+1, NULL, 10)) == 0)
+			continue;
+		*p = '\0';
+		instr[i].file = strdup(line);
+	}
+	fclose(f);
+	waitpid(pid, &status, 0);
+	if(i < instrs || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s\n", "addr2line failed");
+		return -1;
+	}
+	return 0;
+}
+
+static int by_line(const void *a, const void *b)
+{
+	const struct instr *x = a, *y = b;
+	int c = strcmp(x->file, y->file);
+	if(c) return c;
+	if(x->line != y->line) return x->line < y->line? -1 : 1;
+	return x->addr < y->addr? -1 : x->addr > y->addr;
+}
+
+static void lcov(void)
+{
+	unsigned i, j, k, n = 0, lf, lh, brf, brh;
+	for(i=0; i < instrs; i++)
+		if(instr[i].file)
+			instr[n++] = instr[i];
+	qsort(instr, n, sizeof *instr, by_line);
+
+	for(i=0; i < n; ) {
+		const char *file = instr[i].file;
+		lf = lh = brf = brh = 0;
+		printf("TN:\nSF:%s\n", file);
+		for(; i < n && strcmp(instr[i].file, file) == 0; i = j) {
+			int hit = 0;
+			for(j=i; j < n && strcmp(instr[j].file, file) == 0 && instr[j].line == instr[i].line; j++)
+				hit |= instr[j].cover & EXECUTED;
+			for(k=i; k < j; k++) {
+				struct instr *b = &instr[k];
+				if(!b->branch)
+					continue;
+				if(b->cover & EXECUTED)
+					printf("BRDA:%u,%u,0,%d\nBRDA:%u,%u,1,%d\n",
+					       b->line, b->addr, !!(b->cover & TAKEN), b->line, b->addr, !!(b->cover & NOT_TAKEN));
+				else
+					printf("BRDA:%u,%u,0,-\nBRDA:%u,%u,1,-\n", b->line, b->addr, b->line, b->addr);
+				brf += 2;
+				brh += !!(b->cover & TAKEN) + !!(b->cover & NOT_TAKEN);
+			}
+			printf("DA:%u,%d\n", instr[i].line, hit);
+			lf++;
+			lh += hit;
+		}
+		printf("BRF:%u\nBRH:%u\nLF:%u\nLH:%u\nend_of_record\n", brf, brh, lf, lh);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+	if(argc >= 4 && strcmp(argv[1], "merge") == 0) {
+		FILE *f;
+		for(i=3; i < argc; i++)
+			if(read_map(argv[i]) != 0)
+				return 1;
+		if(!(f = fopen(argv[2], "wb")) || fwrite(map, 1, sizeof map, f) != sizeof map || fclose(f) != 0) {
+			perror(argv[2]);
+			return 1;
+		}
+		return 0;
+	}
+	if(argc >= 4 && strcmp(argv[1], "lcov") == 0) {
+		for(i=3; i < argc; i++)
+			if(read_map(argv[i]) != 0)
+				return 1;
+		if(read_elf(argv[2]) != 0 || find_lines(argv[2]) != 0)
+			return 1;
+		lcov();
+		return 0;
+	}
+	fprintf(stderr, "usage: avrcov merge out.cov in.cov...\n"
+	                "       avrcov lcov firmware.elf in.cov... > coverage.info\n");
+	return 2;
+}
@@ -0,0 +1,323 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include "board.h"
+
+/* board mode: several mcus, connected by "wires" between their peripherals.
+
+   the emulator keeps its state in global variables, so every mcu runs in a process of its own;
+   these share a memory area that holds the progress of every mcu and a ring buffer for every
+   wire. nothing on that path makes a system call, unless an mcu has to wait for another.
+
+   time is the number of cycles since the board was started (avr_cycle restarts after a reset, so
+   the host adds an offset); an mcu stops at every multiple of the quantum until all others have
+   come within a quantum of it, so two mcus never drift apart by more than two quanta. the
+   bytes on a wire carry the time at which they arrive, and are taken at the first stop after that.
+   between two stops of the receiving mcu, the sender can get up to three quanta further, so a
+   wire holds at least four quanta of bytes (up to MAX_RING). when one is full all the same, the
+   sender waits for the receiver as long as that is behind it; one that has caught up and still
+   doesn't take its data has overrun, and the byte is lost (these are counted, and reported at
+   the end). an mcu that has to wait sleeps on a futex, which the others wake when they make
+   progress */
+
+#define MAX_MCUS  8
+#define MAX_WIRES 16
+#define MIN_RING  256
+#define MAX_RING  65536
+
+#define NEVER (~0ull)
+
+struct ring {                   /* single producer, single consumer */
+	volatile unsigned head, tail;
+	unsigned size;              /* a power of two */
+	struct slot { unsigned long long at; unsigned char data; } *slot;
+};
+
+static struct board {
+	int mcus, wires;
+	unsigned long quantum;
+	unsigned ring_size;
+	volatile unsigned long long cycle[MAX_MCUS];   /* the last stop of every mcu; NEVER if halted */
+	volatile unsigned progress;                    /* changes with every change of cycle[] */
+	volatile int waiting;                          /* the number of mcus waiting for that */
+	struct wire {
+		int src, src_port, dst, dst_port;
+		volatile unsigned lost;
+		struct ring ring;
+	} wire[MAX_WIRES];
+} *board;
+
+int board_mcu = -1;
+
+static pid_t pid[MAX_MCUS];
+static unsigned long long last;
+
+static const char *port_name[BOARD_PORTS] = { "uart0", "spi0", "porta", "portb", "portc", "portd" };
+
+static int ring_put(struct ring *r, unsigned long long at, unsigned char data)
+{
+	unsigned head = r->head;
+	if(head - r->tail == r->size)
+		return 0;
+	r->slot[head % r->size].at   = at;
+	r->slot[head % r->size].data = data;
+	__sync_synchronize();
+	r->head = head+1;
+	return 1;
+}
+
+static int ring_peek(struct ring *r, unsigned long long *at)
+{
+	if(r->tail == r->head)
+		return 0;
+	__sync_synchronize();
+	*at = r->slot[r->tail % r->size].at;
+	return 1;
+}
+
+static unsigned char ring_get(struct ring *r)
+{
+	unsigned char data = r->slot[r->tail % r->size].data;
+	__sync_synchronize();
+	r->tail++;
+	return data;
+}
+
+/* the rings follow the board in the shared memory; pages that no wire uses are never touched */
+int board_open(int mcus, unsigned long quantum)
+{
+	unsigned size = MIN_RING;
+	if(mcus < 1 || mcus > MAX_MCUS || quantum == 0)
+		return -1;
+	while(size < 4*quantum && size < MAX_RING)
+		size *= 2;
+	board = mmap(NULL, sizeof *board + MAX_WIRES*size*sizeof(struct slot), PROT_READ|PROT_WRITE,
+		MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if(board == MAP_FAILED) {
+		board = NULL;
+		return -1;
+	}
+	board->mcus = mcus;
+	board->quantum = quantum;
+	board->ring_size = size;
+	return 0;
+}
+
+/* mcu.port; for a gpio port, the source is its PORTx register and the destination its PINx register */
+static int parse_end(const char *s, char **end, int *mcu, int *port)
+{
+	int i;
+	*mcu = strtoul(s, end, 10);
+	if(*end == s || **end != '.' || *mcu >= board->mcus)
+		return -1;
+	s = *end+1;
+	for(i=0; i < BOARD_PORTS; i++)
+		if(strncmp(s, port_name[i], strlen(port_name[i])) == 0) {
+			*port = i;
+			*end = (char*)s + strlen(port_name[i]);
+			return 0;
+		}
+	return -1;
+}
+
+/* a wire connects a port to one of the same kind; all gpio ports are of one kind */
+static int port_kind(int port)
+{
+	return port >= BOARD_PORTA? BOARD_PORTA : port;
+}
+
+/* src.port>dst.port, e.g. 0.uart0>1.uart0, 0.spi0>1.spi0 or 0.portb>2.portd */
+int board_wire(const char *spec)
+{
+	struct wire *w;
+	char *p;
+	if(!board || board->wires == MAX_WIRES)
+		return -1;
+	w = &board->wire[board->wires];
+	if(parse_end(spec, &p, &w->src, &w->src_port) != 0 || *p != '>')
+		return -1;
+	if(parse_end(p+1, &p, &w->dst, &w->dst_port) != 0 || *p != '\0')
+		return -1;
+	if(port_kind(w->src_port) != port_kind(w->dst_port))
+		return -1;
+	w->ring.size = board->ring_size;
+	w->ring.slot = (struct slot*)(board+1) + board->wires*board->ring_size;
+	board->wires++;
+	return 0;
+}
+
+/* forks off the other mcus; returns the number of the mcu that the calling process should emulate */
+int board_start(void)
+{
+	int i, fd;
+	board_mcu = 0;
+	atexit(board_exit);
+	for(i=1; i < board->mcus; i++) {
+		pid[i] = fork();
+		if(pid[i] < 0) {
+			perror("fork");
+			exit(2);
+		} else if(pid[i] == 0) {
+			board_mcu = i;
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+			/* only the first mcu reads the console */
+			if((fd = open("/dev/null", O_RDONLY)) >= 0) {
+				dup2(fd, STDIN_FILENO);
+				close(fd);
+			}
+			break;
+		}
+	}
+	return board_mcu;
+}
+
+static void futex(volatile unsigned *addr, int op, unsigned val)
+{
+	syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+/* sets the time of this mcu, and wakes those that wait for it */
+static void progress(unsigned long long t)
+{
+	board->cycle[board_mcu] = t;
+	__sync_fetch_and_add(&board->progress, 1);
+	if(board->waiting)
+		futex(&board->progress, FUTEX_WAKE, INT_MAX);
+}
+
+static int behind(int i, unsigned long long now)
+{
+	return board->cycle[i] != NEVER && board->cycle[i] + board->quantum < now;
+}
+
+/* the time at which an mcu continues after a reset; if it has been halted, it rejoins the others */
+unsigned long long board_resume(void)
+{
+	unsigned long long t = NEVER;
+	int i;
+	if(board->cycle[board_mcu] == NEVER)
+		for(i=0; i < board->mcus; i++)
+			if(i != board_mcu && board->cycle[i] < t)
+				t = board->cycle[i];
+	if(t == NEVER || t < last)
+		t = last;
+	progress(last = t);
+	return t;
+}
+
+/* called at every stop; returns the time of the next one */
+unsigned long long board_sync(unsigned long long now)
+{
+	unsigned long long next, at;
+	int i;
+	progress(last = now);
+	for(i=0; i < board->mcus; i++)
+		while(behind(i, now)) {
+			unsigned seq = board->progress;
+			__sync_fetch_and_add(&board->waiting, 1);
+			if(behind(i, now))
+				futex(&board->progress, FUTEX_WAIT, seq);
+			__sync_fetch_and_sub(&board->waiting, 1);
+		}
+
+	next = (now / board->quantum + 1) * board->quantum;
+	for(i=0; i < board->wires; i++)
+		if(board->wire[i].dst == board_mcu && ring_peek(&board->wire[i].ring, &at) && at > now && at < next)
+			next = at;
+	return next;
+}
+
+/* the mcu will not make progress until it is reset; don't let the others wait for it */
+void board_halt(void)
+{
+	if(board_mcu >= 0)
+		progress(NEVER);
+}
+
+void board_exit(void)
+{
+	int i;
+	board_halt();
+	if(board_mcu != 0)
+		return;
+	for(i=1; i < board->mcus; i++)
+		waitpid(pid[i], NULL, 0);
+	for(i=0; i < board->wires; i++) {
+		struct wire *w = &board->wire[i];
+		if(w->lost)
+			fprintf(stderr, "wire %d.%s>%d.%s: %u bytes lost\n",
+				w->src, port_name[w->src_port], w->dst, port_name[w->dst_port], w->lost);
+	}
+}
+
+/* puts data on a wire that may be full; the receiver is behind as long as its last stop is
+   before now, and it can always get past that without waiting for this mcu */
+static void wire_put(struct wire *w, unsigned long long now, unsigned long long at, unsigned char data)
+{
+	if(ring_put(&w->ring, at, data))
+		return;
+	progress(now);  /* so that no one waits for this mcu before now */
+	do {
+		unsigned seq = board->progress;
+		if(board->cycle[w->dst] >= now) {  /* caught up, or halted */
+			__sync_fetch_and_add(&w->lost, 1);
+			return;
+		}
+		__sync_fetch_and_add(&board->waiting, 1);
+		if(board->cycle[w->dst] < now && w->ring.head - w->ring.tail == w->ring.size)
+			futex(&board->progress, FUTEX_WAIT, seq);
+		__sync_fetch_and_sub(&board->waiting, 1);
+	} while(!ring_put(&w->ring, at, data));
+}
+
+/* the data arrives delay cycles after now; returns the number of wires it was put on */
+int board_send(int port, unsigned long long now, unsigned long delay, unsigned char data)
+{
+	int i, n = 0;
+	if(board_mcu < 0)
+		return 0;
+	for(i=0; i < board->wires; i++)
+		if(board->wire[i].src == board_mcu && board->wire[i].src_port == port) {
+			wire_put(&board->wire[i], now, now+delay, data);
+			n++;
+		}
+	return n;
+}
+
+/* takes the earliest data that has arrived at a port by now */
+int board_recv(int port, unsigned long long now, unsigned char *data)
+{
+	struct ring *first = NULL;
+	unsigned long long at, min = now+1;
+	int i;
+	for(i=0; i < board->wires; i++)
+		if(board->wire[i].dst == board_mcu && board->wire[i].dst_port == port
+		 && ring_peek(&board->wire[i].ring, &at) && at < min) {
+			first = &board->wire[i].ring;
+			min = at;
+		}
+	if(!first)
+		return 0;
+	*data = ring_get(first);
+	return 1;
+}
+
+int board_inputs(int port)
+{
+	int i, n = 0;
+	if(board_mcu < 0)
+		return 0;
+	for(i=0; i < board->wires; i++)
+		n += board->wire[i].dst == board_mcu && board->wire[i].dst_port == port;
+	return n;
+}
@@ -0,0 +1,19 @@
+/* several mcus on one board (see board.c) */
+
+enum board_port {
+	BOARD_UART0, BOARD_SPI0, BOARD_PORTA, BOARD_PORTB, BOARD_PORTC, BOARD_PORTD, BOARD_PORTS
+};
+
+extern int board_mcu;
+
+extern int board_open(int mcus, unsigned long quantum);
+extern int board_wire(const char *spec);
+extern int board_start(void);
+extern unsigned long long board_resume(void);
+extern unsigned long long board_sync(unsigned long long now);
+extern void board_halt(void);
+extern void board_exit(void);
+
+extern int board_send(int port, unsigned long long now, unsigned long delay, unsigned char data);
+extern int board_recv(int port, unsigned long long now, unsigned char *data);
+extern int board_inputs(int port);
@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "bridge.h"
+
+/* bridges between file descriptors on the host and peripherals of the mcu.
+
+   the emulator never makes a system call for a byte: it puts bytes into and takes them from a
+   pair of rings, and a single thread moves them to and from the file descriptors in chunks as
+   large as the rings allow, waiting in epoll (edge-triggered, so a terminal that nobody has
+   opened does not keep it busy). the thread is only woken through an eventfd when it sleeps
+   for lack of bytes to write or of room to read into; otherwise the rings need no locking.
+
+   when the mcu waits for a byte (bridge_wait), arrived() is called on the thread once one is
+   there. a full ring holds the data back: the thread stops reading, and bridge_put fails.
+   regular files can't be waited for; they are read and written whenever the rings allow.
+
+   bridge_connect opens the host side from a description:
+
+     stdio              stdin and stdout
+     pty                a new pseudo terminal
+     file:out[:in]      writes to the file out, and reads from in (if given)
+     unix:path          connects to a unix socket that something listens on
+     pipe:command       runs a shell command, and talks to its stdin and stdout */
+
+#define RING_SIZE 65536
+
+struct ring {                   /* single producer, single consumer */
+	volatile unsigned head, tail;
+	unsigned char data[RING_SIZE];
+};
+
+struct bridge {
+	int in_fd, out_fd;
+	struct ring rx, tx;           /* from the host to the mcu, and back */
+	void (*arrived)(void *arg);
+	void *arg;
+	volatile int rx_waiting;      /* the mcu waits for a byte */
+	volatile int rx_full;         /* the thread waits for room in rx */
+	volatile int tx_idle;         /* the thread waits for bytes in tx */
+	volatile int hangup;
+	int readable, writable;       /* until read/write says otherwise */
+	struct bridge *next;
+};
+
+static struct bridge *volatile bridges;
+static int epoll_fd = -1, kick_fd = -1;
+static pthread_t bridge_thread;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t drained = PTHREAD_COND_INITIALIZER;
+
+static void kick(void)
+{
+	uint64_t one = 1;
+	while(write(kick_fd, &one, sizeof one) < 0 && errno == EINTR)
+		;
+}
+
+static void pump_in(struct bridge *b)
+{
+	while(b->readable) {
+		unsigned head = b->rx.head, room = RING_SIZE - (head - b->rx.tail);
+		unsigned len = RING_SIZE - head % RING_SIZE;
+		ssize_t n;
+		if(room == 0) {
+			b->rx_full = 1;
+			__sync_synchronize();
+			if(b->rx.head - b->rx.tail == RING_SIZE)
+				return;
+			b->rx_full = 0;
+			continue;
+		}
+		n = read(b->in_fd, &b->rx.data[head % RING_SIZE], len < room? len : room);
+		if(n <= 0) {
+			if(n < 0 && errno == EINTR)
+				continue;
+			b->readable = 0;  /* nothing more until the next edge */
+			return;
+		}
+		b->hangup = 0;
+		__sync_synchronize();
+		b->rx.head = head + n;
+		__sync_synchronize();
+		if(b->rx_waiting && __sync_bool_compare_and_swap(&b->rx_waiting, 1, 0))
+			b->arrived(b->arg);
+	}
+}
+
+static void pump_out(struct bridge *b)
+{
+	while(b->writable) {
+		unsigned tail = b->tx.tail, avail = b->tx.head - tail;
+		unsigned len = RING_SIZE - tail % RING_SIZE;
+		ssize_t n;
+		if(avail == 0) {
+			b->tx_idle = 1;
+			__sync_synchronize();
+			if(b->tx.head != tail) {
+				b->tx_idle = 0;
+				continue;
+			}
+			pthread_mutex_lock(&flush_lock);
+			pthread_cond_broadcast(&drained);
+			pthread_mutex_unlock(&flush_lock);
+			return;
+		}
+		__sync_synchronize();
+		n = write(b->out_fd, &b->tx.data[tail % RING_SIZE], len < avail? len : avail);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && errno == EAGAIN) {
+			b->writable = 0;
+			return;
+		}
+		if(n <= 0)  /* nobody is listening anymore; the bytes are lost */
+			n = len < avail? len : avail;
+		__sync_synchronize();
+		b->tx.tail = tail + n;
+	}
+}
+
+static void *bridge_loop(void *arg)
+{
+	struct epoll_event ev[16];
+	struct bridge *b;
+	uint64_t count;
+	int i, n;
+	for(;;) {
+		n = epoll_wait(epoll_fd, ev, sizeof ev/sizeof *ev, -1);
+		for(i=0; i < n; i++) {
+			if(!(b = ev[i].data.ptr)) {
+				while(read(kick_fd, &count, sizeof count) < 0 && errno == EINTR)
+					;
+				continue;
+			}
+			b->readable = b->writable = 1;
+			if(ev[i].events & EPOLLHUP) {
+				pthread_mutex_lock(&flush_lock);
+				b->hangup = 1;
+				pthread_cond_broadcast(&drained);
+				pthread_mutex_unlock(&flush_lock);
+			}
+		}
+		for(b=bridges; b; b=b->next) {
+			pump_in(b);
+			pump_out(b);
+		}
+	}
+	return arg;
+}
+
+struct bridge *bridge_open(int in_fd, int out_fd, void (*arrived)(void *arg), void *arg)
+{
+	struct epoll_event ev = { EPOLLIN|EPOLLOUT|EPOLLET };
+	struct bridge *b;
+	if(epoll_fd < 0) {
+		struct epoll_event kev = { EPOLLIN };
+		if((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 || (kick_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0
+		 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, kick_fd, &kev) != 0 || pthread_create(&bridge_thread, NULL, bridge_loop, NULL) != 0)
+			return NULL;
+	}
+	if(!(b = calloc(1, sizeof *b)))
+		return NULL;
+	b->in_fd    = in_fd;
+	b->out_fd   = out_fd;
+	b->arrived  = arrived;
+	b->arg      = arg;
+	b->readable = b->writable = 1;
+	fcntl(in_fd,  F_SETFL, fcntl(in_fd,  F_GETFL) | O_NONBLOCK);
+	fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_NONBLOCK);
+	ev.data.ptr = b;
+	if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, in_fd, &ev) != 0 && errno != EPERM /* a regular file */
+	 || out_fd != in_fd && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, out_fd, &ev) != 0 && errno != EPERM) {
+		free(b);
+		return NULL;
+	}
+	b->next = bridges;
+	__sync_synchronize();
+	bridges = b;
+	kick();
+	return b;
+}
+
+/* see the top of this file; *pty is the name of a new pseudo terminal */
+struct bridge *bridge_connect(const char *spec, void (*arrived)(void *arg), void *arg, const char **pty)
+{
+	extern int make_pty(const char **name);
+	int in_fd, out_fd, p[2], q[2];
+	*pty = NULL;
+	if(strcmp(spec, "stdio") == 0) {
+		in_fd  = STDIN_FILENO;
+		out_fd = STDOUT_FILENO;
+	} else if(strcmp(spec, "pty") == 0) {
+		if((in_fd = out_fd = make_pty(pty)) < 0)
+			return NULL;
+	} else if(strncmp(spec, "file:", 5) == 0) {
+		char out[256], in[256] = "/dev/null";
+		if(sscanf(spec+5, "%255[^:]:%255s", out, in) < 1)
+			return NULL;
+		if((out_fd = open(out, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666)) < 0 || (in_fd = open(in, O_RDONLY|O_CLOEXEC)) < 0)
+			return NULL;
+	} else if(strncmp(spec, "unix:", 5) == 0) {
+		struct sockaddr_un addr = { AF_UNIX, };
+		strncpy(addr.sun_path, spec+5, sizeof addr.sun_path-1);
+		in_fd = out_fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+		if(in_fd < 0 || connect(in_fd, (struct sockaddr*)&addr, sizeof addr) != 0)
+			return NULL;
+		signal(SIGPIPE, SIG_IGN);  /* a closed connection loses the bytes */
+	} else if(strncmp(spec, "pipe:", 5) == 0) {
+		pid_t pid;
+		if(pipe2(p, O_CLOEXEC) != 0 || pipe2(q, O_CLOEXEC) != 0 || (pid = fork()) < 0)
+			return NULL;
+		if(pid == 0) {
+			dup2(q[0], STDIN_FILENO);
+			dup2(p[1], STDOUT_FILENO);
+			execl("/bin/sh", "sh", "-c", spec+5, (char*)NULL);
+			_exit(127);
+		}
+		close(q[0]);
+		close(p[1]);
+		in_fd  = p[0];
+		out_fd = q[1];
+		signal(SIGPIPE, SIG_IGN);
+	} else {
+		return NULL;
+	}
+	return bridge_open(in_fd, out_fd, arrived, arg);
+}
+
+/* the mcu side; these are not to be called from more than one thread */
+
+int bridge_put(struct bridge *b, unsigned char data)
+{
+	unsigned head = b->tx.head;
+	if(head - b->tx.tail == RING_SIZE)
+		return 0;
+	b->tx.data[head % RING_SIZE] = data;
+	__sync_synchronize();
+	b->tx.head = head+1;
+	__sync_synchronize();
+	if(b->tx_idle && __sync_bool_compare_and_swap(&b->tx_idle, 1, 0))
+		kick();
+	return 1;
+}
+
+int bridge_get(struct bridge *b, unsigned char *data)
+{
+	unsigned tail = b->rx.tail;
+	if(tail == b->rx.head)
+		return 0;
+	__sync_synchronize();
+	*data = b->rx.data[tail % RING_SIZE];
+	__sync_synchronize();
+	b->rx.tail = tail+1;
+	__sync_synchronize();
+	if(b->rx_full && __sync_bool_compare_and_swap(&b->rx_full, 1, 0))
+		kick();
+	return 1;
+}
+
+/* can another byte be put? */
+int bridge_room(struct bridge *b)
+{
+	return b->tx.head - b->tx.tail < RING_SIZE;
+}
+
+/* returns 1 if a byte can be taken; otherwise, arrived() will be called when one can */
+int bridge_wait(struct bridge *b)
+{
+	b->rx_waiting = 1;
+	__sync_synchronize();
+	return b->rx.tail != b->rx.head && __sync_bool_compare_and_swap(&b->rx_waiting, 1, 0);
+}
+
+/* waits until everything that was put has been written, or the other side has hung up */
+void bridge_flush(struct bridge *b)
+{
+	pthread_mutex_lock(&flush_lock);
+	kick();
+	while(b->tx.head != b->tx.tail && !b->hangup)
+		pthread_cond_wait(&drained, &flush_lock);
+	pthread_mutex_unlock(&flush_lock);
+}
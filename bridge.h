@@ -0,0 +1,11 @@
+/* byte streams between a file descriptor on the host and a peripheral of the mcu (see bridge.c) */
+
+struct bridge;
+
+extern struct bridge *bridge_open(int in_fd, int out_fd, void (*arrived)(void *arg), void *arg);
+extern struct bridge *bridge_connect(const char *spec, void (*arrived)(void *arg), void *arg, const char **pty);
+extern int bridge_put(struct bridge *b, unsigned char data);
+extern int bridge_get(struct bridge *b, unsigned char *data);
+extern int bridge_room(struct bridge *b);
+extern int bridge_wait(struct bridge *b);
+extern void bridge_flush(struct bridge *b);
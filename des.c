@@ -237,14 +237,23 @@ static const unsigned char PC2[] = {
 #define SPEEDUP64 8 /* recommended: 4 or 8, max 16 */
 #define SPEEDUP56 7 /* recommend: 4 or 7/8, max 14 */
 
-/* precompute tables */
+/* precompute tables; if PRECOMPUTED is defined, these are generated at build time (see GENTABLES) */
 #if SPEEDUP64 && SPEEDUP56
+#if defined(PRECOMPUTED)
+#include "des_tables.h"
+#else
 static unsigned long SP[8][64];
 static unsigned long long PC2F[56/SPEEDUP56][1<<SPEEDUP56];
 static unsigned long long PC1F[64/SPEEDUP64][1<<SPEEDUP64];
 static unsigned long long IPF [64/SPEEDUP64][1<<SPEEDUP64];
 static unsigned long long IIPF[64/SPEEDUP64][1<<SPEEDUP64];
 static unsigned long long IPC1F[64/SPEEDUP64][1<<SPEEDUP64];
+/* for des_round_cached: the expanded right half taken straight from a block in C layout,
+   and the output of the S/P-boxes mapped back through the inverse IP (with and without the swap) */
+static unsigned long long EIPF[64/SPEEDUP64][1<<SPEEDUP64];
+static unsigned long long SPIP[8][64];
+static unsigned long long SPIPX[8][64];
+#endif
 #endif
 
 /* routines */
@@ -320,9 +329,14 @@ static unsigned long long kstep(int n, unsigned long long *key, int reverse)
 	}
 }
 
+static unsigned long long expand(unsigned long long half)
+{
+	return half>>31 | half<<1 | half<<33;
+}
+
 static unsigned long f(unsigned long long half, unsigned long long subkey)
 {
-	unsigned long long x = half>>31 | half<<1 | half<<33;
+	unsigned long long x = expand(half);
 	unsigned long y = 0;
 	int i;
 	for(i=0; i<8; i++,x>>=4,subkey>>=6)
@@ -347,6 +361,89 @@ unsigned long long des_round(unsigned long long block, unsigned long long *keyp,
 	return bit_select_inv(block, IP, 64);
 }
 
+#if SPEEDUP64 && SPEEDUP56
+
+/* a faster version of des_round, for use by an emulator that executes DES one round at a time:
+
+   - the IP/FP permutations are never performed; since they are linear, the expanded right half
+     can be computed directly from the block, and the output of f can be mapped back by a table;
+     in the IP domain, swapping the halves corresponds to swapping adjacent bits in the C layout
+   - the key schedule (and the rotated key for every round) is derived once for every new key;
+     afterwards the key register is simply compared and replaced by the next cached value */
+
+#define PARITY 0x0101010101010101ull
+
+void des_init(void);
+
+#ifndef DES_KEYCACHE
+#define DES_KEYCACHE 4
+#endif
+
+static struct des_keycache {
+	unsigned long long reg[16];  /* contents of the key before encryption round n (sans parity) */
+	unsigned long long sub[16];  /* subkey for round n */
+} keycache[DES_KEYCACHE];
+static int keycache_next;
+
+static struct des_keycache *des_keycache_fill(unsigned long long key, int anchor)
+{
+	struct des_keycache *kc = &keycache[keycache_next++ % DES_KEYCACHE];
+	unsigned long long state[16];
+	int n, i;
+	state[anchor] = bit_select(key, PC1, 64);
+	for(n=anchor; (n+1)%16 != anchor; n=(n+1)%16) {
+		i = 1 + (n!=0 & n!=1 & n!=8 & n!=15);
+		state[(n+1)%16] = rot(state[n] & mask(28), i, 28) | rot(state[n] >> 28, i, 28) << 28;
+	}
+	for(n=0; n<16; n++) {
+		kc->reg[n] = bit_select_inv(state[n], PC1, 64) & ~PARITY;
+		kc->sub[n] = bit_select(state[(n+1)%16], PC2, 56);
+	}
+	return kc;
+}
+
+void des_round_cached(unsigned long long *blockp, unsigned long long *keyp, int round, int decrypt)
+{
+	static struct des_keycache *kc;
+	unsigned long long block = *blockp, key = *keyp & ~PARITY;
+	unsigned long long x, subkey, y = 0;
+	const unsigned long long (*sp)[64];
+	int cur = (round + !!decrypt) % 16;
+	int i, n;
+
+#if !defined(PRECOMPUTED)
+	static char initialized;
+	if(!initialized) des_init(), initialized++;
+#endif
+	if(!kc || kc->reg[cur] != key) {
+		n = keycache_next < DES_KEYCACHE? keycache_next : DES_KEYCACHE;
+		for(i=0; i < n && keycache[i].reg[cur] != key; i++)
+			;
+		kc = i < n? &keycache[i] : des_keycache_fill(key, cur);
+	}
+	*keyp = *keyp & PARITY | kc->reg[(round + !decrypt) % 16];
+
+	x = bit_select_fast(block, (void*)EIPF, elems(EIPF), 64);
+	subkey = kc->sub[round];
+	if(round != 15*!decrypt) {
+		block = block>>1 & 0x5555555555555555ull | (block & 0x5555555555555555ull) << 1;
+		sp = (void*)SPIPX;
+	} else
+		sp = (void*)SPIP;
+	for(i=0; i<8; i++,x>>=4,subkey>>=6)
+		y ^= sp[i][(x ^ subkey) & 0x3F];
+	*blockp = block ^ y;
+}
+
+#else
+
+void des_round_cached(unsigned long long *blockp, unsigned long long *keyp, int round, int decrypt)
+{
+	*blockp = des_round(*blockp, keyp, round, decrypt);
+}
+
+#endif
+
 static unsigned long long des_encrypt(unsigned long long block, unsigned long long key)
 {
 	int i;
@@ -363,6 +460,14 @@ static unsigned long long des_decrypt(unsigned long long block, unsigned long lo
 	return block;
 }
 
+static unsigned long long des_crypt_cached(unsigned long long block, unsigned long long key, int decrypt)
+{
+	int i;
+	for(i=0; i<16; i++)
+		des_round_cached(&block, &key, decrypt? 15-i : i, decrypt);
+	return block;
+}
+
 static unsigned long long des_fast_encrypt(unsigned long long block, unsigned long long key)
 {
 	unsigned long l, r;
@@ -408,7 +513,7 @@ static unsigned long long des_fast_encrypt_sched(unsigned long long block, unsig
 
 void des_init(void)
 {
-	#if SPEEDUP64 && SPEEDUP56
+	#if SPEEDUP64 && SPEEDUP56 && !defined(PRECOMPUTED)
 	int i,j;
 	char speedup64_is_divisor_of_64[1-(64%SPEEDUP64<<1)];
 	char speedup56_is_divisor_of_56[1-(56%SPEEDUP56<<1)];
@@ -419,6 +524,12 @@ void des_init(void)
 	lut_loop(IPF,layout(IP),i,j,  64,);
 	lut_loop(IIPF,layout(IP),i,j,64,_inv);
 	lut_loop(IPC1F,layout(PC1),i,j,64,_inv);
+	for(i=0; i<elems(EIPF); i++) for(j=0; j<elems(*EIPF); j++)
+		EIPF[i][j] = expand(bit_select((unsigned long long)j<<SPEEDUP64*i, IP, 64) >> 32);
+	for(i=0; i<8; i++) for(j=0; j<64; j++) {
+		SPIP [i][j] = bit_select_inv(SP[i][j], IP, 64);
+		SPIPX[i][j] = bit_select_inv(rot(SP[i][j], 32, 64), IP, 64);
+	}
 	#endif
 }
 
@@ -508,6 +619,7 @@ static void NBS_test(void)
 		unsigned long long cipher = 1ull << 63-i;
 		printf("%016llx %016llx %016llx\n", (key), (des_encrypt(cipher,key)), (cipher));
 		des_encrypt(des_encrypt(cipher,key),key) == cipher || (abort(),0);
+		des_crypt_cached(cipher,key,0) == des_encrypt(cipher,key) || (abort(),0);
 	}
 
 	printf("PC1 and PC2 test\n");
@@ -517,6 +629,7 @@ static void NBS_test(void)
 		if((i+1) % 8 == 0) continue;
 		printf("%016llx %016llx %016llx\n", (key), (plain), (des_encrypt(plain,key)));
 		des_decrypt(des_encrypt(plain,key),key) == plain || (abort(),0);
+		des_crypt_cached(des_crypt_cached(plain,key,0),key,1) == plain || (abort(),0);
 	}
 
 	printf("P test\n");
@@ -524,6 +637,7 @@ static void NBS_test(void)
 		unsigned long long key = (P_keys[i]);
 		unsigned long long plain = 0;
 		printf("%016llx %016llx %016llx\n", (key), (plain), (des_encrypt(plain,key)));
+		des_crypt_cached(plain,key,0) == des_encrypt(plain,key) || (abort(),0);
 	}
 
 	printf("S test\n");
@@ -531,6 +645,8 @@ static void NBS_test(void)
 		unsigned long long key = (S_keys[i]);
 		unsigned long long plain = (S_plain[i]);;
 		printf("%016llx %016llx %016llx\n", (key), (plain), (des_encrypt(plain,key)));
+		des_crypt_cached(plain,key,0) == des_encrypt(plain,key) || (abort(),0);
+		des_crypt_cached(des_encrypt(plain,key),key,1) == plain || (abort(),0);
 	}
 }
 
@@ -598,4 +714,33 @@ int main()
 	des_init();
 	NBS_test();
 }
+#elif defined(GENTABLES)
+#define emit(type, suffix, table) { \
+	printf("static const %s %s[%d][%d] = {\n", type, #table, (int)elems(table), (int)elems(*table)); \
+	for(i=0; i<elems(table); i++) { \
+		printf("\t{"); \
+		for(j=0; j<elems(*table); j++) \
+			printf("%s0x%llx%s,", j%4? " " : "\n\t\t", (unsigned long long)table[i][j], suffix); \
+		printf("\n\t},\n"); \
+	} \
+	printf("};\n\n"); \
+}
+
+/* writes the lookup tables as C source, to be included by des.c when compiled with PRECOMPUTED */
+int main()
+{
+	int i, j;
+	des_init();
+	printf("/* generated by des.c -DGENTABLES -- do not edit */\n\n");
+	emit("unsigned long", "ul", SP);
+	emit("unsigned long long", "ull", PC2F);
+	emit("unsigned long long", "ull", PC1F);
+	emit("unsigned long long", "ull", IPF);
+	emit("unsigned long long", "ull", IIPF);
+	emit("unsigned long long", "ull", IPC1F);
+	emit("unsigned long long", "ull", EIPF);
+	emit("unsigned long long", "ull", SPIP);
+	emit("unsigned long long", "ull", SPIPX);
+	return 0;
+}
 #endif
@@ -0,0 +1,364 @@
+#define _FILE_OFFSET_BITS 64
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "devices.h"
+
+/* host-side models of the chips that firmware talks to over SPI or TWI; the emulator calls them
+   once for every byte, at the time the transfer on the bus completes.
+
+   their contents are image files that are mapped into memory, so that anything the mcu writes
+   ends up in the file:
+
+   spi:nor:file[:cs]       a SPI NOR flash (JEDEC commands READ, FAST READ, PAGE PROGRAM, sector/block/chip
+                           ERASE, RDSR, RDID); never busy
+   spi:sd:file[:cs]        an SDHC card in SPI mode (CMD0/8/9/10/12/13/16/17/24/55/58, ACMD41)
+   twi:eeprom:file[:addr]  a 24Cxx EEPROM (two address bytes if larger than 2K, 64-byte pages)
+
+   cs is a port pin such as b0 (the default, SS on the ATmega2560); addr defaults to 0x50 */
+
+struct spi_device *spi_devices;
+struct twi_device *twi_devices;
+
+static unsigned char *map_image(const char *file, size_t *size)
+{
+	struct stat st;
+	void *mem;
+	int fd = open(file, O_RDWR);
+	if(fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size > 1<<30) {
+		fprintf(stderr, "%s: could not open image (at most 1GB)\n", file);
+		if(fd >= 0) close(fd);
+		return NULL;
+	}
+	mem = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mem == MAP_FAILED) {
+		perror(file);
+		return NULL;
+	}
+	*size = st.st_size;
+	return mem;
+}
+
+/* SPI NOR flash */
+
+struct nor {
+	struct spi_device spi;
+	unsigned char *mem;
+	size_t size;
+	int wel, n;                   /* write enable latch; bytes since chip select */
+	unsigned char cmd;
+	unsigned long addr;
+};
+
+static void nor_select(struct spi_device *dev, int selected)
+{
+	struct nor *nor = (struct nor*)dev;
+	if(!selected && nor->n > 0 && (nor->cmd == 0x02 || nor->cmd == 0x20 || nor->cmd == 0xD8))
+		nor->wel = 0;
+	nor->n = 0;
+}
+
+static unsigned char nor_transfer(struct spi_device *dev, unsigned char out)
+{
+	static const unsigned char jedec_id[3] = { 0xEF, 0x40, 0x18 };
+	struct nor *nor = (struct nor*)dev;
+	unsigned long page;
+
+	if(nor->n++ == 0) {
+		switch(nor->cmd = out) {
+		case 0x06: nor->wel = 1; break;
+		case 0x04: nor->wel = 0; break;
+		case 0x60:
+		case 0xC7:
+			if(nor->wel) memset(nor->mem, 0xFF, nor->size);
+			nor->wel = 0;
+			break;
+		}
+		nor->addr = 0;
+		return 0xFF;
+	}
+
+	switch(nor->cmd) {
+	case 0x9F:
+		return nor->n <= 4? jedec_id[nor->n-2] : 0xFF;
+	case 0x05:
+		return nor->wel << 1;
+	case 0x03:
+	case 0x0B:
+	case 0x02:
+	case 0x20:
+	case 0xD8:
+		if(nor->n <= 4) {
+			nor->addr = (nor->addr << 8 | out) % nor->size;
+			if(nor->n == 4 && nor->wel && (nor->cmd == 0x20 || nor->cmd == 0xD8)) {
+				unsigned long len = nor->cmd == 0x20? 0x1000 : 0x10000;
+				nor->addr &= ~(len-1);
+				memset(nor->mem + nor->addr, 0xFF, nor->addr+len > nor->size? nor->size-nor->addr : len);
+			}
+			return 0xFF;
+		}
+		if(nor->cmd == 0x0B && nor->n == 5)
+			return 0xFF;  /* dummy byte */
+		if(nor->cmd == 0x02) {
+			if(nor->wel) nor->mem[nor->addr] &= out;
+			page = nor->addr & ~0xFFul;
+			nor->addr = (page | (nor->addr+1) & 0xFF) % nor->size;
+			return 0xFF;
+		}
+		if(nor->cmd == 0x20 || nor->cmd == 0xD8)
+			return 0xFF;
+		out = nor->mem[nor->addr];
+		nor->addr = (nor->addr+1) % nor->size;
+		return out;
+	}
+	return 0xFF;
+}
+
+/* SD card */
+
+struct sd {
+	struct spi_device spi;
+	unsigned char *mem;
+	size_t size;
+	unsigned char cmd[6];
+	int n;                        /* bytes of the command received */
+	int idle, app;                /* not initialised yet; next command is an ACMD */
+	enum { SD_CMD, SD_TOKEN, SD_DATA } state;
+	unsigned long block;          /* of a write */
+	int k;
+	unsigned char resp[2+1+512+2];
+	int len, pos;                 /* queued response */
+};
+
+static void sd_select(struct spi_device *dev, int selected)
+{
+	struct sd *sd = (struct sd*)dev;
+	sd->n = 0;
+}
+
+static void sd_reply(struct sd *sd, const unsigned char *data, int len)
+{
+	sd->resp[0] = 0xFF;           /* Ncr */
+	memcpy(sd->resp+1, data, len);
+	sd->len = len+1;
+	sd->pos = 0;
+}
+
+/* R1, followed by a data token, a block and its (ignored) crc */
+static void sd_reply_block(struct sd *sd, const unsigned char *data, int len)
+{
+	sd->resp[0] = 0xFF;
+	sd->resp[1] = 0x00;
+	sd->resp[2] = 0xFE;
+	memcpy(sd->resp+3, data, len);
+	sd->resp[3+len] = sd->resp[4+len] = 0xFF;
+	sd->len = len+5;
+	sd->pos = 0;
+}
+
+static void sd_command(struct sd *sd)
+{
+	int cmd = sd->cmd[0] & 0x3F, app = sd->app;
+	unsigned long arg = (unsigned long)sd->cmd[1] << 24 | sd->cmd[2] << 16 | sd->cmd[3] << 8 | sd->cmd[4];
+	unsigned char r[16] = { sd->idle };
+	unsigned long c_size = sd->size / (512*1024) - 1;
+
+	sd->app = 0;
+	switch(app? cmd | 0x40 : cmd) {
+	case 0:
+		sd->idle = r[0] = 1;
+		sd_reply(sd, r, 1);
+		break;
+	case 8:
+		r[3] = 0x01, r[4] = arg & 0xFF;
+		sd_reply(sd, r, 5);
+		break;
+	case 9: {
+		unsigned char csd[16] = { 0x40, 0x0E, 0x00, 0x32, 0x5B, 0x59, 0x00, c_size >> 16 & 0x3F,
+		                          c_size >> 8 & 0xFF, c_size & 0xFF, 0x7F, 0x80, 0x0A, 0x40, 0x00, 0x01 };
+		sd_reply_block(sd, csd, sizeof csd);
+		break;
+	}
+	case 10: {
+		static const unsigned char cid[16] = { 0x00, 'F', 'A', 'f', 'a', 's', 't', 'a', 'v', 0x10,
+		                                       0x00, 0x00, 0x00, 0x01, 0x00, 0x01 };
+		sd_reply_block(sd, cid, sizeof cid);
+		break;
+	}
+	case 13:
+		sd_reply(sd, r, 2);
+		break;
+	case 12:
+	case 16:
+		sd_reply(sd, r, 1);
+		break;
+	case 17:
+		if(arg >= sd->size/512) {
+			r[0] |= 0x40;         /* parameter error */
+			sd_reply(sd, r, 1);
+		} else
+			sd_reply_block(sd, sd->mem + arg*512, 512);
+		break;
+	case 24:
+		if(arg >= sd->size/512) {
+			r[0] |= 0x40;
+		} else {
+			sd->block = arg;
+			sd->state = SD_TOKEN;
+		}
+		sd_reply(sd, r, 1);
+		break;
+	case 55:
+		sd->app = 1;
+		sd_reply(sd, r, 1);
+		break;
+	case 58:
+		r[1] = 0xC0, r[2] = 0xFF, r[3] = 0x80; /* powered up, high capacity */
+		sd_reply(sd, r, 5);
+		break;
+	case 41 | 0x40:
+		sd->idle = r[0] = 0;
+		sd_reply(sd, r, 1);
+		break;
+	default:
+		r[0] |= 0x04;                 /* illegal command */
+		sd_reply(sd, r, 1);
+		break;
+	}
+}
+
+static unsigned char sd_transfer(struct spi_device *dev, unsigned char out)
+{
+	static const unsigned char accepted[] = { 0x05, 0x00, 0x00 };
+	struct sd *sd = (struct sd*)dev;
+	unsigned char in = sd->pos < sd->len? sd->resp[sd->pos++] : 0xFF;
+
+	switch(sd->state) {
+	case SD_CMD:
+		if(sd->n > 0 || (out & 0xC0) == 0x40)
+			sd->cmd[sd->n++] = out;
+		if(sd->n == 6) {
+			sd->n = 0;
+			sd_command(sd);
+		}
+		break;
+	case SD_TOKEN:
+		if(out == 0xFE) {
+			sd->state = SD_DATA;
+			sd->k = 0;
+		}
+		break;
+	case SD_DATA:
+		if(sd->k < 512)
+			sd->mem[sd->block*512 + sd->k] = out;
+		if(++sd->k == 512+2) {
+			memcpy(sd->resp, accepted, sizeof accepted);
+			sd->len = sizeof accepted;
+			sd->pos = 0;
+			sd->state = SD_CMD;
+		}
+		break;
+	}
+	return in;
+}
+
+/* 24Cxx EEPROM */
+
+struct eeprom24 {
+	struct twi_device twi;
+	unsigned char *mem;
+	size_t size;
+	int n, alen;                  /* bytes written since the start condition; address bytes */
+	unsigned long addr;
+};
+
+static int ee_start(struct twi_device *dev, int read)
+{
+	((struct eeprom24*)dev)->n = read? -1 : 0;
+	return 1;
+}
+
+static int ee_write(struct twi_device *dev, unsigned char data)
+{
+	struct eeprom24 *ee = (struct eeprom24*)dev;
+	if(ee->n < 0)
+		return 0;
+	if(ee->n++ < ee->alen) {
+		ee->addr = (ee->addr << 8 | data) % ee->size;
+	} else {
+		ee->mem[ee->addr] = data;
+		ee->addr = (ee->addr & ~63ul | (ee->addr+1) & 63) % ee->size;
+	}
+	return 1;
+}
+
+static unsigned char ee_read(struct twi_device *dev, int ack)
+{
+	struct eeprom24 *ee = (struct eeprom24*)dev;
+	unsigned char data = ee->mem[ee->addr];
+	ee->addr = (ee->addr+1) % ee->size;
+	return data;
+}
+
+static void ee_stop(struct twi_device *dev)
+{
+}
+
+/* see the top of this file */
+int device_add(const char *spec)
+{
+	char file[256], opt[16] = "";
+	size_t size;
+	unsigned char *mem;
+	int kind;
+
+	if(sscanf(spec, "spi:nor:%255[^:]:%15s", file, opt) >= 1)
+		kind = 0;
+	else if(sscanf(spec, "spi:sd:%255[^:]:%15s", file, opt) >= 1)
+		kind = 1;
+	else if(sscanf(spec, "twi:eeprom:%255[^:]:%15s", file, opt) >= 1)
+		kind = 2;
+	else
+		return -1;
+	if(!(mem = map_image(file, &size)))
+		return -1;
+
+	if(kind < 2) {
+		struct spi_device *dev;
+		int port = opt[0]? opt[0] : 'b', pin = opt[0]? opt[1]-'0' : 0;
+		if(port < 'a' || port > 'd' || pin < 0 || pin > 7)
+			return -1;
+		if(kind == 0) {
+			struct nor *nor = calloc(1, sizeof *nor);
+			nor->mem = mem, nor->size = size;
+			nor->spi.select = nor_select, nor->spi.transfer = nor_transfer;
+			dev = &nor->spi;
+		} else {
+			struct sd *sd;
+			if(size < 512*1024)
+				return -1;
+			sd = calloc(1, sizeof *sd);
+			sd->mem = mem, sd->size = size, sd->idle = 1;
+			sd->spi.select = sd_select, sd->spi.transfer = sd_transfer;
+			dev = &sd->spi;
+		}
+		dev->cs_port = 0x02 + 3*(port-'a');
+		dev->cs_pin = pin;
+		dev->next = spi_devices;
+		spi_devices = dev;
+	} else {
+		struct eeprom24 *ee = calloc(1, sizeof *ee);
+		ee->mem = mem, ee->size = size;
+		ee->alen = size > 2048? 2 : 1;
+		ee->twi.start = ee_start, ee->twi.write = ee_write, ee->twi.read = ee_read, ee->twi.stop = ee_stop;
+		ee->twi.addr = opt[0]? strtoul(opt, NULL, 0) : 0x50;
+		ee->twi.next = twi_devices;
+		twi_devices = &ee->twi;
+	}
+	return 0;
+}
@@ -0,0 +1,23 @@
+/* chips on the SPI and TWI buses (see devices.c) */
+
+struct spi_device {
+	void (*select)(struct spi_device *dev, int selected);
+	unsigned char (*transfer)(struct spi_device *dev, unsigned char out);
+	int cs_port, cs_pin;          /* chip select (active low): I/O address of PORTx, bit */
+	int selected;
+	struct spi_device *next;
+};
+
+struct twi_device {
+	int (*start)(struct twi_device *dev, int read);
+	int (*write)(struct twi_device *dev, unsigned char data);
+	unsigned char (*read)(struct twi_device *dev, int ack);
+	void (*stop)(struct twi_device *dev);
+	unsigned char addr;           /* 7-bit slave address */
+	struct twi_device *next;
+};
+
+extern struct spi_device *spi_devices;
+extern struct twi_device *twi_devices;
+
+extern int device_add(const char *spec);
@@ -0,0 +1,565 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+#include "ihexread.h"
+
+/* fuzz: a harness for fuzzing the code that parses serial input, e.g. with AFL++:
+
+     afl-fuzz -i seeds -o findings -- ./fuzz firmware.hex
+
+   the firmware is started once, and run until it first waits for a byte on USART0 (polls an
+   empty receiver, enables the receive interrupt or goes to sleep); that state is kept, and for
+   every input only the 256-byte pages of SRAM and EEPROM that were changed are copied back.
+   the input is then fed through UDR0 as fast as the firmware reads it, and the run ends when the
+   firmware waits for more after reading all of it, sleeps with nothing to do, is reset by the
+   watchdog (on emulated time) or runs out of its budget of cycles.
+
+   a crash is an unhandled opcode, a BREAK, a jump-to-self with interrupts disabled (what avr-libc's
+   abort and exit end in), or any fault that the checked core detects (stack under/overflow,
+   accesses above RAMEND, reads of uninitialised SRAM); it is reported as SIGABRT to the fuzzer.
+
+   coverage comes from avr_COVER: every executed instruction and every branch outcome counts as
+   an edge in AFL's shared memory area (or in libFuzzer's extra counters, if built with
+   -DLIBFUZZER and -fsanitize=fuzzer; the firmware is then named by $FUZZ_FLASH).
+
+   without a fuzzer, the inputs named on the command line (or stdin) are run once, for triage.
+   the rest of the mcu is not modelled: other I/O registers read back what was written */
+
+extern volatile unsigned long long avr_cycle;
+extern volatile unsigned long avr_last_wdr;
+extern volatile unsigned char avr_IO[];
+extern volatile unsigned char avr_INT, avr_HALT;
+extern volatile unsigned long avr_INTR;
+extern volatile unsigned long long avr_DEADLINE;
+extern volatile unsigned long long avr_LIMIT;
+extern volatile unsigned long long avr_IRQ;
+
+extern unsigned long avr_PC, avr_BOOT_PC;
+extern unsigned char avr_ADDR[], avr_CHECKED, avr_COVER[], avr_SHADOW[];
+extern unsigned short int avr_FLASH[];
+extern unsigned short int avr_SP, avr_STACK_LIMIT;
+extern unsigned char volatile avr_SREG;
+
+int avr_run_until(unsigned long long cycle);
+void avr_reset();
+
+#define RAMEND  0x21FF
+#define PAGE    256
+#define NEVER   (~0ull)
+#define MAX_INPUT 0x10000
+#define MAX_POLLS 8
+
+#define UCSR0A 0xA0
+#define UCSR0B 0xA1
+#define UDR0   0xA6
+#define MCUSR  0x34
+#define WDTCSR 0x40
+#define EEARH  0x22
+#define EEARL  0x21
+#define EEDR   0x20
+#define EECR   0x1F
+
+enum ucsr_bits {
+	RXC = 1<<7, TXC = 1<<6, UDRE = 1<<5, RXCIE = 1<<7
+};
+
+enum wdtcr_bits {
+	WDIF = 1<<7, WDIE = 1<<6, WDCE = 1<<4, WDE = 1<<3
+};
+
+enum eecr_bits {
+	EEMPE = 1<<2, EEPE = 1<<1, EERE = 1<<0
+};
+
+#define PORF 1
+
+#define vec_WDIF  0x18
+#define vec_RXC   0x32
+#define vec_UDRE  0x34
+#define vec_TXC   0x36
+
+#define IRQ(vec) (1ull << (vec)/2)
+
+/* the watchdog oscillator runs at 128kHz, the mcu at 16MHz */
+#define WD_CYCLES (16000000/128000)
+
+enum outcome {
+	DONE, TIMEOUT, WATCHDOG, CRASH
+};
+
+static const char *outcome_name[] = { "ok", "timeout", "watchdog reset", "crash" };
+
+static unsigned long long limit = 10000000, drain = 100000;
+static unsigned flash_words;
+static int verbose;
+
+static unsigned char eeprom[0x1000];
+
+/* the state after booting */
+static struct {
+	unsigned char data[RAMEND+1], shadow[RAMEND+1], eeprom[sizeof eeprom];
+	unsigned long pc, last_wdr;
+	unsigned long long cycle, irq;
+} boot;
+
+static int booting, polls;
+static const unsigned char *input;
+static size_t input_len, input_pos;
+static unsigned long long drain_at;
+
+static enum outcome outcome;
+static char reason[64];
+
+#ifdef LIBFUZZER
+static unsigned char edge_map[0x10000] __attribute__((section("__libfuzzer_extra_counters")));
+#else
+static unsigned char edge_map[0x10000];
+#endif
+static unsigned char *edges = edge_map;
+
+/* ends the run after the current instruction */
+static void stop(enum outcome o)
+{
+	if(outcome == DONE)
+		outcome = o;
+	avr_HALT = 1;
+	avr_INT = 1;
+}
+
+void avr_fault(int kind, int addr)
+{
+	static const char *fault_name[] = {
+		"", "read of uninitialised SRAM", "access above RAMEND", "unmapped I/O",
+		"stack overflow", "stack underflow"
+	};
+	if(outcome == CRASH)
+		return;
+	snprintf(reason, sizeof reason, "%s at %04X", fault_name[kind%6], addr);
+	stop(CRASH);
+}
+
+static void irq_update(unsigned long long mask, unsigned long long req)
+{
+	avr_IRQ = avr_IRQ & ~mask | req;
+	if(req)
+		avr_INT = 1;
+}
+
+static void uart_irq(void)
+{
+	int req = avr_IO[UCSR0A] & avr_IO[UCSR0B];
+	irq_update(IRQ(vec_RXC)|IRQ(vec_UDRE)|IRQ(vec_TXC),
+	           (req&RXC? IRQ(vec_RXC) : 0) | (req&UDRE? IRQ(vec_UDRE) : 0) | (req&TXC? IRQ(vec_TXC) : 0));
+}
+
+static void uart_update(void)
+{
+	avr_IO[UCSR0A] = avr_IO[UCSR0A] & ~RXC | UDRE | (input_pos < input_len? RXC : 0);
+	uart_irq();
+}
+
+static unsigned long wd_timeout(void)
+{
+	unsigned char wdtcr = avr_IO[WDTCSR];
+	unsigned wdp = (wdtcr&0x20)/4 + (wdtcr&0x7);
+	if(!(wdtcr & (WDE|WDIE)))
+		return 0;
+	return WD_CYCLES * (2048ul << (wdp > 9? 9 : wdp));
+}
+
+/* the next deadline is the watchdog timeout, or the end of the time the firmware gets to process
+   the input after reading all of it */
+static void schedule(void)
+{
+	unsigned long timeout = wd_timeout(), since = (unsigned long)avr_cycle - avr_last_wdr;
+	unsigned long long at = avr_cycle + (1ul<<30);
+	if(timeout)
+		at = avr_cycle + (since < timeout? timeout - since : 0);
+	if(drain_at < at)
+		at = drain_at;
+	avr_DEADLINE = at < avr_LIMIT? at : avr_LIMIT;
+}
+
+void avr_deadline(void)
+{
+	unsigned long timeout = wd_timeout();
+	if(avr_cycle >= drain_at) {
+		drain_at = NEVER;
+		stop(DONE);
+	}
+	if(timeout && (unsigned long)avr_cycle - avr_last_wdr >= timeout) {
+		avr_last_wdr = avr_cycle;
+		if(avr_IO[WDTCSR] & WDIE) {
+			avr_IO[WDTCSR] |= WDIF;
+			if(avr_IO[WDTCSR] & WDE)
+				avr_IO[WDTCSR] &= ~WDIE;
+			irq_update(0, IRQ(vec_WDIF));
+		} else
+			stop(WATCHDOG);
+	}
+	schedule();
+	if(avr_DEADLINE <= avr_cycle)
+		avr_DEADLINE = avr_cycle + 1;
+}
+
+void avr_interrupt(int n)
+{
+	avr_IRQ &= ~(1ull << n);
+	switch(2*n) {
+	case vec_TXC:
+		avr_IO[UCSR0A] &= ~TXC;
+		break;
+	case vec_WDIF:
+		avr_IO[WDTCSR] &= ~WDIF;
+		break;
+	}
+}
+
+void avr_io_in(int port)
+{
+	switch(port) {
+	case UDR0:
+	case UCSR0A:
+		/* the firmware waits for more input than there is; UCSR0A is also polled before
+		   sending, but then UDR0 gets written soon after */
+		if(input_pos >= input_len && (port == UDR0 || ++polls == MAX_POLLS))
+			stop(DONE);
+		else if(port == UDR0) {
+			avr_IO[UDR0] = input[input_pos++];
+			if(input_pos == input_len) {
+				drain_at = avr_cycle + drain;
+				schedule();
+			}
+		}
+		uart_update();
+		break;
+	}
+}
+
+void avr_io_out(int port, unsigned char prev)
+{
+	static unsigned long long last_eempe = -4;
+	switch(port) {
+	case UDR0:
+		polls = 0;
+		if(verbose)
+			putchar(avr_IO[port]);
+		avr_IO[UCSR0A] |= TXC|UDRE;
+		uart_irq();
+		break;
+	case UCSR0A:
+		/* only allow writing the R/W parts */
+		avr_IO[port] = prev&~0x43 | (avr_IO[port]&0x43 | ~prev&TXC) ^ TXC;
+		uart_irq();
+		break;
+	case UCSR0B:
+		if(booting && avr_IO[port] & RXCIE)
+			stop(DONE);
+		uart_update();
+		break;
+	case EECR:
+		if(avr_cycle-last_eempe <= 4 && avr_IO[port]&EEPE)
+			eeprom[(avr_IO[EEARH]<<8 | avr_IO[EEARL]) % sizeof eeprom] = avr_IO[EEDR];
+		else if(avr_IO[port]&EERE)
+			avr_IO[EEDR] = eeprom[(avr_IO[EEARH]<<8 | avr_IO[EEARL]) % sizeof eeprom];
+		if(avr_IO[port] & EEMPE)
+			last_eempe = avr_cycle;
+		avr_IO[port] &= ~(EEPE|EERE);
+		break;
+	case WDTCSR:
+		/* writing a one clears WDIF; the timed sequence is not enforced */
+		avr_IO[port] = avr_IO[port] & ~(WDCE|WDIF) | prev & WDIF & ~avr_IO[port];
+		schedule();
+		break;
+	}
+}
+
+/* runs the mcu until the run ends */
+static enum outcome run(void)
+{
+	unsigned long long end = avr_cycle + limit;
+	int status;
+	outcome = DONE;
+	for(;;) {
+		status = avr_run_until(end);
+		switch(status) {
+		case 0:
+		case 4:
+			avr_HALT = 0;
+			return outcome;
+		case 1:
+			if(avr_IRQ && avr_SREG & 0x80)
+				continue;
+			return outcome;
+		case 2:
+			strcpy(reason, "break");
+			return CRASH;
+		case 3:
+			if(avr_IRQ && avr_SREG & 0x80)
+				continue;
+			if(avr_SREG & 0x80)
+				return outcome;
+			strcpy(reason, "abort (rjmp -1 with interrupts disabled)");
+			return CRASH;
+		case 5:
+			return TIMEOUT;
+		default:
+			snprintf(reason, sizeof reason, "unhandled opcode %04X", status & 0xFFFF);
+			return CRASH;
+		}
+	}
+}
+
+static void snapshot(void)
+{
+	memcpy(boot.data, avr_ADDR, sizeof boot.data);
+	memcpy(boot.shadow, avr_SHADOW, sizeof boot.shadow);
+	memcpy(boot.eeprom, eeprom, sizeof eeprom);
+	boot.pc       = avr_PC;
+	boot.last_wdr = avr_last_wdr;
+	boot.cycle    = avr_cycle;
+	boot.irq      = avr_IRQ;
+}
+
+static void restore_pages(unsigned char *dst, const unsigned char *src, size_t size)
+{
+	size_t p, n;
+	for(p=0; p < size; p += PAGE) {
+		n = size-p < PAGE? size-p : PAGE;
+		if(memcmp(dst+p, src+p, n) != 0)
+			memcpy(dst+p, src+p, n);
+	}
+}
+
+static void restore(void)
+{
+	restore_pages(avr_ADDR, boot.data, sizeof boot.data);
+	restore_pages(avr_SHADOW, boot.shadow, sizeof boot.shadow);
+	restore_pages(eeprom, boot.eeprom, sizeof eeprom);
+	avr_PC       = boot.pc;
+	avr_last_wdr = boot.last_wdr;
+	avr_cycle    = boot.cycle;
+	avr_IRQ      = boot.irq;
+	avr_INTR     = 0;
+	avr_HALT     = 0;
+	avr_INT      = avr_IRQ != 0;
+}
+
+/* every instruction and branch outcome that was reached is an edge */
+static void collect_edges(void)
+{
+	unsigned w, b;
+	for(w=0; w < flash_words; w++)
+		if(avr_COVER[w]) {
+			for(b=0; b < 3; b++)
+				if(avr_COVER[w] & 1<<b) {
+					unsigned i = (w<<2 | b) * 0x9E3779B1u >> 16;
+					if(edges[i] < 255)
+						edges[i]++;
+				}
+			avr_COVER[w] = 0;
+		}
+}
+
+static enum outcome run_input(const unsigned char *data, size_t len)
+{
+	enum outcome o;
+	restore();
+	input = data;
+	input_len = len;
+	input_pos = 0;
+	polls = 0;
+	drain_at = NEVER;
+	reason[0] = '\0';
+	uart_update();
+	schedule();
+	o = run();
+	collect_edges();
+	return o;
+}
+
+static int load(const char *flash, const char *eeprom_file)
+{
+	enum outcome o;
+	int n, w;
+	memset(avr_FLASH, 0xFF, 0x40000);
+	if((n = ihex_read(flash, avr_FLASH, 0x40000, &avr_BOOT_PC)) < 0) {
+		fprintf(stderr, "could not read %s\n", flash);
+		return -1;
+	}
+	avr_BOOT_PC >>= 1;
+	for(w=0x20000; w > 0 && avr_FLASH[w-1] == 0xFFFF; w--)
+		;
+	flash_words = w;
+	memset(eeprom, 0xFF, sizeof eeprom);
+	if(eeprom_file && ihex_read(eeprom_file, eeprom, sizeof eeprom, NULL) < 0) {
+		fprintf(stderr, "could not read %s\n", eeprom_file);
+		return -1;
+	}
+
+	avr_CHECKED = 1;
+	avr_reset();
+	avr_IO[MCUSR] = PORF;
+	booting = 1;
+	drain_at = NEVER;
+	schedule();
+	o = run();
+	booting = 0;
+	if(o != DONE) {
+		fprintf(stderr, "the firmware does not wait for input: %s%s%s\n", outcome_name[o], *reason? ": " : "", reason);
+		return -1;
+	}
+	memset(avr_COVER, 0, flash_words);
+	snapshot();
+	fprintf(stderr, "booted in %llu cycles, waiting for input at %04lX\n", avr_cycle, avr_PC);
+	return 0;
+}
+
+#ifdef LIBFUZZER
+
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+	const char *flash = getenv("FUZZ_FLASH");
+	if(!flash || load(flash, getenv("FUZZ_EEPROM")) != 0) {
+		fprintf(stderr, "%s\n", "set FUZZ_FLASH to the firmware to be fuzzed");
+		exit(2);
+	}
+	if(getenv("FUZZ_LIMIT"))
+		limit = strtoull(getenv("FUZZ_LIMIT"), NULL, 0);
+	return 0;
+}
+
+int LLVMFuzzerTestOneInput(const unsigned char *data, size_t len)
+{
+	if(run_input(data, len) == CRASH) {
+		fprintf(stderr, "crash: %s at %04lX\n", reason, avr_PC);
+		abort();
+	}
+	return 0;
+}
+
+#else
+
+#define FORKSRV_FD 198
+#define PERSIST    10000
+
+static size_t read_input(int fd, unsigned char *buf)
+{
+	ssize_t n;
+	size_t len = 0;
+	/* afl-fuzz rewrites the same file for every input, so read it from the start */
+	while(len < MAX_INPUT && ((n = pread(fd, buf+len, MAX_INPUT-len, len)) > 0
+	                          || (n < 0 && (n = read(fd, buf+len, MAX_INPUT-len)) > 0)))
+		len += n;
+	return len;
+}
+
+/* the forkserver protocol of AFL: the child runs inputs until it has done PERSIST of them,
+   stopping itself after each, so that afl-fuzz can continue it for the next one */
+static void afl_fuzz(void)
+{
+	static unsigned char buf[MAX_INPUT];
+	unsigned char msg[4] = { 0 };
+	int status, stopped = 0, forkserver, i;
+	pid_t child = 0;
+	void *shm = shmat(atoi(getenv("__AFL_SHM_ID")), NULL, 0);
+	if(shm == (void*)-1) {
+		perror("shmat");
+		exit(2);
+	}
+	edges = shm;
+
+	if((forkserver = write(FORKSRV_FD+1, msg, 4) == 4))
+		for(;;) {
+			if(read(FORKSRV_FD, msg, 4) != 4)
+				exit(0);
+			if(stopped && (msg[0]|msg[1]|msg[2]|msg[3])) { /* afl-fuzz killed it after a timeout */
+				waitpid(child, &status, 0);
+				stopped = 0;
+			}
+			if(stopped) {
+				kill(child, SIGCONT);
+				stopped = 0;
+			} else if((child = fork()) < 0) {
+				exit(2);
+			} else if(child == 0) {
+				close(FORKSRV_FD);
+				close(FORKSRV_FD+1);
+				break;
+			}
+			if(write(FORKSRV_FD+1, &child, 4) != 4 || waitpid(child, &status, WUNTRACED) < 0)
+				exit(2);
+			stopped = WIFSTOPPED(status);
+			if(write(FORKSRV_FD+1, &status, 4) != 4)
+				exit(2);
+		}
+
+	/* the child, or a run without the forkserver */
+	for(i=0; i < (forkserver? PERSIST : 1); i++) {
+		if(run_input(buf, read_input(STDIN_FILENO, buf)) == CRASH)
+			abort();
+		if(forkserver)
+			raise(SIGSTOP);
+	}
+	exit(0);
+}
+
+int main(int argc, char **argv)
+{
+	static unsigned char buf[MAX_INPUT];
+	const char *eeprom_file = NULL;
+	int crashes = 0;
+
+	for(; argv[1] && argv[1][0] == '-'; ++argv) {
+		if(strncmp(argv[1], "-limit:", 7) == 0)
+			limit = strtoull(argv[1]+7, NULL, 0);
+		else if(strncmp(argv[1], "-drain:", 7) == 0)
+			drain = strtoull(argv[1]+7, NULL, 0);
+		else if(strncmp(argv[1], "-stack:", 7) == 0)
+			avr_STACK_LIMIT = strtoul(argv[1]+7, NULL, 0) - 1;
+		else if(strncmp(argv[1], "-eeprom:", 8) == 0)
+			eeprom_file = argv[1]+8;
+		else if(strcmp(argv[1], "-v") == 0)
+			verbose = 1;
+		else
+			break;
+	}
+	if(!argv[1] || argv[1][0] == '-') {
+		fprintf(stderr, "usage: fuzz [-limit:cycles] [-drain:cycles] [-stack:end_of_bss] [-eeprom:file.hex] [-v] flash.hex [input...]\n");
+		return 2;
+	}
+	if(load(argv[1], eeprom_file) != 0)
+		return 2;
+
+	if(getenv("__AFL_SHM_ID"))
+		afl_fuzz();
+
+	if(!argv[2]) {
+		enum outcome o = run_input(buf, read_input(STDIN_FILENO, buf));
+		fprintf(stderr, "%s%s%s\n", outcome_name[o], *reason? ": " : "", reason);
+		return o == CRASH;
+	}
+	for(argv += 2; *argv; argv++) {
+		FILE *f = fopen(*argv, "rb");
+		enum outcome o;
+		size_t len;
+		if(!f) {
+			perror(*argv);
+			continue;
+		}
+		len = fread(buf, 1, sizeof buf, f);
+		fclose(f);
+		o = run_input(buf, len);
+		printf("%s: %s%s%s (pc %04lX, %llu cycles)\n", *argv, outcome_name[o], *reason? ": " : "", reason,
+		       avr_PC, avr_cycle - boot.cycle);
+		crashes += o == CRASH;
+	}
+	return crashes > 0;
+}
+
+#endif
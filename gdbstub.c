@@ -0,0 +1,497 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "watch.h"
+
+/* a GDB remote serial protocol server, for use with avr-gdb ("target remote :1234")
+
+   software breakpoints are set by overwriting the flash word with a BREAK instruction,
+   so the emulator runs at full speed when no breakpoint is hit; the original contents
+   are shown to the debugger when it reads the flash memory.
+
+   while the mcu is running, a thread watches the connection; when a debugger attaches, sends
+   a ^C or goes away, the emulator is stopped via avr_HALT. all other communication, and all
+   patching of the flash, happens on the emulator thread, in gdb_stop().
+
+   watchpoints (Z2/Z3/Z4) on the data memory are supported by the checked core, which the
+   first one switches to; see watch.c */
+
+extern volatile unsigned long long avr_cycle;
+extern volatile unsigned char avr_INT;
+extern volatile unsigned char avr_HALT;
+extern unsigned long avr_PC;
+extern unsigned char avr_ADDR[];
+extern unsigned short int avr_FLASH[];
+extern unsigned short int avr_SP;
+extern unsigned char volatile avr_SREG;
+
+int avr_step();
+
+/* wakes the emulator thread if it is waiting for an interrupt (see tester.c) */
+extern void idle_wake(void) __attribute__((weak));
+
+#define BREAK 0x9598
+#define MAX_BREAKPOINTS 64
+
+/* memory map used by avr-gdb */
+#define GDB_SRAM   0x800000
+#define GDB_EEPROM 0x810000
+
+static struct breakpoint {
+	unsigned long addr;
+	unsigned short orig;
+} bp[MAX_BREAKPOINTS];
+static int bp_num;
+
+static size_t flash_size;
+static unsigned char *eeprom;
+static size_t eeprom_size;
+
+static int listen_fd = -1;
+static int conn_fd = -1;
+static pthread_t gdb_thread;
+static pthread_mutex_t gdb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gdb_resumed = PTHREAD_COND_INITIALIZER;
+static volatile char stopped;   /* if set, the connection is owned by the emulator thread */
+static char detaching;          /* has the connection been closed by the debugger? */
+static char announce;           /* should a stop be reported without being asked? */
+
+static int bp_remove(unsigned long addr);
+
+static void request_stop(void)
+{
+	stopped = 1;
+	avr_HALT = 1;
+	avr_INT = 1;
+	if(idle_wake)
+		idle_wake();
+}
+
+static void *gdb_listener(void *arg)
+{
+	for(;;) {
+		int fd = accept(listen_fd, NULL, NULL), one = 1;
+		if(fd < 0) continue;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		fprintf(stderr, "%s\n", "debugger attached");
+
+		pthread_mutex_lock(&gdb_lock);
+		conn_fd = fd;
+		announce = 0;
+		request_stop();
+		while(conn_fd >= 0) {
+			struct pollfd info[1] = { fd, POLLIN, };
+			char c;
+			ssize_t n;
+			while(stopped)
+				pthread_cond_wait(&gdb_resumed, &gdb_lock);
+			if(conn_fd < 0) break;
+			pthread_mutex_unlock(&gdb_lock);
+			poll(info, 1, -1);
+			pthread_mutex_lock(&gdb_lock);
+			if(stopped) continue;
+			n = recv(fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+			if(n == 0 || n < 0 && info[0].revents & (POLLHUP|POLLERR)) {
+				detaching = 1;
+				request_stop();
+			} else if(n > 0) {
+				if(c == 0x03) recv(fd, &c, 1, 0);
+				request_stop();
+			}
+		}
+		pthread_mutex_unlock(&gdb_lock);
+	}
+	return NULL;
+}
+
+/* spec is either a TCP port number (bound to localhost) or the path of a unix socket */
+int gdb_init(const char *spec, size_t flash, unsigned char *ee, size_t ee_size)
+{
+	flash_size = flash;
+	eeprom = ee;
+	eeprom_size = ee_size;
+
+	if(strchr(spec, '/')) {
+		struct sockaddr_un addr = { AF_UNIX, };
+		strncpy(addr.sun_path, spec, sizeof addr.sun_path-1);
+		unlink(spec);
+		listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(listen_fd < 0 || bind(listen_fd, (struct sockaddr*)&addr, sizeof addr) != 0)
+			return -1;
+	} else {
+		struct sockaddr_in addr = { AF_INET, };
+		int one = 1;
+		addr.sin_port = htons(*spec? atoi(spec) : 1234);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+		if(listen_fd < 0) return -1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+		if(bind(listen_fd, (struct sockaddr*)&addr, sizeof addr) != 0)
+			return -1;
+	}
+	if(listen(listen_fd, 1) != 0)
+		return -1;
+	return pthread_create(&gdb_thread, NULL, gdb_listener, NULL);
+}
+
+/* breakpoint management */
+
+static struct breakpoint *bp_find(unsigned long addr)
+{
+	int i;
+	for(i=0; i < bp_num; i++)
+		if(bp[i].addr == addr) return &bp[i];
+	return NULL;
+}
+
+static int bp_insert(unsigned long addr)
+{
+	if(addr >= flash_size/2) return -1;
+	if(bp_find(addr)) return 0;
+	if(bp_num == MAX_BREAKPOINTS) return -1;
+	bp[bp_num].addr = addr;
+	bp[bp_num].orig = avr_FLASH[addr];
+	bp_num++;
+	avr_FLASH[addr] = BREAK;
+	return 0;
+}
+
+static int bp_remove(unsigned long addr)
+{
+	struct breakpoint *b = bp_find(addr);
+	if(!b) return -1;
+	avr_FLASH[addr] = b->orig;
+	*b = bp[--bp_num];
+	return 0;
+}
+
+/* called before (written = 0) and after (written = 1) the mcu programs these words of flash
+   itself, so that the breakpoints among them end up over the new contents */
+void gdb_flash(unsigned long addr, unsigned long words, int written)
+{
+	int i;
+	for(i=0; i < bp_num; i++)
+		if(bp[i].addr - addr < words) {
+			if(written) {
+				bp[i].orig = avr_FLASH[bp[i].addr];
+				avr_FLASH[bp[i].addr] = BREAK;
+			} else
+				avr_FLASH[bp[i].addr] = bp[i].orig;
+		}
+}
+
+static int gdb_step(void)
+{
+	struct breakpoint *b = bp_find(avr_PC);
+	int status;
+	if(b) avr_FLASH[b->addr] = b->orig;
+	status = avr_step();
+	if(b) avr_FLASH[b->addr] = BREAK;
+	return status;
+}
+
+/* memory access, using the avr-gdb address space */
+
+static int mem_byte(unsigned long addr, int value)
+{
+	unsigned char *p;
+	if(addr < GDB_SRAM) {
+		struct breakpoint *b = bp_find(addr/2);
+		if(addr >= flash_size) return -1;
+		p = b? (unsigned char*)&b->orig + (addr&1) : (unsigned char*)avr_FLASH + addr;
+	} else if(addr < GDB_EEPROM) {
+		if(addr-GDB_SRAM >= 0x10000) return -1;
+		p = avr_ADDR + (addr-GDB_SRAM);
+	} else {
+		if(addr-GDB_EEPROM >= eeprom_size) return -1;
+		p = eeprom + (addr-GDB_EEPROM);
+	}
+	if(value >= 0) *p = value;
+	return *p;
+}
+
+/* registers: r0..r31, SREG, SP, PC */
+
+static int reg_size(int n)
+{
+	return n < 33? 1 : n == 33? 2 : n == 34? 4 : 0;
+}
+
+static unsigned long reg_read(int n)
+{
+	return n < 32? avr_ADDR[n] : n == 32? avr_SREG : n == 33? avr_SP : avr_PC*2;
+}
+
+static void reg_write(int n, unsigned long val)
+{
+	if(n < 32) avr_ADDR[n] = val;
+	else if(n == 32) avr_SREG = val;
+	else if(n == 33) avr_SP = val;
+	else if(n == 34) avr_PC = val/2;
+}
+
+/* packet I/O */
+
+static char hexdigit(int n)
+{
+	return "0123456789abcdef"[n&0xF];
+}
+
+static int hexval(int c)
+{
+	return c >= '0' && c <= '9'? c-'0' : c >= 'a' && c <= 'f'? c-'a'+10 : c >= 'A' && c <= 'F'? c-'A'+10 : -1;
+}
+
+static unsigned long hexnum(const char **p)
+{
+	unsigned long x = 0;
+	while(hexval(**p) >= 0)
+		x = x<<4 | hexval(*(*p)++);
+	return x;
+}
+
+static int getbyte(void)
+{
+	unsigned char c;
+	return recv(conn_fd, &c, 1, 0) == 1? c : -1;
+}
+
+static int get_packet(char *buf, size_t size)
+{
+	int c;
+	size_t n;
+	do {
+		if((c = getbyte()) < 0) return -1;
+	} while(c != '$');
+	for(n=0; (c = getbyte()) != '#'; ) {
+		if(c < 0) return -1;
+		if(n < size-1) buf[n++] = c;
+	}
+	buf[n] = '\0';
+	if(getbyte() < 0 || getbyte() < 0) return -1;  /* ignore the checksum; we are on a reliable transport */
+	send(conn_fd, "+", 1, 0);
+	return n;
+}
+
+static void put_packet(const char *data)
+{
+	static char buf[4096+4];
+	unsigned char sum = 0;
+	size_t n = 0;
+	buf[n++] = '$';
+	for(; *data && n < sizeof buf-3; n++)
+		sum += buf[n] = *data++;
+	buf[n++] = '#';
+	buf[n++] = hexdigit(sum>>4);
+	buf[n++] = hexdigit(sum);
+	send(conn_fd, buf, n, 0);
+}
+
+static struct watch_hit hit;
+static char watched;
+
+static void stop_reply(char *buf, int sig)
+{
+	if(watched)
+		sprintf(buf, "T%02x%s:%x;", sig, hit.kind == WATCH_WRITE? "watch" : "rwatch", GDB_SRAM+hit.addr);
+	else
+		sprintf(buf, "S%02x", sig);
+}
+
+static void put_stop_reply(int sig)
+{
+	char buf[32];
+	stop_reply(buf, sig);
+	put_packet(buf);
+}
+
+#define SIGINT_GDB  2
+#define SIGTRAP_GDB 5
+
+/* the debugger loop; returns when the mcu should continue */
+static void gdb_session(int sig)
+{
+	static char pkt[4096+1];
+	static char out[4096+1];
+
+	if(announce) put_stop_reply(sig);
+	announce = 1;
+
+	while(get_packet(pkt, sizeof pkt) >= 0) {
+		const char *p = pkt+1;
+		unsigned long addr, len, i;
+		int n, c;
+		out[0] = '\0';
+		switch(pkt[0]) {
+		case '?':
+			stop_reply(out, sig);
+			break;
+		case 'g':
+			for(n=0, i=0; n < 35; n++) {
+				unsigned long val = reg_read(n);
+				for(c=reg_size(n); c--; val >>= 8) {
+					out[i++] = hexdigit(val>>4);
+					out[i++] = hexdigit(val);
+				}
+			}
+			out[i] = '\0';
+			break;
+		case 'G':
+			for(n=0; n < 35; n++) {
+				unsigned long val = 0;
+				for(c=0; c < reg_size(n) && hexval(p[0]) >= 0 && hexval(p[1]) >= 0; c++, p+=2)
+					val |= (unsigned long)(hexval(p[0])<<4 | hexval(p[1])) << 8*c;
+				reg_write(n, val);
+			}
+			strcpy(out, "OK");
+			break;
+		case 'p':
+			n = hexnum(&p);
+			if(n > 34) { strcpy(out, "E01"); break; }
+			for(i=0, addr=reg_read(n), c=reg_size(n); c--; addr >>= 8) {
+				out[i++] = hexdigit(addr>>4);
+				out[i++] = hexdigit(addr);
+			}
+			out[i] = '\0';
+			break;
+		case 'P':
+			n = hexnum(&p);
+			if(n > 34 || *p++ != '=') { strcpy(out, "E01"); break; }
+			for(addr=0, c=0; c < reg_size(n) && hexval(p[0]) >= 0; c++, p+=2)
+				addr |= (unsigned long)(hexval(p[0])<<4 | hexval(p[1])) << 8*c;
+			reg_write(n, addr);
+			strcpy(out, "OK");
+			break;
+		case 'm':
+			addr = hexnum(&p), p++;
+			len = hexnum(&p);
+			if(len > sizeof out/2-1) len = sizeof out/2-1;
+			for(i=0; i < len && (c = mem_byte(addr+i, -1)) >= 0; i++) {
+				out[2*i]   = hexdigit(c>>4);
+				out[2*i+1] = hexdigit(c);
+			}
+			out[2*i] = '\0';
+			if(i == 0 && len > 0) strcpy(out, "E01");
+			break;
+		case 'M':
+			addr = hexnum(&p), p++;
+			len = hexnum(&p), p++;
+			for(i=0; i < len && hexval(p[0]) >= 0 && hexval(p[1]) >= 0; i++, p+=2)
+				if(mem_byte(addr+i, hexval(p[0])<<4 | hexval(p[1])) < 0) break;
+			strcpy(out, i == len? "OK" : "E01");
+			break;
+		case 'Z':
+		case 'z':
+			c = *p++ - '0';
+			p++;
+			addr = hexnum(&p), p++;
+			len = hexnum(&p);
+			if(c == 0 || c == 1) {
+				n = pkt[0] == 'Z'? bp_insert(addr/2) : bp_remove(addr/2);
+			} else if(c >= 2 && c <= 4 && addr >= GDB_SRAM && addr < GDB_EEPROM) {
+				static const int kind[] = { WATCH_WRITE, WATCH_READ, WATCH_ACCESS };
+				addr -= GDB_SRAM;
+				n = pkt[0] == 'Z'? watch_add(addr, len, kind[c-2]) : watch_remove(addr, len, kind[c-2]);
+			} else
+				break;
+			strcpy(out, n == 0? "OK" : "E01");
+			break;
+		case 's':
+			if(*p) avr_PC = hexnum(&p)/2;
+			gdb_step();
+			sprintf(out, "S%02x", SIGTRAP_GDB);
+			break;
+		case 'c':
+			if(*p) avr_PC = hexnum(&p)/2;
+			if(bp_find(avr_PC)) gdb_step();
+			return;
+		case 'D':
+			put_packet("OK");
+			goto detach;
+		case 'k':
+			exit(0);
+		case 'H':
+			strcpy(out, "OK");
+			break;
+		case 'q':
+			if(strncmp(pkt, "qSupported", 10) == 0)
+				sprintf(out, "PacketSize=%x", (unsigned)sizeof pkt-1);
+			else if(strcmp(pkt, "qAttached") == 0)
+				strcpy(out, "1");
+			break;
+		}
+		put_packet(out);
+	}
+detach:
+	while(bp_num)
+		bp_remove(bp[0].addr);
+	watch_clear();
+	shutdown(conn_fd, SHUT_RDWR);
+}
+
+/* called by the emulator thread with the status returned by avr_run; returns non-zero if a
+   debugger has handled the situation and the emulator can resume */
+int gdb_stop(int status)
+{
+	int sig;
+	if(status != 2 && status != 4)
+		return 0;
+
+	pthread_mutex_lock(&gdb_lock);
+	avr_HALT = 0;
+	if(conn_fd < 0) {
+		pthread_mutex_unlock(&gdb_lock);
+		return 0;
+	}
+	if(detaching) {
+		/* the core may already have fetched one of the BREAKs, so it is recognised before
+		   they are removed; any other stop is left to the caller */
+		int hit_bp = status == 2 && bp_find(avr_PC-1);
+		if(hit_bp) {
+			avr_PC--;
+			avr_cycle--;
+		}
+		while(bp_num)
+			bp_remove(bp[0].addr);
+		if(status == 4) watch_triggered(&hit);
+		watch_clear();
+		close(conn_fd);
+		conn_fd = -1;
+		detaching = 0;
+		fprintf(stderr, "%s\n", "debugger detached");
+		stopped = 0;
+		pthread_cond_broadcast(&gdb_resumed);
+		pthread_mutex_unlock(&gdb_lock);
+		return hit_bp;
+	}
+	if(status == 4) {
+		watched = watch_triggered(&hit);
+		sig = watched? SIGTRAP_GDB : SIGINT_GDB;
+	} else {
+		watched = 0;
+		if(bp_find(avr_PC-1)) {
+			avr_PC--;
+			avr_cycle--;
+		}
+		sig = SIGTRAP_GDB;
+	}
+	stopped = 1;
+	pthread_mutex_unlock(&gdb_lock);
+
+	gdb_session(sig);
+
+	pthread_mutex_lock(&gdb_lock);
+	stopped = 0;
+	pthread_cond_broadcast(&gdb_resumed);
+	pthread_mutex_unlock(&gdb_lock);
+	return 1;
+}
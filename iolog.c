@@ -0,0 +1,100 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "iolog.h"
+#include "logring.h"
+
+/* logging the accesses of the mcu to i/o registers, with the cycle at which they happen.
+
+   the registers are selected by a mask (iolog_select), so that the others cost only the test
+   of a bit. a record is put into a ring, which a thread writes out in chunks (see logring.c).
+
+   the file starts with IOLOG_MAGIC, followed by a struct iolog_record for every access (in the
+   byte order of the host): for a read, old is the value before the host updated the register
+   and new the value that the mcu reads; for a write, old is the previous value and new what the
+   register holds after the host has handled the write. see iostat.c for a summary */
+
+extern volatile unsigned long long avr_cycle;
+extern unsigned long avr_IO_PC;
+extern unsigned short int avr_FLASH[];
+
+unsigned char iolog_ports[0x200/8];
+
+static int log_fd = -1;
+
+static void log_write(const void *records, unsigned n)
+{
+	write_all(log_fd, records, n * sizeof(struct iolog_record), "iolog");
+}
+
+static struct logring ring = {
+	.record  = sizeof(struct iolog_record),
+	.size    = 65536,
+	.chunk   = 4096,            /* the thread is woken when this many are waiting */
+	.consume = log_write,
+};
+
+/* ports are given as data addresses or ranges of them, e.g. 0x25,0xC0-0xC6; by default, all are logged */
+int iolog_select(const char *ports)
+{
+	char *p;
+	unsigned long lo, hi, a;
+	memset(iolog_ports, 0, sizeof iolog_ports);
+	do {
+		lo = hi = strtoul(ports, &p, 0);
+		if(*p == '-')
+			hi = strtoul(p+1, &p, 0);
+		if(p == ports || (*p && *p != ',') || lo < 0x20 || hi < lo || hi >= 0x20 + 8*sizeof iolog_ports)
+			return -1;
+		for(a=lo-0x20; a <= hi-0x20; a++)
+			iolog_ports[a>>3] |= 1<<(a&7);
+		ports = p+1;
+	} while(*p);
+	return 0;
+}
+
+int iolog_open(const char *file)
+{
+	size_t i;
+	if((log_fd = open(file, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666)) < 0)
+		return -1;
+	for(i=0; i < sizeof iolog_ports && !iolog_ports[i]; i++)
+		;
+	if(i == sizeof iolog_ports)
+		memset(iolog_ports, 0xFF, sizeof iolog_ports);
+	write_all(log_fd, IOLOG_MAGIC, 8, "iolog");
+	if(logring_start(&ring) != 0) {
+		close(log_fd);
+		return -1;
+	}
+	atexit(iolog_close);
+	return 0;
+}
+
+/* called by the emulator thread only */
+void iolog_record(int port, unsigned char old, unsigned char new, int write)
+{
+	unsigned pc = avr_IO_PC-1 & 0x1FFFF;
+	struct iolog_record *r = logring_slot(&ring);
+	/* avr_IO_PC follows the instruction, which may be a two-word LDS/STS of this address */
+	if((avr_FLASH[pc-1 & 0x1FFFF] & 0xFC0F) == 0x9000 && avr_FLASH[pc] == port + 0x20)
+		pc--;
+	r->cycle = avr_cycle;
+	r->pc    = pc;
+	r->addr  = port + 0x20 | (write? IOLOG_WRITE : 0);
+	r->old   = old;
+	r->new   = new;
+	logring_commit(&ring);
+}
+
+/* writes out what is left; called at exit */
+void iolog_close(void)
+{
+	if(log_fd < 0)
+		return;
+	logring_stop(&ring);
+	close(log_fd);
+	log_fd = -1;
+}
@@ -0,0 +1,21 @@
+/* a binary log of the accesses of the mcu to i/o registers (see iolog.c) */
+
+struct iolog_record {
+	unsigned long long cycle;
+	unsigned pc;                    /* word address of the instruction */
+	unsigned short addr;            /* data address of the register; IOLOG_WRITE is set for writes */
+	unsigned char old, new;
+};
+
+#define IOLOG_MAGIC "avriolog"
+#define IOLOG_WRITE 0x8000
+
+extern unsigned char iolog_ports[0x200/8];
+
+/* is the port (as passed to avr_io_in/avr_io_out) being logged? */
+#define iolog_selected(port) (iolog_ports[(port)>>3] & 1<<((port)&7))
+
+extern int iolog_select(const char *ports);
+extern int iolog_open(const char *file);
+extern void iolog_record(int port, unsigned char old, unsigned char new, int write);
+extern void iolog_close(void);
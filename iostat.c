@@ -0,0 +1,91 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "iolog.h"
+
+/* iostat: summarizes the logs written by "tester -iolog:file".
+
+     iostat file.log...
+
+   for every register that was accessed, the number of reads and writes, and a histogram of the
+   number of cycles between an access and the previous access to the same register (in powers of
+   two; the first access of every file has no predecessor) */
+
+#define PORTS   0x200
+#define BUCKETS 65
+
+static struct port {
+	unsigned long long reads, writes, first, last;
+	unsigned long long gap[BUCKETS];
+	int seen;
+} port[PORTS];
+
+static int bucket(unsigned long long gap)
+{
+	int n = 0;
+	while(gap) gap >>= 1, n++;
+	return n;
+}
+
+static int read_log(const char *name)
+{
+	static struct iolog_record buf[4096];
+	char magic[8];
+	size_t n, i;
+	struct port *p;
+	static unsigned long long prev[PORTS];
+	char has_prev[PORTS];
+	int k;
+	FILE *f = fopen(name, "rb");
+	if(!f) {
+		perror(name);
+		return -1;
+	}
+	if(fread(magic, sizeof magic, 1, f) != 1 || memcmp(magic, IOLOG_MAGIC, sizeof magic) != 0) {
+		fprintf(stderr, "%s: not an i/o log\n", name);
+		fclose(f);
+		return -1;
+	}
+	memset(has_prev, 0, sizeof has_prev);
+	while((n = fread(buf, sizeof *buf, sizeof buf/sizeof *buf, f)) > 0)
+		for(i=0; i < n; i++) {
+			k = buf[i].addr & ~IOLOG_WRITE;
+			if(k >= PORTS) continue;
+			p = &port[k];
+			if(has_prev[k])
+				p->gap[bucket(buf[i].cycle - prev[k])]++;
+			if(!p->seen || buf[i].cycle < p->first)
+				p->first = buf[i].cycle;
+			if(!p->seen || buf[i].cycle > p->last)
+				p->last = buf[i].cycle;
+			prev[k] = buf[i].cycle;
+			p->seen = has_prev[k] = 1;
+			if(buf[i].addr & IOLOG_WRITE)
+				p->writes++;
+			else
+				p->reads++;
+		}
+	fclose(f);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int i, k, b;
+	if(argc < 2) {
+		fprintf(stderr, "usage: iostat file.log...\n");
+		return 2;
+	}
+	for(i=1; i < argc; i++)
+		if(read_log(argv[i]) != 0)
+			return 1;
+	for(k=0; k < PORTS; k++) {
+		struct port *p = &port[k];
+		if(!p->seen) continue;
+		printf("%04x: %llu reads, %llu writes, cycles %llu to %llu\n", k, p->reads, p->writes, p->first, p->last);
+		for(b=0; b < BUCKETS; b++)
+			if(p->gap[b])
+				printf("  %12llu to %-12llu cycles apart: %llu\n", b? 1ull<<(b-1) : 0, b? (1ull<<(b-1))*2-1 : 0, p->gap[b]);
+	}
+	return 0;
+}
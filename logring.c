@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "logring.h"
+
+/* the emulator puts records into a ring (single producer, single consumer) without a system
+   call, and a thread hands them to consume() in batches. the thread is woken when a chunk of
+   records is waiting, and otherwise looks every FLUSH_NS; when there is nothing left to do, it
+   calls flush(), if given. the emulator only makes a system call if a chunk is complete while
+   the thread sleeps, or if the ring is full: then it waits until there is room again, so that
+   nothing is lost.
+
+   the owner sets record, size, chunk, consume and flush, and calls logring_start; records are
+   written into logring_slot() and published with logring_commit(), by the emulator thread only */
+
+#define FLUSH_NS 100000000
+
+static void futex_wait(volatile unsigned *addr, unsigned val, const struct timespec *timeout)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static void futex_wake(volatile unsigned *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+void write_all(int fd, const void *buf, size_t len, const char *what)
+{
+	const char *p = buf;
+	ssize_t n;
+	while(len > 0) {
+		if((n = write(fd, p, len)) < 0) {
+			if(errno == EINTR) continue;
+			perror(what);
+			return;
+		}
+		p += n, len -= n;
+	}
+}
+
+static void *logring_loop(void *arg)
+{
+	static const struct timespec period = { 0, FLUSH_NS };
+	struct logring *r = arg;
+	for(;;) {
+		unsigned tail = r->tail, head = r->head;
+		if(head - tail < r->chunk && !r->closing) {
+			r->idle = 1;
+			__sync_synchronize();
+			if(r->head - tail < r->chunk && !r->closing)
+				futex_wait(&r->head, head, &period);
+			r->idle = 0;
+			head = r->head;
+		}
+		if(head == tail) {
+			if(r->flush) /* nothing is happening; let the output catch up */
+				r->flush();
+			if(r->closing)
+				break;
+			continue;
+		}
+		__sync_synchronize();
+		while(tail != head) {  /* in at most two pieces */
+			unsigned len = r->size - tail % r->size;
+			if(len > head - tail)
+				len = head - tail;
+			r->consume(r->data + tail % r->size * r->record, len);
+			tail += len;
+		}
+		__sync_synchronize();
+		r->tail = tail;
+		__sync_synchronize();
+		if(r->full && __sync_bool_compare_and_swap(&r->full, 1, 0))
+			futex_wake(&r->tail);
+	}
+	return NULL;
+}
+
+int logring_start(struct logring *r)
+{
+	if(!(r->data = malloc(r->size * r->record)))
+		return -1;
+	if(pthread_create(&r->thread, NULL, logring_loop, r) != 0) {
+		free(r->data);
+		r->data = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* where the next record goes */
+void *logring_slot(struct logring *r)
+{
+	unsigned head = r->head;
+	while(head - r->tail == r->size) {
+		r->full = 1;
+		__sync_synchronize();
+		if(head - r->tail == r->size)
+			futex_wait(&r->tail, head - r->size, NULL);
+	}
+	return r->data + head % r->size * r->record;
+}
+
+void logring_commit(struct logring *r)
+{
+	unsigned head = r->head;
+	__sync_synchronize();
+	r->head = head+1;
+	if((head+1) % r->chunk == 0) {
+		__sync_synchronize();
+		if(r->idle)
+			futex_wake(&r->head);
+	}
+}
+
+/* hands over what is left, and waits for the thread */
+void logring_stop(struct logring *r)
+{
+	if(!r->data)
+		return;
+	r->closing = 1;
+	__sync_synchronize();
+	futex_wake(&r->head);
+	pthread_join(r->thread, NULL);
+	free(r->data);
+	r->data = NULL;
+}
@@ -0,0 +1,24 @@
+/* a ring of records from the emulator thread, which a thread of its own consumes (see logring.c) */
+
+#include <stddef.h>
+#include <pthread.h>
+
+struct logring {
+	volatile unsigned head, tail;
+	volatile int idle;            /* the thread waits for records */
+	volatile int full;            /* the emulator waits for room */
+	volatile int closing;
+	unsigned size, chunk;         /* in records; powers of two */
+	size_t record;                /* the size of a record */
+	char *data;
+	void (*consume)(const void *records, unsigned n);
+	void (*flush)(void);
+	pthread_t thread;
+};
+
+extern int logring_start(struct logring *r);
+extern void *logring_slot(struct logring *r);
+extern void logring_commit(struct logring *r);
+extern void logring_stop(struct logring *r);
+
+extern void write_all(int fd, const void *buf, size_t len, const char *what);
@@ -4,7 +4,18 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-/* this opens /dev/ptmx to get a master/slave pair, so we don't need 'socat' */
+/* this opens /dev/ptmx to get a master/slave pair, so we don't need 'socat'; make_stdin_pty
+   puts the master on stdin and stdout */
+
+int make_pty(const char **name)
+{
+	int fd = posix_openpt(O_RDWR|O_NOCTTY);
+	if(fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0)
+		return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	*name = ptsname(fd);
+	return fd;
+}
 
 const char* make_stdin_pty(void)
 {
@@ -0,0 +1,303 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <elf.h>
+#include "measure.h"
+
+/* measuring the number of cycles that functions in the firmware take, without changing it.
+
+   like the breakpoints of gdbstub.c, the start of a measurement is a BREAK instruction written
+   over the flash word, so that nothing is checked anywhere else; when the emulator stops there,
+   the return address on the stack gets a BREAK of its own until the function returns to it
+   (or, if a stop address was given, the measurement ends when that is reached instead).
+
+   with /noisr, the cycles spent in interrupt handlers while a function runs are not counted:
+   when an interrupt is taken during a measurement, the address it returns to is marked as well.
+
+   the breakpoints are written by measure_reset(), which should be called after loading the flash.
+
+   a measurement is given as start[:stop][/noisr], where start and stop are byte addresses (as
+   shown by avr-objdump) or the names of symbols in the elf file given to measure_elf() */
+
+extern volatile unsigned long long avr_cycle;
+extern unsigned long avr_PC;
+extern unsigned char avr_ADDR[];
+extern unsigned short int avr_FLASH[];
+extern unsigned short int avr_SP;
+
+int avr_step();
+
+#define BREAK 0x9598
+#define MAX_MEASUREMENTS 16
+#define MAX_ACTIVE       64
+#define MAX_BREAKPOINTS  (2*MAX_MEASUREMENTS + MAX_ACTIVE)
+#define RETURN (~0ul)
+#define INT_CYCLES 5            /* before avr_interrupt: the dispatch, and 3-BIGPC (BIGPC is -1) in avr_core_x86.s */
+
+static struct measurement {
+	char *name;
+	unsigned long start, stop;      /* word addresses; stop is RETURN to wait for the return */
+	int noisr;
+	unsigned long long *delta;
+	size_t n, size;
+} m[MAX_MEASUREMENTS];
+static int m_num;
+
+/* a BREAK that is shared by all measurements that need it */
+static struct breakpoint {
+	unsigned long addr;
+	unsigned short orig;
+	int refs;
+} bp[MAX_BREAKPOINTS];
+static int bp_num;
+
+/* the invocations that are running (innermost last); an interrupt handler has m == -1 */
+static struct active {
+	int m;
+	unsigned long end;              /* the address at which it ends */
+	unsigned sp;                    /* the stack pointer after returning there; 0 for a stop address */
+	unsigned long long begin, isr;
+} act[MAX_ACTIVE];
+static int act_num;
+
+static Elf32_Sym *syms;
+static char *strtab;
+static size_t sym_num;
+
+static struct breakpoint *bp_find(unsigned long addr)
+{
+	int i;
+	for(i=0; i < bp_num; i++)
+		if(bp[i].addr == addr) return &bp[i];
+	return NULL;
+}
+
+static int bp_set(unsigned long addr)
+{
+	struct breakpoint *b = bp_find(addr);
+	if(b) {
+		b->refs++;
+		return 0;
+	}
+	if(bp_num == MAX_BREAKPOINTS || addr > 0x1FFFF) return -1;
+	bp[bp_num].addr = addr;
+	bp[bp_num].orig = avr_FLASH[addr];
+	bp[bp_num].refs = 1;
+	bp_num++;
+	avr_FLASH[addr] = BREAK;
+	return 0;
+}
+
+static void bp_clear(unsigned long addr)
+{
+	struct breakpoint *b = bp_find(addr);
+	if(!b || --b->refs > 0) return;
+	avr_FLASH[addr] = b->orig;
+	*b = bp[--bp_num];
+}
+
+/* reads the symbol table of an elf file */
+int measure_elf(const char *file)
+{
+	Elf32_Ehdr eh;
+	Elf32_Shdr *sh = NULL;
+	int i, ok = 0;
+	FILE *f = fopen(file, "rb");
+	if(!f) return -1;
+	if(fread(&eh, sizeof eh, 1, f) == 1 && memcmp(eh.e_ident, ELFMAG, SELFMAG) == 0 && eh.e_ident[EI_CLASS] == ELFCLASS32
+	 && (sh = calloc(eh.e_shnum, sizeof *sh)) != NULL && fseek(f, eh.e_shoff, SEEK_SET) == 0)
+		for(i=0; i < eh.e_shnum && fread(&sh[i], sizeof *sh, 1, f) == 1; i++)
+			;
+	for(i=0; sh && i < eh.e_shnum; i++)
+		if(sh[i].sh_type == SHT_SYMTAB && sh[i].sh_link < eh.e_shnum) {
+			Elf32_Shdr *str = &sh[sh[i].sh_link];
+			syms   = malloc(sh[i].sh_size);
+			strtab = malloc(str->sh_size+1);
+			ok = syms && strtab
+			  && fseek(f, sh[i].sh_offset, SEEK_SET) == 0 && fread(syms, 1, sh[i].sh_size, f) == sh[i].sh_size
+			  && fseek(f, str->sh_offset, SEEK_SET) == 0 && fread(strtab, 1, str->sh_size, f) == str->sh_size;
+			if(ok) {
+				strtab[str->sh_size] = '\0';
+				sym_num = sh[i].sh_size / sizeof *syms;
+			}
+			break;
+		}
+	free(sh);
+	fclose(f);
+	return ok? 0 : -1;
+}
+
+/* a byte address or a symbol name; returns a word address */
+static unsigned long lookup(const char *s, size_t len)
+{
+	char *end;
+	size_t i;
+	unsigned long addr = strtoul(s, &end, 0);
+	if(end == s+len)
+		return addr/2;
+	for(i=0; i < sym_num; i++)
+		if(syms[i].st_name && strncmp(strtab + syms[i].st_name, s, len) == 0 && strtab[syms[i].st_name+len] == '\0'
+		 && ELF32_ST_TYPE(syms[i].st_info) != STT_OBJECT && syms[i].st_shndx != SHN_UNDEF)
+			return syms[i].st_value/2;
+	return RETURN;
+}
+
+int measure_add(const char *spec)
+{
+	struct measurement *p = &m[m_num];
+	size_t len = strcspn(spec, ":/");
+	if(m_num == MAX_MEASUREMENTS || (p->start = lookup(spec, len)) == RETURN)
+		return -1;
+	p->stop = RETURN;
+	p->name = strdup(spec);
+	p->name[strcspn(p->name, "/")] = '\0';
+	spec += len;
+	if(*spec == ':') {
+		len = strcspn(++spec, "/");
+		if((p->stop = lookup(spec, len)) == RETURN)
+			return -1;
+		spec += len;
+	}
+	if(*spec && strcmp(spec, "/noisr") != 0)
+		return -1;
+	p->noisr = *spec != '\0';
+	if(m_num++ == 0)
+		atexit(measure_report);
+	return 0;
+}
+
+/* the return address on the stack, as pushed by a call or an interrupt */
+static unsigned long return_address(void)
+{
+	return avr_ADDR[avr_SP+1]<<16 | avr_ADDR[avr_SP+2]<<8 | avr_ADDR[avr_SP+3];
+}
+
+static void push(int n, unsigned long end, unsigned sp, unsigned long long begin)
+{
+	if(act_num == MAX_ACTIVE || (sp && bp_set(end) != 0))
+		return;
+	act[act_num].m     = n;
+	act[act_num].end   = end;
+	act[act_num].sp    = sp;
+	act[act_num].begin = begin;
+	act[act_num].isr   = 0;
+	act_num++;
+}
+
+static void finish(int i)
+{
+	unsigned long long cycles = avr_cycle - act[i].begin;
+	int j;
+	if(act[i].m < 0) {
+		for(j=0; j < i; j++)
+			act[j].isr += cycles;
+	} else {
+		struct measurement *p = &m[act[i].m];
+		if(p->noisr)
+			cycles -= act[i].isr;
+		if(p->n == p->size) {
+			p->size = p->size? 2*p->size : 64;
+			p->delta = realloc(p->delta, p->size * sizeof *p->delta);
+		}
+		p->delta[p->n++] = cycles;
+	}
+	if(act[i].sp)
+		bp_clear(act[i].end);
+	memmove(&act[i], &act[i+1], (act_num-i-1) * sizeof *act);
+	act_num--;
+}
+
+/* called when the emulator stops at a BREAK; returns 2 if it isn't one of ours, otherwise
+   the status of executing the original instruction (0 if it simply executed) */
+int measure_break(void)
+{
+	unsigned long pc = avr_PC-1;
+	struct breakpoint *b;
+	unsigned stopped = 0;
+	int i, status;
+	if(!bp_find(pc))
+		return 2;
+	avr_PC = pc;
+	avr_cycle--;
+
+	/* everything that returns here, and the innermost invocation of a measurement with this stop address */
+	for(i=act_num-1; i >= 0; i--)
+		if(act[i].end == pc && (act[i].sp? act[i].sp == avr_SP : !(stopped & 1u<<act[i].m))) {
+			if(!act[i].sp)
+				stopped |= 1u<<act[i].m;
+			finish(i);
+		}
+	for(i=0; i < m_num; i++)
+		if(m[i].start == pc)
+			push(i, m[i].stop == RETURN? return_address() : m[i].stop, m[i].stop == RETURN? avr_SP+3 : 0, avr_cycle);
+
+	/* execute the original instruction */
+	b = bp_find(pc);
+	if(b) avr_FLASH[pc] = b->orig;
+	status = avr_step();
+	if(b && bp_find(pc)) avr_FLASH[pc] = BREAK;
+	return status;
+}
+
+/* called when an interrupt is taken; the cycles of pushing the return address have passed already */
+void measure_interrupt(void)
+{
+	int i;
+	for(i=0; i < act_num; i++)
+		if(act[i].m >= 0 && m[act[i].m].noisr) {
+			push(-1, return_address(), avr_SP+3, avr_cycle - INT_CYCLES);
+			return;
+		}
+}
+
+/* after a reset, nothing returns anymore; the breakpoints are (re)written, as the flash may
+   have been loaded or programmed since */
+void measure_reset(void)
+{
+	int i;
+	for(i=0; i < bp_num; i++)
+		if(avr_FLASH[bp[i].addr] == BREAK)
+			avr_FLASH[bp[i].addr] = bp[i].orig;
+	bp_num = act_num = 0;
+	for(i=0; i < m_num; i++) {
+		bp_set(m[i].start);
+		if(m[i].stop != RETURN)
+			bp_set(m[i].stop);
+	}
+}
+
+/* called before (written = 0) and after (written = 1) the mcu programs these words of flash:
+   the breakpoints among them are taken out, and then written over the new contents */
+void measure_flash(unsigned long addr, unsigned long words, int written)
+{
+	int i;
+	for(i=0; i < bp_num; i++)
+		if(bp[i].addr - addr < words) {
+			if(written) {
+				bp[i].orig = avr_FLASH[bp[i].addr];
+				avr_FLASH[bp[i].addr] = BREAK;
+			} else
+				avr_FLASH[bp[i].addr] = bp[i].orig;
+		}
+}
+
+static int by_value(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long*)a, y = *(const unsigned long long*)b;
+	return x < y? -1 : x > y;
+}
+
+void measure_report(void)
+{
+	int i;
+	for(i=0; i < m_num; i++) {
+		struct measurement *p = &m[i];
+		if(p->n == 0) {
+			fprintf(stderr, "%s: not executed\n", p->name);
+			continue;
+		}
+		qsort(p->delta, p->n, sizeof *p->delta, by_value);
+		fprintf(stderr, "%s: %zu calls, cycles min %llu, median %llu, max %llu\n",
+		        p->name, p->n, p->delta[0], p->delta[p->n/2], p->delta[p->n-1]);
+	}
+}
@@ -0,0 +1,9 @@
+/* cycle counts of functions in the firmware (see measure.c) */
+
+extern int measure_elf(const char *file);
+extern int measure_add(const char *spec);
+extern int measure_break(void);
+extern void measure_interrupt(void);
+extern void measure_reset(void);
+extern void measure_flash(unsigned long addr, unsigned long words, int written);
+extern void measure_report(void);
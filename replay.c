@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "replay.h"
+
+/* record and replay: everything the mcu gets from the host that depends on the timing of the
+   host (bytes arriving on the serial line, the real-time clock behind the timers, resets by
+   signals) is written to a file with the cycle at which the mcu saw it, so that a run can be
+   repeated exactly, and as fast as the host allows.
+
+   there are two kinds of input. the ones the emulator asks for itself (reading the clock, or
+   stdin) happen at the same cycles again once everything before them was the same; these are
+   returned in the recorded order by replay_input, which only checks that they are asked for at
+   the same cycle. the others are posted by other threads and signal handlers and taken by the
+   emulator through avr_mail, whenever it got to that; these are put back by the host at the
+   cycle of replay_next, as replay_take gives them out.
+
+   avr_cycle restarts after a reset, so the cycle of a record is paired with the number of resets
+   before it (replay_reset is called after every one). the records are a struct replay_record
+   each, following REPLAY_MAGIC, in the byte order of the host */
+
+extern volatile unsigned long long avr_cycle;
+
+#define NEVER (~0ull)
+
+int replaying;
+
+static FILE *out;
+static unsigned epoch;
+
+/* in replay, the two kinds are taken from separate lists */
+static struct list {
+	struct replay_record *rec;
+	size_t n, size, next;
+} asked, posted;
+
+static const char *kind_name[] = { "clock", "getchar", "bridge_wait", "bridge_get", "bridge_room", "hangup", "mail", "reset" };
+
+int replay_record(const char *file)
+{
+	if(!(out = fopen(file, "wb")))
+		return -1;
+	setvbuf(out, NULL, _IOFBF, 1<<20);
+	fwrite(REPLAY_MAGIC, 8, 1, out);
+	return 0;
+}
+
+static int add(struct list *l, const struct replay_record *r)
+{
+	if(l->n == l->size) {
+		struct replay_record *p = realloc(l->rec, (l->size? 2*l->size : 1024) * sizeof *p);
+		if(!p) return -1;
+		l->rec  = p;
+		l->size = l->size? 2*l->size : 1024;
+	}
+	l->rec[l->n++] = *r;
+	return 0;
+}
+
+int replay_open(const char *file)
+{
+	struct replay_record r;
+	char magic[8];
+	int ok;
+	FILE *f = fopen(file, "rb");
+	if(!f) return -1;
+	ok = fread(magic, sizeof magic, 1, f) == 1 && memcmp(magic, REPLAY_MAGIC, sizeof magic) == 0;
+	while(ok && fread(&r, sizeof r, 1, f) == 1)
+		ok = add(r.kind >= REPLAY_MAIL? &posted : &asked, &r) == 0;
+	fclose(f);
+	replaying = ok;
+	return ok? 0 : -1;
+}
+
+/* writes out the rest of the recording; this is safe to call more than once */
+void replay_close(void)
+{
+	if(out) fclose(out);
+	out = NULL;
+}
+
+void replay_reset(void)
+{
+	epoch++;
+}
+
+void replay_log(int kind, int arg, long long value)
+{
+	struct replay_record r;
+	if(!out) return;
+	memset(&r, 0, sizeof r);
+	r.cycle = avr_cycle;
+	r.value = value;
+	r.epoch = epoch;
+	r.kind  = kind;
+	r.arg   = arg;
+	fwrite(&r, sizeof r, 1, out);
+}
+
+/* returns 1 and the recorded value if replaying; otherwise, the caller gets the value itself
+   (and logs it). the run is over once it asks for something else than the recording has */
+int replay_input(int kind, long long *value)
+{
+	struct replay_record *r = &asked.rec[asked.next];
+	if(!replaying)
+		return 0;
+	if(asked.next == asked.n) {
+		fprintf(stderr, "end of the recording at cycle %llu\n", avr_cycle);
+		exit(0);
+	}
+	if(r->kind != kind || r->epoch != epoch || r->cycle != avr_cycle) {
+		fprintf(stderr, "replay diverged: %s at cycle %llu, but the recording has %s at cycle %llu%s\n",
+			kind_name[kind], avr_cycle, kind_name[r->kind], r->cycle, r->epoch != epoch? " (after another reset)" : "");
+		exit(2);
+	}
+	asked.next++;
+	*value = r->value;
+	return 1;
+}
+
+/* the cycle at which the next posted input is to be taken, or NEVER (not before the next reset) */
+unsigned long long replay_next(void)
+{
+	struct replay_record *r = &posted.rec[posted.next];
+	if(!replaying || posted.next == posted.n || r->epoch > epoch)
+		return NEVER;
+	return r->epoch < epoch? 0 : r->cycle;
+}
+
+/* gives out the posted inputs that are due */
+int replay_take(int *kind, int *arg, long long *value)
+{
+	struct replay_record *r = &posted.rec[posted.next];
+	if(replay_next() > avr_cycle)
+		return 0;
+	*kind  = r->kind;
+	*arg   = r->arg;
+	*value = r->value;
+	posted.next++;
+	return 1;
+}
@@ -0,0 +1,34 @@
+/* recording the inputs that the host gives the mcu, and playing them back (see replay.c) */
+
+enum replay_kind {
+	/* values that the emulator asks for; replayed in the order in which they were recorded */
+	REPLAY_CLOCK,                 /* a reading of the real-time clock */
+	REPLAY_GETCHAR,               /* a byte (or EOF) read from stdin */
+	REPLAY_RX_WAIT,               /* bridge_wait: is a byte there? (arg is the USART) */
+	REPLAY_RX_GET,                /* bridge_get: the byte, or -1 */
+	REPLAY_TX_ROOM,               /* bridge_room */
+	REPLAY_HANGUP,                /* has the other side of stdout hung up? */
+	/* events that come from other threads and signal handlers; replayed at their cycle */
+	REPLAY_MAIL,                  /* flags (value) posted to a port (arg) */
+	REPLAY_RESET,                 /* an external reset or power-off (value is the reason) */
+};
+
+struct replay_record {
+	unsigned long long cycle;
+	long long value;
+	unsigned epoch;               /* the number of resets before it */
+	unsigned short kind, arg;
+};
+
+#define REPLAY_MAGIC "avrinput"
+
+extern int replaying;
+
+extern int replay_record(const char *file);
+extern int replay_open(const char *file);
+extern void replay_close(void);
+extern void replay_reset(void);
+extern void replay_log(int kind, int arg, long long value);
+extern int replay_input(int kind, long long *value);
+extern unsigned long long replay_next(void);
+extern int replay_take(int *kind, int *arg, long long *value);
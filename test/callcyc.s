@@ -0,0 +1,33 @@
+; regression - cycles taken by the calls, measured with timer 2 running at the cpu clock
+; (it counts emulated cycles whether or not TIME_ACCELERATION is set); each delta includes
+; the 2 cycles of an lds. on the ATmega2560 (3-byte PC), expect
+; r3 = 06 (rcall), r5 = 06 (icall), r7 = 06 (eicall) and r9 = 07 (call)
+
+.text
+    ldi r16, 1
+    sts 0xB1, r16       ; tccr2b: clk/1
+
+    lds r2, 0xB2        ; tcnt2
+    rcall 1f
+1:  lds r3, 0xB2
+    sub r3, r2
+
+    ldi r30, lo8(pm(2f))
+    ldi r31, hi8(pm(2f))
+    lds r4, 0xB2
+    icall
+2:  lds r5, 0xB2
+    sub r5, r4
+
+    ldi r30, lo8(pm(3f))
+    ldi r31, hi8(pm(3f))
+    lds r6, 0xB2
+    eicall              ; eind is 0 after reset
+3:  lds r7, 0xB2
+    sub r7, r6
+
+    lds r8, 0xB2
+    call 4f
+4:  lds r9, 0xB2
+    sub r9, r8
+    sleep
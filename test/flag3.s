@@ -0,0 +1,20 @@
+; regression - S written by SES or OUT SREG stays set through instructions that leave N and V
+; alone, until one changes them; expect r2 = 10, r3 = 00, r5 = 12, r6 = 01 and r7 = 00
+
+.text
+    ses
+    sec
+    ldi r16, 5
+    mul r16, r16        ; changes Z and C only
+    in r2, 0x3F
+    brlt 1f
+    inc r3
+1:  ldi r17, 0x10
+    out 0x3F, r17
+    sez
+    in r5, 0x3F
+    brge 2f
+    inc r6
+2:  inc r16             ; N = V = 0, so S is clear again
+    in r7, 0x3F
+    sleep
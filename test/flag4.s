@@ -0,0 +1,14 @@
+; regression - MUL and FMUL update Z and C after a write to SREG; expect r2 = 00 and r3 = 01
+
+.text
+    ldi r16, 5
+    ldi r17, 0x03
+    out 0x3F, r17       ; Z and C set
+    mul r16, r16        ; 25: Z and C clear
+    in r2, 0x3F
+    ldi r18, 0xC0
+    ldi r17, 0x02
+    out 0x3F, r17       ; Z set
+    fmul r18, r18       ; 0x9000 before the shift: C set, Z clear
+    in r3, 0x3F
+    sleep
@@ -0,0 +1,29 @@
+	; checks that a compare match in CTC mode requests its interrupt every OCR2A+1 cycles;
+	; timer 2 counts emulated cycles whether or not TIME_ACCELERATION is set.
+	; expect r2 = r3 = 06 (tcnt2 as read first thing in the handler, both times),
+	; r20 = 02 and cycle 226 in the final dump
+	rjmp start
+
+.org 0x1A*2			; TIMER2_COMPA
+	lds r17, 0xB2		; tcnt2
+	inc r20
+	cpi r20, 2
+	breq 1f
+	mov r2, r17
+	reti
+1:	mov r3, r17
+	sleep
+
+start:
+	ldi r16, 99
+	sts 0xB3, r16		; ocr2a
+	ldi r16, 2
+	sts 0xB0, r16		; tccr2a: ctc
+	sts 0x70, r16		; timsk2: ocie2a
+	sei
+	ldi r16, 1
+	sts 0xB1, r16		; tccr2b: clk/1
+	.rept 250
+	nop
+	.endr
+	sleep
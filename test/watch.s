@@ -0,0 +1,18 @@
+; watchpoints - a watchpoint switches to the checked core, which the default build links, e.g.
+;   ./tester -watch:0x300 test/watch.hex      (stops at the 'sts')
+;   ./tester -watch:0x2FE,4:a test/watch.hex  (stops at the first 'st')
+
+.text
+    cli
+    ldi r26, 0x00
+    ldi r27, 0x03
+    ldi r16, 0x55
+    ld r17, X
+    ldi r18, 10
+loop:
+    inc r17
+    dec r18
+    brne loop
+    sts 0x300, r17
+    st X+, r16
+    sleep
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -5,30 +6,50 @@
 #include <sched.h>
 #include <unistd.h>
 #include <time.h>
-#include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <termios.h>
 #include <string.h>
 #include <signal.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "ihexread.h"
+#include "watch.h"
+#include "board.h"
+#include "devices.h"
+#include "measure.h"
+#include "bridge.h"
+#include "iolog.h"
+#include "vcd.h"
+#include "adc.h"
+#include "replay.h"
 
 /* #define THREAD_IO 10 */
-#define THREAD_TIMER 100
-#define WD_FREQ 128000/64
 
 /* should the emulator quit if the only thing that will get things moving again is a reset? */
 /* #define HALT_QUIT */
 
+/* should every flash page erased or written by the mcu (using SPM) be reported on stderr? */
+/* #define SPM_LOG */
+
 /* should TIMER0 and TIMER1 be based on "wall" time or "emulated" (i.e. accelerated) time */
 /* #define TIME_ACCELERATION */
 
 extern volatile unsigned long long avr_cycle;
 extern volatile unsigned long avr_last_wdr;
 extern volatile unsigned char avr_IO[];
-extern volatile unsigned char avr_INT;
+extern volatile unsigned char avr_INT, avr_HALT;
 extern volatile unsigned long avr_INTR;
+extern volatile unsigned char avr_MAIL, avr_ASYNC;
+extern volatile unsigned long long avr_DEADLINE;
+extern volatile unsigned long long avr_LIMIT;
+extern volatile unsigned long long avr_IRQ;
 
 extern unsigned long avr_PC, avr_BOOT_PC;
 extern unsigned char avr_ADDR[];
@@ -37,6 +58,7 @@ extern unsigned short int avr_SP;
 extern unsigned char volatile avr_SREG;
 
 int avr_run();
+int avr_run_until(unsigned long long cycle);
 int avr_step();
 void avr_reset();
 
@@ -46,7 +68,7 @@ static const char *eeprom_file;
 
 static volatile enum { INTR, WDRESET, XRESET, POWEROFF } INT_reason;
 
-#define reset { INT_reason = INTR; do; while(kill_with_fire); continue; }
+#define reset { INT_reason = INTR; continue; }
 
 /* note: consider calling this at regular intervals from a thread? */
 void eeprom_commit(void)
@@ -72,18 +94,54 @@ void avr_debug(unsigned long ip)
 /* usleep is deprecated in POSIX */
 #define usleep(us) \
 	{ const struct timespec ts = { (us)/1000000, ((us)%1000000)*1000 }; nanosleep(&ts, NULL); }
-#define ualarm(us,iv) \
-	{ const struct timeval u_tv = { (us)/1000000, (us)%1000000 }; \
-	  const struct timeval i_tv = { (iv)/1000000, (iv)%1000000 }; \
-	  const struct itimerval itv = { i_tv, u_tv }; \
-	  setitimer(ITIMER_REAL, &itv, NULL); }
-#define uvalarm(us,iv) \
-	{ const struct timeval u_tv = { (us)/1000000, (us)%1000000 }; \
-	  const struct timeval i_tv = { (iv)/1000000, (iv)%1000000 }; \
-	  const struct itimerval itv = { i_tv, u_tv }; \
-	  setitimer(ITIMER_VIRTUAL, &itv, NULL); }
-
-/* a watchdog process; behaves mostly according to the datasheet. */
+
+/* the interrupt controller: bit n of avr_IRQ is set while the interrupt at vector n (word address 2n)
+   is pending, so the lowest set bit has the highest priority; bit 0 (RESET) is used for the
+   events that the host handles itself. Threads other than the emulator only ever raise requests */
+
+#define vec_RESET 0x00
+#define vec_WDIF  0x18
+#define vec_OC2A  0x1A
+#define vec_OC1A  0x22
+#define vec_OC0A  0x2A
+#define vec_SPI   0x30
+#define vec_RXC   0x32                /* USART0; UDRE and TXC follow */
+#define vec_ADC   0x3A
+#define vec_EERI  0x3C
+#define vec_RXC1  0x48
+#define vec_TWI   0x4E
+#define vec_SPMR  0x50
+#define vec_RXC2  0x66
+#define vec_RXC3  0x6C
+
+#define IRQ(vec) (1ull << (vec)/2)
+
+/* when there is nothing to do, the emulator thread blocks on an eventfd (see idle_wait); other
+   threads and signal handlers wake it when they request an interrupt */
+static int wake_fd = -1;
+static volatile int idle;
+
+void idle_wake(void)
+{
+	static const uint64_t one = 1;
+	__sync_synchronize();
+	if(idle && write(wake_fd, &one, sizeof one) < 0)
+		return; /* it is counting on its own */
+}
+
+/* clear the requests in mask that are not in req, then raise req */
+static void irq_update(unsigned long long mask, unsigned long long req)
+{
+	if(mask & ~req)
+		__sync_fetch_and_and(&avr_IRQ, ~(mask & ~req));
+	if(req) {
+		__sync_fetch_and_or(&avr_IRQ, req);
+		avr_INT = 1;
+		idle_wake();
+	}
+}
+
+/* the watchdog; see wd_event() */
 
 #define MCUSR  0x34
 #define WDTCSR 0x40
@@ -96,269 +154,1366 @@ enum mcusr_bits {
 	WDRF = 1<<3, BORF = 1<<2, EXTRF = 1<<1, PORF = 1<<0
 };
 
-#ifndef WD_FREQ
-#define WD_FREQ 128000
-#endif
+ /* we use I/O functions to
+    - fake a UART: accept everything written to UDR0 (0xA6); always report ready on UCSR0A (0xA0),
+      unless USART0 is connected like USART1..3, at their baud rates
+    - implement EEPROM data accesses
+    - implement 8-bit counters 0 and 2 and 16-bit counter 1; with compare match and overflow
+      interrupts, but no input capture or waveform output
+    - act as the master on the SPI and TWI buses, with the chips in devices.c as slaves
+    - convert the signals recorded in adc.c with the ADC */
 
-void watchdog(int alarm)
-{
-	static unsigned long last_wdr;
-	static unsigned long timer;
+#define UCSR0A 0xA0
+#define UCSR0B 0xA1
+#define UDR0   0xA6
+#define UCSR1A 0xA8
+#define UCSR2A 0xB0
+#define UCSR3A 0x110
 
-	unsigned char wdtcr = avr_IO[WDTCSR];
-	unsigned long cur = avr_last_wdr;
-	unsigned long threshold = 2ul << ((wdtcr&0x20)/4 + (wdtcr&0x7)) % 10;
-	if(cur == last_wdr && wdtcr&(WDIE|WDE) && ++timer > threshold) {
-		timer = 0;
-		if(wdtcr & WDIE) {
-			wdtcr |= WDIF;
-			if(wdtcr & WDE)
-				wdtcr &=~WDIE;
-			avr_IO[WDTCSR] = wdtcr;
-			timer = 0;
-			avr_INT = 1;
-		} else if(wdtcr & WDE) {
-			timer = last_wdr = 0;
-			INT_reason = WDRESET;
-			avr_INT = 1;
-			avr_SREG = 0x80;
-		}
-	} else if(cur != last_wdr) {
-		timer = 0;
-		last_wdr = cur;
-	}
-}
+enum usart_regs {                 /* from UCSRnA */
+	UCSRA, UCSRB, UCSRC, UBRRL = 4, UBRRH, UDR
+};
 
-/* scale the cpu cycle count according to TCCRxB, and generate an overflow interrupt if demanded
-   if the first argument is NULL, only compute the scaled count; tihs routine is used to easily
-   (partially) implement counters/timers
+enum ucsr_bits {
+	RXC = 1<<7, TXC = 1<<6, UDRE = 1<<5, U2X = 1<<1
+};
 
-   NOTE that interrupts will only be generated when a counter value is polled; this should suffice
-   for creating counters; for a more realistic emulation, an extra thread would be needed. */
+#define PINA  0x00
+#define DDRA  0x01
+#define PORTA 0x02
+#define PINB  0x03
+#define DDRB  0x04
+#define PORTB 0x05
+#define PINC  0x06
+#define DDRC  0x07
+#define PORTC 0x08
+#define PIND  0x09
+#define DDRD  0x0A
+#define PORTD 0x0B
 
-#define GTCCR  0x23
+#define SPCR  0x2C
+#define SPSR  0x2D
+#define SPDR  0x2E
 
-enum timer_bits {
-	TSM = 1<<7, PSRASY = 1<<1, PSRSYNC = 1<<0, /* GTCCR */
-	TOV = 1<<0,                                /* TIMSKn & TIFRn */
-	AS2 = 1<<5                                 /* ASSR */
+enum spi_bits {
+	SPIE = 1<<7, SPE = 1<<6, DORD = 1<<5, MSTR = 1<<4, /* SPCR */
+	SPIF = 1<<7, WCOL = 1<<6, SPI2X = 1<<0             /* SPSR */
 };
 
-#define instantiate_prescaler(simulated_timer, reset, t1, t2, t3, t4, t5, t6, t7, clock_src) \
-static void simulated_timer(unsigned long long *prev, int tccr, int tifr, int timsk, int bits, int offset, volatile unsigned *overflow_events) \
-{ \
-	/* the prescaler is shared for all timers */ \
-	static unsigned long long last_reset; \
-	static unsigned long long prev_cycle; \
-	static unsigned long long counted_cycle; \
-	static volatile char busy = 0; /* this function is not re-entrant*/ \
-	unsigned long long cycle = clock_src; \
- \
-	tccr = avr_IO[tccr] & 7; \
-	if(!tccr || busy) return; \
-	busy++; \
- \
-	if(reset) { \
-		if(last_reset != counted_cycle) \
-			last_reset = counted_cycle += cycle - prev_cycle; \
-	} else { \
-		counted_cycle += cycle - prev_cycle; \
-	} \
-	prev_cycle = cycle; \
- \
-	if(prev) { \
-		/* assume we are reading the register before the clock increases */ \
-		const int tap[7] = { t1,t2,t3,t4,t5,t6,t7 }; \
-		const int w = tap[tccr-1]; \
-		unsigned long long scaled_count = counted_cycle-1 - (last_reset&(1<<w)-1) >> w; \
-		scaled_count += offset; \
-		if(*prev >> bits != scaled_count >> bits) { \
-			avr_IO[tifr] |= TOV; \
-			if(avr_IO[timsk]&TOV) { /* generate overflow interruptions */ \
-				*overflow_events = (scaled_count >> bits) - (*prev >> bits); \
-				avr_INT = 1; \
-			} \
-		} \
-		*prev = scaled_count; \
-	} \
-	busy--; \
-}
+#define TWBR  0x98
+#define TWSR  0x99
+#define TWDR  0x9B
+#define TWCR  0x9C
 
- /* we use I/O functions to
-    - fake a UART: accept everything written to UDR0 (0xA6); always report ready on UCSR0A (0xA0)
-    - implement EEPROM data accesses
-    - implement 8-bit counter 0 and 16-bit counter 1; with interrupts, but no OCR/ICP */
-
-#define UCSR0A 0xA0
-#define UCSR0B 0xA1
-#define UDR0   0xA6
-
-enum ucsr_bits {
-	RXC = 1<<7, TXC = 1<<6, UDRE = 1<<5
+enum twcr_bits {
+	TWINT = 1<<7, TWEA = 1<<6, TWSTA = 1<<5, TWSTO = 1<<4, TWWC = 1<<3, TWEN = 1<<2, TWIE = 1<<0
 };
 
-#define TCNT0  0x26
+#define GTCCR  0x23
+
+#define TCCR0A 0x24
 #define TCCR0B 0x25
+#define TCNT0  0x26
+#define OCR0A  0x27
+#define OCR0B  0x28
 #define TIMSK0 0x4E
 #define TIFR0  0x15
 
+#define TCCR1A 0x60
+#define TCCR1B 0x61
 #define TCNT1L 0x64
 #define TCNT1H 0x65
-#define TCCR1B 0x61
+#define ICR1L  0x66
+#define ICR1H  0x67
+#define OCR1AL 0x68
+#define OCR1AH 0x69
+#define OCR1BL 0x6A
+#define OCR1BH 0x6B
+#define OCR1CL 0x6C
+#define OCR1CH 0x6D
 #define TIMSK1 0x4F
 #define TIFR1  0x16
 
-#define TCNT2  0x92
+#define TCCR2A 0x90
 #define TCCR2B 0x91
+#define TCNT2  0x92
+#define OCR2A  0x93
+#define OCR2B  0x94
 #define TIMSK2 0x50
 #define TIFR2  0x17
 #define ASSR   0x96
 
+#define ADCL   0x58
+#define ADCH   0x59
+#define ADCSRA 0x5A
+#define ADCSRB 0x5B
+#define ADMUX  0x5C
+
+enum adc_bits {
+	ADEN = 1<<7, ADSC = 1<<6, ADATE = 1<<5, ADIF = 1<<4, ADIE = 1<<3, /* ADCSRA */
+	MUX5 = 1<<3,                                                      /* ADCSRB */
+	ADLAR = 1<<5                                                      /* ADMUX */
+};
+
 #define EEARH  0x22
 #define EEARL  0x21
 #define EEDR   0x20
 #define EECR   0x1F
 
-#define vec_WDIF 0x18
-#define vec_TOV0 0x2E
-#define vec_TOV1 0x28
-#define vec_TOV2 0x1E
-#define vec_EERI 0x3C
-#define vec_UDRE 0x34
-#define vec_TXC  0x36
-#define vec_RXC  0x32
-
 enum eecr_bits {
 	EEPM1 = 1<<5, EEPM0 = 1<<4, EERIE = 1<<3, EEMPE = 1<<2, EEPE = 1<<1, EERE = 1<<0
 };
 
+enum timer_bits {
+	TSM = 1<<7, PSRASY = 1<<1, PSRSYNC = 1<<0, /* GTCCR */
+	TOV = 1<<0, OCFA = 1<<1,                   /* TIMSKn & TIFRn; OCFB and OCFC follow OCFA */
+	AS2 = 1<<5                                 /* ASSR */
+};
+
 static unsigned long long oscillator(unsigned long long freq)
 {
 	struct timespec ts = { 0, 0 };
+	long long t;
+	if(replay_input(REPLAY_CLOCK, &t))
+		return t;
 	clock_gettime(CLOCK_MONOTONIC, &ts);
-	return ts.tv_sec*freq + ts.tv_nsec*freq / 1000000000;
+	t = ts.tv_sec*freq + ts.tv_nsec*freq / 1000000000;
+	replay_log(REPLAY_CLOCK, 0, t);
+	return t;
 }
 
+/* events that have to happen at a certain cycle; the emulator calls avr_deadline when the
+   earliest of them is due, so nothing needs to be polled */
+
+#define NEVER (~0ull)
+
+enum event { EV_TIMER0, EV_TIMER1, EV_TIMER2, EV_WDT, EV_UART0, EV_UART1, EV_UART2, EV_UART3, EV_SPI, EV_TWI, EV_BOARD, EV_SPM, EV_ADC, EV_REPLAY, EVENTS };
+static unsigned long long event_at[EVENTS] = { NEVER, NEVER, NEVER, NEVER, NEVER, NEVER, NEVER, NEVER, NEVER, NEVER, NEVER, NEVER, NEVER, NEVER };
+
+static void schedule(int ev, unsigned long long cycle)
+{
+	unsigned long long next = avr_cycle + (1u<<30);
+	int i;
+	event_at[ev] = cycle;
+	for(i=0; i < EVENTS; i++)
+		if(event_at[i] < next) next = event_at[i];
+	avr_DEADLINE = next < avr_LIMIT? next : avr_LIMIT;
+}
+
+/* the counters are only brought up to date when they are accessed, or when the next compare match
+   or overflow that can request an interrupt is due; the prescalers count emulated cycles, or
+   (without TIME_ACCELERATION, and for timer 2 with AS2 set) a real-time clock */
+
+#ifndef F_CPU
+#define F_CPU 16000000
+#endif
+
+static struct prescaler {
+	char tap[7];                  /* log2 of the division factor selected by CSn2:0 */
+	unsigned char psr;            /* the reset bit in GTCCR */
+	unsigned long long base;      /* clock value at the last prescaler reset */
+} prescaler[2] = {
+	{ { 0, 3, 6, 8, 10, 16, 20 }, PSRSYNC }, /* the external clock inputs are faked */
+	{ { 0, 3, 5, 6,  7,  8, 10 }, PSRASY  },
+};
+
+/* the frequency of the prescaler clock, or 0 if it is avr_cycle */
+static unsigned long prescaler_freq(struct prescaler *pre)
+{
+	if(pre == &prescaler[1])
+		return avr_IO[ASSR]&AS2? 32768 : 0;
 #ifdef TIME_ACCELERATION
-/* let timer0 and timer1 be based on actual emulated AVR cycles, meaning that in essence the whole simulated world is sped up */
-instantiate_prescaler(PRESCALER01, avr_IO[GTCCR]&PSRSYNC, 0, 3, 6, 8, 10, 16, 20, avr_cycle)
+	/* let timer0 and timer1 be based on actual emulated AVR cycles, meaning that in essence the whole simulated world is sped up */
+	return 0;
 #else
-/* let timer0 and timer1 fake a 16mhz unit -- does mean that they cannot be used anymore for cycle measurement */
-instantiate_prescaler(PRESCALER01, avr_IO[GTCCR]&PSRSYNC, 0, 3, 6, 8, 10, 16, 20, oscillator(16000000))
+	/* let timer0 and timer1 fake a 16mhz unit -- does mean that they cannot be used anymore for cycle measurement */
+	return F_CPU;
 #endif
-instantiate_prescaler(PRESCALER2,  avr_IO[GTCCR]&PSRASY,  0, 3, 5, 6, 7, 8, 10,   (avr_IO[ASSR]&AS2)?oscillator(32768):avr_cycle)
-#define PRESCALER0 PRESCALER01
-#define PRESCALER1 PRESCALER01
+}
+
+static unsigned long long prescaler_clock(struct prescaler *pre)
+{
+	unsigned long freq = prescaler_freq(pre);
+	if(freq) return oscillator(freq);
+	/* assume we are reading the register before the clock increases */
+	return avr_cycle? avr_cycle-1 : 0;
+}
+
+static struct timer {
+	unsigned char tccra, tccrb, tcnt, ocr, icr, timsk, tifr, vec;
+	int bits, channels;
+	struct prescaler *pre;
+	unsigned count, down;         /* counter state at... */
+	unsigned long long last;      /* ...this prescaler clock value */
+} timers[3] = {
+	{ TCCR0A, TCCR0B, TCNT0,  OCR0A,  0,     TIMSK0, TIFR0, vec_OC0A,  8, 2, &prescaler[0] },
+	{ TCCR1A, TCCR1B, TCNT1L, OCR1AL, ICR1L, TIMSK1, TIFR1, vec_OC1A, 16, 3, &prescaler[0] },
+	{ TCCR2A, TCCR2B, TCNT2,  OCR2A,  0,     TIMSK2, TIFR2, vec_OC2A,  8, 2, &prescaler[1] },
+};
+
+/* the interrupt requests of a timer follow TIFRn & TIMSKn; compare match A comes first */
+static void timer_irq(struct timer *t)
+{
+	int ch = t->channels, req = avr_IO[t->tifr] & avr_IO[t->timsk];
+	unsigned long long vec = (req >> 1 & (1 << ch)-1) | (req & TOV) << ch;
+	irq_update(((2ull << ch) - 1) * IRQ(t->vec), vec * IRQ(t->vec));
+}
 
 /* the "temp" register to get 16-bit reads/writes */
 static unsigned char TEMP;
-/* offsets to derive the counters from the free-running prescaler */
-static unsigned long long timer[3];
-static int timer_ofs[3];
-/* number of overflow events to catch up on */
-static volatile unsigned timer_overflows[3];
 
-#define fetch_timer(n) \
-	PRESCALER##n(&timer[n], TCCR##n##B, TIFR##n, TIMSK##n, n==1? 16 : 8, timer_ofs[n], &timer_overflows[n])
+static unsigned timer_reg(const struct timer *t, int port)
+{
+	return t->bits == 16? avr_IO[port] | avr_IO[port+1] << 8 : avr_IO[port];
+}
+
+enum wgm { NORMAL, CTC, FAST, PHASE };
+enum top { MAX, FF, x1FF, x3FF, OCRA, ICR };
+
+static const unsigned char wgm8[8][2] = {
+	{NORMAL,MAX}, {PHASE,FF}, {CTC,OCRA}, {FAST,FF}, {NORMAL,MAX}, {PHASE,OCRA}, {NORMAL,MAX}, {FAST,OCRA}
+};
+static const unsigned char wgm16[16][2] = {
+	{NORMAL,MAX}, {PHASE,FF}, {PHASE,x1FF}, {PHASE,x3FF}, {CTC,OCRA}, {FAST,FF}, {FAST,x1FF}, {FAST,x3FF},
+	{PHASE,ICR}, {PHASE,OCRA}, {PHASE,ICR}, {PHASE,OCRA}, {CTC,ICR}, {NORMAL,MAX}, {FAST,ICR}, {FAST,OCRA}
+};
+
+/* the sequence a counter goes through is described by a period, its current position in it,
+   and the positions at which it sets a flag in TIFRn (on leaving that position) */
+struct timer_cycle {
+	unsigned long long period, pos;
+	int n, wrap, updown;
+	unsigned long long at[7];
+	unsigned char flag[7];
+};
+
+static void timer_cycle(const struct timer *t, struct timer_cycle *c)
+{
+	const unsigned max = (1u << t->bits) - 1;
+	const unsigned char *wgm = t->bits == 16?
+		wgm16[(avr_IO[t->tccra]&3) | (avr_IO[t->tccrb]>>1&12)] :
+		wgm8 [(avr_IO[t->tccra]&3) | (avr_IO[t->tccrb]>>1&4)];
+	const unsigned tops[] = { max, 0xFF, 0x1FF, 0x3FF, timer_reg(t, t->ocr), t->icr? timer_reg(t, t->icr) : max };
+	unsigned top = tops[wgm[1]], i;
+
+	c->n = 0;
+	c->wrap = t->count > top;
+	c->updown = !c->wrap && wgm[0] == PHASE && top > 0;
+	if(c->wrap) {
+		/* the counter was set beyond TOP, so it counts up to MAX first */
+		c->period = max+1;
+		c->pos = t->count;
+		for(i=0; i < t->channels; i++) {
+			c->at[c->n] = timer_reg(t, t->ocr+2*i);
+			c->flag[c->n++] = OCFA << i;
+		}
+		c->at[c->n] = max;
+		c->flag[c->n++] = TOV;
+	} else if(c->updown) {
+		/* up and down again: positions beyond TOP are on the way down */
+		c->period = 2*top;
+		c->pos = t->down? c->period - t->count : t->count;
+		for(i=0; i < t->channels; i++) {
+			unsigned ocr = timer_reg(t, t->ocr+2*i);
+			if(ocr > top) continue;
+			c->at[c->n] = ocr;
+			c->flag[c->n++] = OCFA << i;
+			if(ocr == 0 || ocr == top) continue;
+			c->at[c->n] = c->period - ocr;
+			c->flag[c->n++] = OCFA << i;
+		}
+		c->at[c->n] = c->period-1; /* overflow when reaching BOTTOM */
+		c->flag[c->n++] = TOV;
+	} else {
+		c->period = top+1;
+		c->pos = t->count;
+		for(i=0; i < t->channels; i++) {
+			unsigned ocr = timer_reg(t, t->ocr+2*i);
+			if(ocr > top) continue;
+			c->at[c->n] = ocr;
+			c->flag[c->n++] = OCFA << i;
+		}
+		if(wgm[0] == FAST || top == max) {
+			c->at[c->n] = top;
+			c->flag[c->n++] = TOV;
+		}
+	}
+	c->pos %= c->period;
+}
+
+/* advance a counter by a number of timer clocks; returns the flags that get set on the way */
+static int timer_advance(struct timer *t, unsigned long long ticks)
+{
+	int flags = 0, i;
+	while(ticks > 0) {
+		struct timer_cycle c;
+		unsigned long long step = ticks;
+		timer_cycle(t, &c);
+		if(c.wrap && step > c.period - c.pos)
+			step = c.period - c.pos;
+		for(i=0; i < c.n; i++)
+			if((c.at[i] + c.period - c.pos) % c.period < step)
+				flags |= c.flag[i];
+		c.pos = (c.pos + step) % c.period;
+		t->down  = c.updown && c.pos >= c.period/2;
+		t->count = t->down? c.period - c.pos : c.pos;
+		ticks -= step;
+	}
+	return flags;
+}
+
+/* the prescaler is held in reset while TSM and its PSR bit are set */
+static int prescaler_halted(struct prescaler *pre)
+{
+	return (avr_IO[GTCCR] & (TSM|pre->psr)) == (TSM|pre->psr);
+}
+
+static int adc_trigger_flag(int timer);
+static void adc_trigger(void);
+
+/* bring a counter and its flags up to date; a flag that triggers the ADC does so when it gets set */
+static void timer_sync(struct timer *t)
+{
+	struct prescaler *pre = t->pre;
+	unsigned long long now = prescaler_clock(pre);
+	int cs = avr_IO[t->tccrb] & 7, w, flags;
+
+	if(prescaler_halted(pre))
+		pre->base = now;
+	if(t->last < pre->base)
+		t->last = pre->base;
+	if(now <= t->last)
+		return;
+	if(cs && !prescaler_halted(pre)) {
+		w = pre->tap[cs-1];
+		flags = timer_advance(t, (now - pre->base >> w) - (t->last - pre->base >> w));
+		if(flags) {
+			if(flags & ~avr_IO[t->tifr] & adc_trigger_flag(t-timers))
+				adc_trigger();
+			avr_IO[t->tifr] |= flags;
+			timer_irq(t);
+		}
+	}
+	t->last = now;
+}
+
+/* make sure avr_deadline gets called at the next compare match or overflow that can request
+   an interrupt or trigger the ADC (for real-time clocks, this is only an estimate) */
+static void timer_schedule(struct timer *t)
+{
+	struct prescaler *pre = t->pre;
+	int cs = avr_IO[t->tccrb] & 7, want, i, w;
+	unsigned long long ticks = NEVER, tick, at;
+	unsigned long freq;
+	struct timer_cycle c;
+
+	want = (avr_IO[t->timsk] | adc_trigger_flag(t-timers)) & ~avr_IO[t->tifr];
+	if(!cs || prescaler_halted(pre)) {
+		schedule(t-timers, NEVER);
+		return;
+	}
+	timer_cycle(t, &c);
+	for(i=0; i < c.n; i++)
+		if(c.flag[i] & want && (c.at[i] + c.period - c.pos) % c.period + 1 < ticks)
+			ticks = (c.at[i] + c.period - c.pos) % c.period + 1;
+	if(c.wrap && c.period - c.pos < ticks)
+		ticks = c.period - c.pos;
+	if(ticks == NEVER) {
+		schedule(t-timers, NEVER);
+		return;
+	}
+
+	/* the prescaler clock value at which the counter has made that many ticks */
+	w = pre->tap[cs-1];
+	tick = (t->last - pre->base >> w) + ticks;
+	if(tick > (NEVER - pre->base) >> w) {
+		schedule(t-timers, NEVER);
+		return;
+	}
+	at = pre->base + (tick << w);
+	freq = prescaler_freq(pre);
+	if(freq) {
+		unsigned long long now = prescaler_clock(pre);
+		at = at > now? (at - now) * F_CPU / freq : 0;
+		schedule(t-timers, avr_cycle + (at? at : 1));
+	} else {
+		schedule(t-timers, at+1);
+	}
+}
+
+static void timer_update(struct timer *t)
+{
+	timer_sync(t);
+	timer_schedule(t);
+}
+
+/* after avr_reset() */
+static void timer_reset(void)
+{
+	int i;
+	for(i=0; i < 2; i++)
+		prescaler[i].base = prescaler_clock(&prescaler[i]);
+	for(i=0; i < 3; i++) {
+		timers[i].count = timers[i].down = 0;
+		timers[i].last = timers[i].pre->base;
+		schedule(i, NEVER);
+	}
+}
+
+/* the watchdog behaves mostly according to the datasheet; it counts the cycles of its 128kHz
+   oscillator in emulated time. WDR only notes the cycle at which it was executed (avr_last_wdr,
+   the lower half of avr_cycle), so the deadline is moved forward when it turns out to have been
+   executed since; the timeout still happens at the exact cycle */
+
+#define WD_CYCLES (F_CPU/128000)
+
+static unsigned long wd_timeout(void)
+{
+	unsigned char wdtcr = avr_IO[WDTCSR];
+	unsigned wdp = (wdtcr&0x20)/4 + (wdtcr&0x7);
+	if(!(wdtcr & (WDIE|WDE)))
+		return 0;
+	return WD_CYCLES * (2048ul << (wdp > 9? 9 : wdp));
+}
+
+static void wd_schedule(void)
+{
+	unsigned long timeout = wd_timeout(), since = (unsigned long)avr_cycle - avr_last_wdr;
+	schedule(EV_WDT, !timeout? NEVER : avr_cycle + (since < timeout? timeout - since : 0));
+}
+
+static void wd_event(void)
+{
+	unsigned long timeout = wd_timeout();
+	if(timeout && (unsigned long)avr_cycle - avr_last_wdr >= timeout) {
+		avr_last_wdr = avr_cycle;
+		if(avr_IO[WDTCSR] & WDIE) {
+			avr_IO[WDTCSR] |= WDIF;
+			if(avr_IO[WDTCSR] & WDE)
+				avr_IO[WDTCSR] &= ~WDIE;
+			irq_update(0, IRQ(vec_WDIF));
+		} else {
+			INT_reason = WDRESET;
+			irq_update(0, IRQ(vec_RESET));
+		}
+	}
+	wd_schedule();
+}
+
+static void uart_pace(int n);
+static void spi_event(void);
+static void twi_event(void);
+static void board_event(void);
+static void spm_event(void);
+static void adc_event(void);
+static void replay_event(void);
+
+void avr_deadline(void)
+{
+	int i;
+	for(i=0; i < EVENTS; i++)
+		if(event_at[i] <= avr_cycle) {
+			event_at[i] = NEVER;
+			switch(i) {
+			case EV_WDT:   wd_event();    break;
+			case EV_UART0:
+			case EV_UART1:
+			case EV_UART2:
+			case EV_UART3: uart_pace(i-EV_UART0); break;
+			case EV_SPI:   spi_event();   break;
+			case EV_TWI:   twi_event();   break;
+			case EV_BOARD: board_event(); break;
+			case EV_SPM:   spm_event();   break;
+			case EV_ADC:   adc_event();   break;
+			case EV_REPLAY: replay_event(); break;
+			default:       timer_update(&timers[i]);
+			}
+		}
+	schedule(0, event_at[0]);
+}
+
+/* blocks until there is an interrupt to take (or, if the mcu is halted, a reset), hup_fd (if not
+   negative) hangs up, or ns nanoseconds have passed (if not negative) */
+static void idle_wait(long long ns, int halted, int hup_fd)
+{
+	struct pollfd fds[2] = { { wake_fd, POLLIN }, { hup_fd, POLLHUP } };
+	struct timespec ts = { ns / 1000000000, ns % 1000000000 };
+	uint64_t count;
+	if(replaying) /* the time that passes is in the recording */
+		return;
+	idle = 1;
+	__sync_synchronize();
+	if(halted? INT_reason == INTR && !avr_MAIL : !avr_INT)
+		ppoll(fds, hup_fd < 0? 1 : 2, ns < 0? NULL : &ts, NULL);
+	idle = 0;
+	if(read(wake_fd, &count, sizeof count) < 0)
+		return; /* nobody woke us */
+}
+
+/* let time pass while the mcu is sleeping or halted: skip to the next event in emulated time,
+   or wait for the real-time clocks */
+static void timer_idle(int halted, int hup_fd)
+{
+	int i, ev = -1;
+	unsigned long long start;
+	for(i=0; i < EVENTS; i++)
+		if(i != EV_REPLAY && event_at[i] != NEVER && (ev < 0 || event_at[i] < event_at[ev]))
+			ev = i;
+	if(ev >= 0 && (ev > EV_TIMER2 || !prescaler_freq(timers[ev].pre))) {
+		if(avr_cycle < event_at[ev])
+			avr_cycle = event_at[ev];
+		avr_deadline();
+	} else {
+		start = oscillator(F_CPU);
+		idle_wait(ev < 0? -1 : (long long)((event_at[ev] - avr_cycle) * 1000000000ull / F_CPU), halted, hup_fd);
+		avr_cycle += 2 + oscillator(F_CPU) - start;
+		for(i=0; i < 3; i++)
+			if(prescaler_freq(timers[i].pre))
+				timer_update(&timers[i]);
+	}
+}
+
+/* the flag of a timer interrupt is cleared when it is executed */
+static void timer_ack(int vec)
+{
+	int i, j;
+	for(i=0; i < 3; i++) {
+		struct timer *t = &timers[i];
+		if(vec < t->vec || vec > t->vec + 2*t->channels) continue;
+		j = (vec - t->vec)/2;
+		avr_IO[t->tifr] &= j < t->channels? ~(OCFA << j) : ~TOV;
+		timer_irq(t);
+		timer_schedule(t);
+	}
+}
+
+#define OR(x,y) __sync_fetch_and_or(&x,y)
+#define AND(x,y) __sync_fetch_and_and(&x,y)
+#define INCR(x) __sync_add_and_fetch(&x,1)
+#define DECR(x) __sync_fetch_and_sub(&x,1)
+
+/* the four USARTs are the same but for their registers and vectors; USART0 also has the unpaced
+   ways of talking to stdin and stdout below, and can be wired on a board */
+
+static struct uart {
+	int io;                       /* UCSRnA; see usart_regs */
+	int vec;                      /* RXC; UDRE and TXC follow */
+	struct bridge *bridge;        /* the host side, if any */
+	const char *link;             /* a symbolic link to its pty */
+	unsigned long long tx_free;   /* when the shift register will be empty */
+	unsigned long long rx_next;   /* when the next byte can have arrived */
+	unsigned long long rx_at;     /* when the byte in UDRn arrived; NEVER if it came while waiting */
+	int txc;                      /* TXC is to be set at tx_free */
+} uart[4] = {
+	{ UCSR0A, vec_RXC  },
+	{ UCSR1A, vec_RXC1 },
+	{ UCSR2A, vec_RXC2 },
+	{ UCSR3A, vec_RXC3 },
+};
+
+/* the USART (with a bridge) on stdin and stdout, if any; otherwise, they belong to USART0 */
+static struct uart *uart_stdio;
+
+/* the USART whose registers these are, or NULL */
+static struct uart *uart_of(int port)
+{
+	int n;
+	for(n=0; n < 4; n++)
+		if(port >= uart[n].io && port <= uart[n].io+UDR)
+			return &uart[n];
+	return NULL;
+}
+
+/* USART1..3 are always paced, since nothing else handles them */
+static int uart_paced(const struct uart *u)
+{
+	return u->bridge || u != &uart[0];
+}
+
+/* the interrupts follow the flags in UCSRnA that are enabled in UCSRnB */
+static unsigned long long uart_req(const struct uart *u)
+{
+	int req = avr_IO[u->io+UCSRA] & avr_IO[u->io+UCSRB];
+	return (req&RXC? IRQ(u->vec) : 0) | (req&UDRE? IRQ(u->vec+2) : 0) | (req&TXC? IRQ(u->vec+4) : 0);
+}
+
+static void uart_irq(const struct uart *u)
+{
+	irq_update(IRQ(u->vec)|IRQ(u->vec+2)|IRQ(u->vec+4), uart_req(u));
+	irq_update(0, uart_req(u)); /* in case another thread changed UCSRnA meanwhile */
+}
+
+/* the time it takes to shift out a frame of 10 bits */
+static unsigned long uart_frame(const struct uart *u)
+{
+	unsigned ubrr = avr_IO[u->io+UBRRH]<<8 | avr_IO[u->io+UBRRL];
+	return 10ul * (avr_IO[u->io+UCSRA]&U2X? 8 : 16) * (ubrr+1);
+}
+
+/* the mailbox: threads other than the emulator, and signal handlers, do not write to avr_IO
+   themselves (so that the core can use plain instructions for I/O, see avr_ASYNC), but post the
+   flags they raise here; the core calls avr_mail() before the next instruction, and the host
+   calls take_mail() while the mcu sleeps */
+
+static volatile unsigned char mail_flags[0x200];
+static volatile unsigned mail_ports[0x200/32];
+
+static void io_post(int port, unsigned char flags)
+{
+	OR(mail_flags[port], flags);
+	OR(mail_ports[port/32], 1u << port%32);
+	avr_MAIL = 1;
+	avr_INT = 1;
+	idle_wake();
+}
+
+/* a reset asked for by a signal (see ctrl_handler) */
+static volatile int mail_reset;
+
+static void reset_request(int reason)
+{
+	INT_reason = reason;
+	irq_update(0, IRQ(vec_RESET));
+}
+
+static void mail_deliver(int port, unsigned char flags)
+{
+	struct uart *u = uart_of(port);
+	avr_IO[port] |= flags;
+	if(u && port == u->io+UCSRA)
+		uart_irq(u);
+}
+
+/* with -record, the mail is logged as it is delivered; with -replay, the recorded mail is delivered
+   instead, at the same cycle (only a reset by a signal still gets through) */
+void avr_mail(void)
+{
+	unsigned i, ports;
+	int kind, arg, reason;
+	long long value;
+	for(i=0; i < sizeof mail_ports/sizeof *mail_ports; i++)
+		for(ports = __sync_lock_test_and_set(&mail_ports[i], 0); ports; ports &= ports-1) {
+			int port = 32*i + __builtin_ctz(ports);
+			unsigned char flags = __sync_lock_test_and_set(&mail_flags[port], 0);
+			if(replaying)
+				continue;
+			replay_log(REPLAY_MAIL, port, flags);
+			mail_deliver(port, flags);
+		}
+	if((reason = __sync_lock_test_and_set(&mail_reset, 0)) != INTR) {
+		replay_log(REPLAY_RESET, 0, reason);
+		reset_request(reason);
+	}
+	if(replaying) {
+		while(replay_take(&kind, &arg, &value))
+			if(kind == REPLAY_MAIL)
+				mail_deliver(arg, value);
+			else
+				reset_request(value);
+		schedule(EV_REPLAY, replay_next());
+	}
+}
+
+/* the next recorded input is due */
+static void replay_event(void)
+{
+	avr_MAIL = 1;
+	avr_INT = 1;
+}
+
+/* is there mail for the host to take while the mcu is idle (or a recorded input that is due)? */
+static int mail_waiting(void)
+{
+	return avr_MAIL || replay_next() <= avr_cycle;
+}
 
-#define set_timer(n, val) \
-	fetch_timer(n); \
-	timer[n] -= timer_ofs[n]; \
-	timer[n] += timer_ofs[n] = (val) - (timer[n]&(n==1? 0xFFFF: 0xFF));
+/* as the core does it: the avr_INT that came with the mail is taken back, unless it is needed */
+static void take_mail(void)
+{
+	__sync_lock_test_and_set(&avr_MAIL, 0);
+	avr_mail();
+	__sync_lock_test_and_set(&avr_INTR, 0);
+	if(avr_IRQ || avr_MAIL || avr_HALT)
+		avr_INT = 1;
+}
+
+/* -pty or -usart: a USART is connected to the host through the rings of bridge.c, which a thread
+   fills and drains for all of them. the bytes pass at the speed set by UBRRn, counted in emulated
+   cycles by a token bucket that holds two frames (UDRn and the shift register): a byte written to
+   UDRn waits there until the previous one has been shifted out, and a received byte becomes
+   visible a frame after the one before it. nothing sleeps, so time acceleration works as for the
+   timers. a USART without a connection sends into the void, and receives nothing */
+
+/* called on the thread of bridge.c, after bridge_wait */
+static void uart_arrived(void *arg)
+{
+	struct uart *u = arg;
+	io_post(u->io+UCSRA, RXC);
+}
 
+/* what the bridge says depends on the host, so it is recorded (or replayed) */
+static int uart_room(struct uart *u)
+{
+	long long v;
+	if(!u->bridge)
+		return 1;
+	if(!replay_input(REPLAY_TX_ROOM, &v))
+		replay_log(REPLAY_TX_ROOM, u-uart, v = bridge_room(u->bridge));
+	return v;
+}
+
+static int uart_wait(struct uart *u)
+{
+	long long v;
+	if(!u->bridge)
+		return 0;
+	if(!replay_input(REPLAY_RX_WAIT, &v))
+		replay_log(REPLAY_RX_WAIT, u-uart, v = bridge_wait(u->bridge));
+	return v;
+}
+
+static int uart_get(struct uart *u, unsigned char *c)
+{
+	long long v;
+	if(!u->bridge)
+		return 0;
+	if(!replay_input(REPLAY_RX_GET, &v))
+		replay_log(REPLAY_RX_GET, u-uart, v = bridge_get(u->bridge, c)? *c : -1);
+	*c = v;
+	return v >= 0;
+}
+
+/* brings the flags in UCSRnA up to date, and schedules the next time one of them changes */
+static void uart_pace(int n)
+{
+	struct uart *u = &uart[n];
+	volatile unsigned char *ucsra = &avr_IO[u->io+UCSRA];
+	unsigned long frame = uart_frame(u);
+	unsigned long long next = NEVER;
+	if(!(*ucsra & UDRE)) {
+		if(avr_cycle+frame < u->tx_free)
+			next = u->tx_free-frame;
+		else if(uart_room(u))
+			OR(*ucsra, UDRE);
+		else
+			next = avr_cycle+frame; /* the host is not keeping up */
+	}
+	if(u->txc && avr_cycle >= u->tx_free) {
+		OR(*ucsra, TXC);
+		u->txc = 0;
+	} else if(u->txc && u->tx_free < next)
+		next = u->tx_free;
+	if(!(*ucsra & RXC)) {
+		if(avr_cycle < u->rx_next) {
+			if(u->rx_next < next) next = u->rx_next;
+		} else if(uart_wait(u)) {
+			OR(*ucsra, RXC);
+			u->rx_at = u->rx_next;
+		} else
+			u->rx_at = NEVER;
+	}
+	uart_irq(u);
+	schedule(EV_UART0+n, next);
+}
+
+static void uart_read(struct uart *u)
+{
+	unsigned char c;
+	if(!(avr_IO[u->io+UCSRA] & RXC))
+		return;
+	if(uart_get(u, &c))
+		avr_IO[u->io+UDR] = c;
+	AND(avr_IO[u->io+UCSRA], ~RXC);
+	u->rx_next = (u->rx_at == NEVER? avr_cycle : u->rx_at) + uart_frame(u);
+	uart_pace(u-uart);
+}
+
+static void uart_write(struct uart *u)
+{
+	if(avr_IO[u->io+UCSRA] & UDRE) { /* otherwise, the byte in UDRn is overwritten */
+		if(u->bridge)
+			bridge_put(u->bridge, avr_IO[u->io+UDR]);
+		u->tx_free = (u->tx_free > avr_cycle? u->tx_free : avr_cycle) + uart_frame(u);
+		u->txc = 1;
+		AND(avr_IO[u->io+UCSRA], ~(TXC|UDRE));
+	}
+	uart_pace(u-uart);
+}
+
+static void uart_reset(struct uart *u)
+{
+	u->tx_free = u->rx_next = u->txc = 0;
+	u->rx_at = NEVER;
+	uart_pace(u-uart);
+}
+
+/* waits until everything the mcu sent has been written */
+static void uart_flush(void)
+{
+	int n;
+	for(n=0; n < 4; n++)
+		if(uart[n].bridge)
+			bridge_flush(uart[n].bridge);
+}
+
+/* the flag of TXC is cleared when its interrupt is executed */
+static void uart_ack(int vec)
+{
+	int n;
+	for(n=0; n < 4; n++)
+		if(vec == uart[n].vec+4) {
+			AND(avr_IO[uart[n].io+UCSRA], ~TXC);
+			uart_irq(&uart[n]);
+		}
+}
+
+/* -usart:n:endpoint (see bridge.c), or -pty[:symlink] for USART0; pty:symlink also makes a
+   symbolic link to the terminal */
+static int uart_connect(int n, const char *spec)
+{
+	struct uart *u = &uart[n];
+	const char *pty, *stdin_pty = NULL, *sym = strncmp(spec, "pty:", 4) == 0? spec+4 : NULL;
+	int terminal = sym || strcmp(spec, "pty") == 0;
+	if(u->bridge)
+		return -1;
+	/* the terminal of USART0 is on stdin and stdout, so that its hangup is noticed; in a replay,
+	   its input is in the recording, and what the mcu sends goes to stdout */
+	if(terminal)
+		spec = n == 0? "stdio" : "pty";
+	if(strcmp(spec, "stdio") == 0) {
+		if(uart_stdio)
+			return -1;
+		uart_stdio = u;
+	}
+	if(terminal && n == 0 && !replaying) {
+		extern const char *make_stdin_pty(void);
+		stdin_pty = make_stdin_pty();
+	}
+	if(!(u->bridge = bridge_connect(spec, uart_arrived, u, &pty)))
+		return -1;
+	if(stdin_pty)
+		pty = stdin_pty;
+	if(pty && sym) {
+		if(symlink(pty, sym) != 0) {
+			fprintf(stderr, "could not create symbolic link %s\n", sym);
+			return -1;
+		}
+		u->link = pty = sym;
+	}
+	if(pty)
+		fprintf(stderr, "connecting terminal for USART%d: %.*s%s\n", n, (pty[0]!='/')*2, "./", pty);
+	return 0;
+}
+
+#ifdef THREAD_IO
+static pthread_t tty_thread;
+
+static volatile unsigned char uart_buffer[256];
+static volatile unsigned int uart_num;
+static volatile int uart_draining;   /* the emulator waits for uart_num to become 0 */
+
+static void *fake_console(void *threadid)
+{
+	int ptr = 0;
+	while(1) {
+		while(uart_num > 0) {
+			int c = uart_buffer[ptr];
+			ptr = (ptr+1) % sizeof uart_buffer;
+			OR(avr_IO[UCSR0A], TXC|UDRE);
+			if(DECR(uart_num) == 1 && uart_draining)
+				syscall(SYS_futex, &uart_num, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+			irq_update(0, uart_req(&uart[0]));
+			assert(putchar(c) != EOF);
+#ifdef BAUD
+			usleep(10000000/BAUD);
+#endif
+		}
+		if(!(OR(avr_IO[UCSR0A], UDRE) & UDRE)) // in case it is cleared due to a reset
+			irq_update(0, uart_req(&uart[0]));
+		usleep(THREAD_IO);
+	}
+}
+
+static pthread_t rbr_thread;
+
+static volatile unsigned char rdbr_buffer[256];
+static volatile unsigned int rdbr_num = sizeof rdbr_buffer;
+
+static void *fake_receiver(void *threadid)
+{
+	int ptr = 0;
+	sched_yield();
+	while(1) {
+		int c = getchar();
+		if(c != EOF) {
+			rdbr_buffer[ptr] = c;
+			ptr = (ptr+1) % sizeof rdbr_buffer;
+			OR(avr_IO[UCSR0A], RXC);
+			DECR(rdbr_num);
+		} else if(rdbr_num == sizeof rdbr_buffer) {
+			break;
+		} else
+			OR(avr_IO[UCSR0A], RXC);
+		irq_update(0, uart_req(&uart[0]));
+#ifdef BAUD
+		usleep(10000000/BAUD);
+#endif
+		while(rdbr_num == 0)
+			usleep(THREAD_IO);
+	}
+	return NULL;
+}
+#endif
+
+/* a byte from stdin, or EOF; recorded (or replayed) */
+static int uart_getchar(void)
+{
+	long long c;
+	if(!replay_input(REPLAY_GETCHAR, &c))
+		replay_log(REPLAY_GETCHAR, 0, c = getchar());
+	return c;
+}
+
+/* signal handler to handle arrival of data */
+static void io_input_handler(int sig)
+{
+	int n;
+	if((avr_IO[UCSR0A] & RXC) == 0 && ioctl(STDIN_FILENO, FIONREAD, &n) == 0 && n > 0)
+		io_post(UCSR0A, RXC);
+}
+
+/* the SPI and TWI masters; the chips on the buses are modelled in devices.c, and are called
+   when the time it takes to clock out a byte has passed. only master mode is supported */
+
+static struct {
+	int busy, clear;              /* a byte is being shifted; SPSR was read with SPIF set */
+	unsigned char out, rx;
+} spi;
+
+static unsigned char bitrev(unsigned char b)
+{
+	b = b >> 4 | b << 4;
+	b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+	return (b & 0xAA) >> 1 | (b & 0x55) << 1;
+}
+
+static void spi_irq(void)
+{
+	irq_update(IRQ(vec_SPI), avr_IO[SPSR] & SPIF && avr_IO[SPCR] & SPIE? IRQ(vec_SPI) : 0);
+}
+
+static unsigned char spi_wire(unsigned char out, int master);
+static void spi_receive(void);
+
+/* reading SPSR with SPIF set, then accessing SPDR clears SPIF and WCOL */
+static void spi_access(void)
+{
+	if(spi.clear) {
+		avr_IO[SPSR] &= ~(SPIF|WCOL);
+		spi.clear = 0;
+		spi_irq();
+		spi_receive();
+	}
+}
+
+static void spi_start(void)
+{
+	static const char rate[4] = { 2, 4, 6, 7 };
+	if(spi.busy) {
+		avr_IO[SPSR] |= WCOL;
+		return;
+	}
+	if((avr_IO[SPCR] & (SPE|MSTR)) == SPE) /* a slave on a board: shifted out at the next transfer */
+		spi_wire(avr_IO[SPCR]&DORD? bitrev(avr_IO[SPDR]) : avr_IO[SPDR], 0);
+	if((avr_IO[SPCR] & (SPE|MSTR)) != (SPE|MSTR))
+		return;
+	spi.out  = avr_IO[SPDR];
+	spi.busy = 1;
+	schedule(EV_SPI, avr_cycle + (8 << rate[avr_IO[SPCR]&3] >> (avr_IO[SPSR]&SPI2X)));
+}
+
+static void spi_event(void)
+{
+	struct spi_device *dev;
+	unsigned char out = avr_IO[SPCR]&DORD? bitrev(spi.out) : spi.out, in = spi_wire(out, 1);
+	for(dev=spi_devices; dev; dev=dev->next)
+		if(dev->selected)
+			in &= dev->transfer(dev, out);
+	spi.rx   = avr_IO[SPCR]&DORD? bitrev(in) : in;
+	spi.busy = 0;
+	avr_IO[SPSR] |= SPIF;
+	spi_irq();
+}
+
+/* a chip is selected while its chip select pin is an output driven low */
+static void spi_select(void)
+{
+	struct spi_device *dev;
+	int sel;
+	for(dev=spi_devices; dev; dev=dev->next) {
+		sel = (avr_IO[dev->cs_port-1] & ~avr_IO[dev->cs_port]) >> dev->cs_pin & 1;
+		if(sel != dev->selected)
+			dev->select(dev, dev->selected = sel);
+	}
+}
+
+static struct {
+	enum { TWI_IDLE, TWI_ADDRESS, TWI_TRANSMIT, TWI_RECEIVE } state;
+	enum { TWI_START, TWI_SLA, TWI_DATA } action;
+	struct twi_device *dev;       /* the addressed slave */
+} twi;
+
+static void twi_irq(void)
+{
+	irq_update(IRQ(vec_TWI), (avr_IO[TWCR] & (TWINT|TWIE)) == (TWINT|TWIE)? IRQ(vec_TWI) : 0);
+}
+
+/* TWINT has been cleared: perform what TWCR asks for */
+static void twi_start(void)
+{
+	unsigned long scl = 16 + 2*avr_IO[TWBR] * (1 << 2*(avr_IO[TWSR]&3));
+	int cr = avr_IO[TWCR];
+	if(cr & TWSTO) {
+		if(twi.dev) twi.dev->stop(twi.dev);
+		twi.dev   = NULL;
+		twi.state = TWI_IDLE;
+		avr_IO[TWCR] &= ~TWSTO;
+		avr_IO[TWSR]  = 0xF8 | avr_IO[TWSR]&3;
+	}
+	if(cr & TWSTA) {
+		twi.action = TWI_START;
+		schedule(EV_TWI, avr_cycle + scl);
+	} else if(twi.state != TWI_IDLE) {
+		twi.action = twi.state == TWI_ADDRESS? TWI_SLA : TWI_DATA;
+		schedule(EV_TWI, avr_cycle + 9*scl);
+	}
+}
+
+static void twi_event(void)
+{
+	struct twi_device *dev;
+	int cr = avr_IO[TWCR], sla, status;
+	switch(twi.action) {
+	case TWI_START:
+		status = twi.state == TWI_IDLE? 0x08 : 0x10;
+		twi.state = TWI_ADDRESS;
+		break;
+	case TWI_SLA:
+		sla = avr_IO[TWDR];
+		for(dev=twi_devices; dev && (dev->addr != sla>>1 || !dev->start(dev, sla&1)); dev=dev->next)
+			;
+		twi.dev   = dev;
+		twi.state = sla&1? TWI_RECEIVE : TWI_TRANSMIT;
+		status    = sla&1? (dev? 0x40 : 0x48) : (dev? 0x18 : 0x20);
+		break;
+	default:
+		if(twi.state == TWI_TRANSMIT) {
+			status = twi.dev && twi.dev->write(twi.dev, avr_IO[TWDR])? 0x28 : 0x30;
+		} else {
+			avr_IO[TWDR] = twi.dev? twi.dev->read(twi.dev, cr & TWEA) : 0xFF;
+			status = cr & TWEA? 0x50 : 0x58;
+		}
+		break;
+	}
+	avr_IO[TWSR] = status | avr_IO[TWSR]&3;
+	avr_IO[TWCR] |= TWINT;
+	twi_irq();
+}
+
+/* board mode (see board.c): USART0, SPI and the gpio ports can be wired to other mcus; the time
+   on the board goes on where avr_cycle is reset */
+
+static unsigned long long board_base;
+#define BOARD_NOW (board_base + avr_cycle)
+
+static int uart_wired, spi_wired;
+static unsigned char uart_rx;
+static unsigned char spi_miso = 0xFF; /* the byte that a slave has last put on the wire */
+static unsigned char gpio_in[4];
+
+/* a byte that has arrived waits on the wire until the previous one has been read */
+static void uart_receive(void)
+{
+	if(!(avr_IO[UCSR0A] & RXC) && board_recv(BOARD_UART0, BOARD_NOW, &uart_rx))
+		OR(avr_IO[UCSR0A], RXC);
+}
+
+/* the bytes on the SPI wires are in the order they are shifted. what a master shifts out goes to
+   every mcu wired to it, and it shifts in the byte that was last in the shift register of a
+   slave: the one it received, or what it wrote to SPDR since. there is no slave select */
+static unsigned char spi_wire(unsigned char out, int master)
+{
+	board_send(BOARD_SPI0, BOARD_NOW, 0, out);
+	if(master && spi_wired)
+		while(board_recv(BOARD_SPI0, BOARD_NOW, &spi_miso))
+			;
+	return spi_miso;
+}
+
+/* a slave takes a byte that has arrived when it has read the previous one, like USART0 */
+static void spi_receive(void)
+{
+	unsigned char in;
+	if(spi_wired && (avr_IO[SPCR] & (SPE|MSTR)) == SPE && !(avr_IO[SPSR] & SPIF)
+	 && board_recv(BOARD_SPI0, BOARD_NOW, &in)) {
+		spi.rx = avr_IO[SPCR]&DORD? bitrev(in) : in;
+		avr_IO[SPSR] |= SPIF;
+		spi_irq();
+		spi_wire(in, 0);
+	}
+}
+
+static void board_event(void)
+{
+	unsigned long long next = board_sync(BOARD_NOW);
+	int p;
+	for(p=BOARD_PORTA; p <= BOARD_PORTD; p++)
+		while(board_recv(p, BOARD_NOW, &gpio_in[p-BOARD_PORTA]))
+			avr_IO[PINA + 3*(p-BOARD_PORTA)] = gpio_in[p-BOARD_PORTA];
+	vcd_sample_all();
+	if(uart_wired) {
+		uart_receive();
+		uart_irq(&uart[0]);
+	}
+	spi_receive();
+	schedule(EV_BOARD, next - board_base);
+}
+
+/* self-programming: SPM fills the temporary page buffer one word at a time, and erases or writes
+   a whole page, which takes effect about 4ms later; until then SPMEN stays set and the RWW section
+   is busy (RWWSB), which the program has to clear with RWWSRE. the cpu keeps running, as it would
+   in the NRWW section where a bootloader lives */
+
+#define SPMCSR 0x37
+
+enum spmcsr_bits {
+	SPMIE = 1<<7, RWWSB = 1<<6, SIGRD = 1<<5, RWWSRE = 1<<4, BLBSET = 1<<3, PGWRT = 1<<2, PGERS = 1<<1, SPMEN = 1<<0
+};
+
+#define SPM_PAGE   128                /* words */
+#define SPM_CYCLES (F_CPU/250)        /* 4ms, between the 3.7 and 4.5ms of the datasheet */
+
+static struct {
+	unsigned short buf[SPM_PAGE];
+	unsigned long page;           /* word address of the page being erased or written */
+	unsigned char op;             /* PGERS or PGWRT while busy */
+	unsigned long long armed;     /* when SPMEN was set */
+} spm;
+
+extern void gdb_flash(unsigned long addr, unsigned long words, int written); /* see gdbstub.c */
+
+static void spm_irq(void)
+{
+	irq_update(IRQ(vec_SPMR), (avr_IO[SPMCSR] & (SPMIE|SPMEN)) == SPMIE? IRQ(vec_SPMR) : 0);
+}
+
+static void spm_clear_buffer(void)
+{
+	memset(spm.buf, 0xFF, sizeof spm.buf);
+}
+
+/* the erase or write has completed; breakpoints in the page are moved out of the way meanwhile */
+static void spm_event(void)
+{
+	unsigned long i, changed = 0;
+	gdb_flash(spm.page, SPM_PAGE, 0);
+	measure_flash(spm.page, SPM_PAGE, 0);
+	for(i=0; i < SPM_PAGE; i++) {
+		unsigned short word = spm.op == PGERS? 0xFFFF : avr_FLASH[spm.page+i] & spm.buf[i];
+		changed += word != avr_FLASH[spm.page+i];
+		avr_FLASH[spm.page+i] = word;
+	}
+	if(spm.op == PGWRT)
+		spm_clear_buffer();
+	gdb_flash(spm.page, SPM_PAGE, 1);
+	measure_flash(spm.page, SPM_PAGE, 1);
+#ifdef SPM_LOG
+	fprintf(stderr, "flash page %05lX %s, %lu words changed\n", 2*spm.page, spm.op == PGERS? "erased" : "written", changed);
+#else
+	(void)changed;
+#endif
+	spm.op = 0;
+	avr_IO[SPMCSR] &= ~(PGWRT|PGERS|SPMEN);
+	spm_irq();
+}
 
-/* a routine for asynchronously polling the timer */
-static void timer_poll_handler(int sig)
+/* called by the emulator for SPM; the operation is selected by SPMCSR, which has to be written
+   at most four cycles earlier */
+void avr_self_program(int addr, int value)
 {
-	fetch_timer(0);
-	fetch_timer(1);
-	fetch_timer(2);
+	unsigned long word = addr/2 & 0x1FFFF;
+	int cmd = avr_IO[SPMCSR] & (RWWSRE|BLBSET|PGWRT|PGERS|SPMEN);
+	if(spm.op || !(cmd & SPMEN) || avr_cycle-spm.armed > 4)
+		return;
+	switch(cmd) {
+	case SPMEN:
+		spm.buf[word % SPM_PAGE] = value;
+		break;
+	case PGERS|SPMEN:
+	case PGWRT|SPMEN:
+		spm.op = cmd & ~SPMEN;
+		spm.page = word & ~(SPM_PAGE-1ul);
+		avr_IO[SPMCSR] |= RWWSB;
+		schedule(EV_SPM, avr_cycle + SPM_CYCLES);
+		return;
+	case RWWSRE|SPMEN:
+		avr_IO[SPMCSR] &= ~RWWSB;
+		spm_clear_buffer();
+		break;
+	default: /* lock bits can't be changed */
+		break;
+	}
+	avr_IO[SPMCSR] &= ~(RWWSRE|BLBSET|PGWRT|PGERS|SPMEN);
+	spm_irq();
 }
 
-#define OR(x,y) __sync_fetch_and_or(&x,y)
-#define AND(x,y) __sync_fetch_and_and(&x,y)
-#define INCR(x) __sync_add_and_fetch(&x,1)
-#define DECR(x) __sync_fetch_and_sub(&x,1)
+/* the ADC converts the signals of adc.c as they are at its sample and hold, in emulated time.
+   its clock is F_CPU divided by ADPS, counted from the moment ADEN is set; a conversion takes 13
+   of its cycles (the first after ADEN 25), from the next edge after ADSC is set, or 13.5 from an
+   auto trigger, which resets the prescaler. in free running mode (ADTS 0), the next conversion
+   starts as one completes. of the other trigger sources, there are only the compare matches and
+   overflows of timers 0 and 1; the differential channels read 0 */
+
+static struct {
+	int busy, first;
+	int locked;                   /* ADCL has been read, ADCH not yet */
+	unsigned char mux, refs;      /* as of the start of the conversion */
+	unsigned long long base;      /* the cycle at which the prescaler started */
+	unsigned long long hold, done;
+	unsigned long long time, last; /* cycles before the last reset; the last sample */
+} adc;
+
+static void adc_irq(void)
+{
+	irq_update(IRQ(vec_ADC), (avr_IO[ADCSRA] & (ADIF|ADIE)) == (ADIF|ADIE)? IRQ(vec_ADC) : 0);
+}
 
-#ifdef THREAD_IO
-static pthread_t tty_thread;
+static unsigned adc_div(void)
+{
+	int ps = avr_IO[ADCSRA] & 7;
+	return ps? 1u << ps : 2;
+}
 
-static volatile unsigned char uart_buffer[256];
-static volatile unsigned int uart_num;
+/* the sample and hold and the end of the conversion are given in half cycles of the ADC clock */
+static void adc_start(unsigned long long at, int hold, int length)
+{
+	unsigned div = adc_div();
+	adc.mux  = avr_IO[ADMUX] & 0x1F | (avr_IO[ADCSRB] & MUX5) << 2;
+	adc.refs = avr_IO[ADMUX] >> 6;
+	adc.hold = at + hold*div/2;
+	adc.done = at + length*div/2;
+	adc.busy = 1;
+	avr_IO[ADCSRA] |= ADSC;
+	schedule(EV_ADC, adc.done);
+}
 
-static void *fake_console(void *threadid)
+/* the flag of timer n that auto triggers a conversion (ADTS 3..6), if any */
+static int adc_trigger_flag(int n)
 {
-	int ptr = 0;
-	while(1) {
-		while(uart_num > 0) {
-			int c = uart_buffer[ptr], old_ucsr;
-			ptr = (ptr+1) % sizeof uart_buffer;
-			old_ucsr = OR(avr_IO[UCSR0A], TXC|UDRE);
-			DECR(uart_num);
-#ifndef DELAY_IO
-			if((old_ucsr & (TXC|UDRE)) == 0 && avr_IO[UCSR0B] & (TXC|UDRE))
-				avr_INT = 1;
-#else
-			if(avr_IO[UCSR0B] & (TXC|UDRE))
-				avr_INT = 1;
-#endif
-			assert(putchar(c) != EOF);
-#ifdef BAUD
-			usleep(10000000/BAUD);
-#endif
-		}
-		OR(avr_IO[UCSR0A], UDRE); // in case it is cleared due to a reset
-		usleep(THREAD_IO);
-	}
+	static const struct { signed char timer; unsigned char flag; } source[8] = {
+		[3] = { 0, OCFA }, [4] = { 0, TOV }, [5] = { 1, OCFA<<1 }, [6] = { 1, TOV },
+	};
+	int ts = avr_IO[ADCSRB] & 7;
+	if((avr_IO[ADCSRA] & (ADEN|ADATE)) != (ADEN|ADATE))
+		return 0;
+	return source[ts].timer == n? source[ts].flag : 0;
 }
 
-static pthread_t rbr_thread;
+/* a trigger during a conversion is ignored */
+static void adc_trigger(void)
+{
+	if(adc.busy)
+		return;
+	adc.base = avr_cycle;
+	if(adc.first)
+		adc_start(avr_cycle, 27, 50);
+	else
+		adc_start(avr_cycle, 4, 27);
+}
 
-static volatile unsigned char rdbr_buffer[256];
-static volatile unsigned int rdbr_num = sizeof rdbr_buffer;
+static unsigned adc_value(void)
+{
+	static const unsigned short bandgap[4] = { 225, 225, 1023, 440 }; /* 1.1V of AREF (5V), AVCC, 1.1V, 2.56V */
+	unsigned long long t = adc.time + adc.hold;
+	adc.last = adc.hold;
+	if(adc.mux < 0x08 || adc.mux >= 0x20 && adc.mux < 0x28)
+		return adc_sample(adc.mux & 7 | adc.mux >> 2 & 8, t / F_CPU * 1000000000 + t % F_CPU * 1000000000 / F_CPU);
+	return adc.mux == 0x1E? bandgap[adc.refs] : 0;
+}
 
-static void *fake_receiver(void *threadid)
+static void adc_event(void)
 {
-	int ptr = 0;
-	sched_yield();
-	while(1) {
-		int c = getchar(), old_ucsr;
-		if(c != EOF) {
-			rdbr_buffer[ptr] = c;
-			ptr = (ptr+1) % sizeof rdbr_buffer;
-			old_ucsr = OR(avr_IO[UCSR0A], RXC);
-			DECR(rdbr_num);
-		} else if(rdbr_num == sizeof rdbr_buffer) {
-			break;
-		} else
-			old_ucsr = OR(avr_IO[UCSR0A], RXC);
-#ifndef DELAY_IO
-		if(!(old_ucsr & RXC) && avr_IO[UCSR0B] & RXC)
-			avr_INT = 1;
-#else
-		if(avr_IO[UCSR0B] & RXC)
-			avr_INT = 1;
-#endif
-#ifdef BAUD
-		usleep(10000000/BAUD);
-#endif
-		while(rdbr_num == 0)
-			usleep(THREAD_IO);
+	unsigned value = adc_value();
+	if(!adc.locked) { /* otherwise, the result is lost */
+		if(avr_IO[ADMUX] & ADLAR)
+			value <<= 6;
+		avr_IO[ADCL] = value;
+		avr_IO[ADCH] = value >> 8;
 	}
-	return NULL;
+	adc.busy = adc.first = 0;
+	avr_IO[ADCSRA] |= ADIF;
+	if(avr_IO[ADCSRA] & ADATE && (avr_IO[ADCSRB] & 7) == 0) {
+		adc.base = adc.done;
+		adc_start(adc.done, 3, 26);
+	} else {
+		avr_IO[ADCSRA] &= ~ADSC;
+	}
+	adc_irq();
 }
-#endif
 
-/* signal handler to handle arrival of data */
-static void io_input_handler(int sig)
+/* a write to ADCSRA or ADCSRB; the timers catch up with the trigger source as it was first */
+static void adc_write(int port, unsigned char prev)
 {
-	if((avr_IO[UCSR0A] & RXC) == 0) {
-		avr_INT = 1;
+	unsigned char val = avr_IO[port];
+	avr_IO[port] = prev;
+	timer_sync(&timers[0]);
+	timer_sync(&timers[1]);
+	avr_IO[port] = val;
+	if(port == ADCSRA) {
+		/* writing a one clears ADIF; ADSC stays set until the conversion completes */
+		avr_IO[port] = val & ~(ADIF|ADSC) | (val & ADIF? 0 : prev & ADIF);
+		if(!(val & ADEN)) {
+			adc.busy = 0;
+			schedule(EV_ADC, NEVER);
+		} else if(!(prev & ADEN)) {
+			adc.base  = avr_cycle;
+			adc.first = 1;
+		}
+		if(adc.busy) {
+			avr_IO[port] |= ADSC;
+		} else if((val & (ADEN|ADSC)) == (ADEN|ADSC)) {
+			unsigned div = adc_div();
+			unsigned long long at = adc.base + (avr_cycle - adc.base + div-1) / div * div;
+			if(adc.first)
+				adc_start(at, 27, 50);
+			else
+				adc_start(at, 3, 26);
+		}
+		adc_irq();
 	}
+	timer_schedule(&timers[0]);
+	timer_schedule(&timers[1]);
 }
 
-void avr_io_in(int port)
+static void io_in(int port)
 {
+	struct uart *u = uart_of(port);
+	if(uart_wired && (port == UDR0 || port == UCSR0A)) {
+		if(port == UDR0) {
+			avr_IO[port] = uart_rx;
+			AND(avr_IO[UCSR0A], ~RXC);
+		}
+		uart_receive();
+		OR(avr_IO[UCSR0A], UDRE);
+		uart_irq(&uart[0]);
+		return;
+	}
+	if(u && uart_paced(u) && (port == u->io+UDR || port == u->io+UCSRA)) {
+		if(port == u->io+UDR)
+			uart_read(u);
+		uart_irq(u);
+		return;
+	}
 	switch(port) {
 #ifdef THREAD_IO
 		static int cur = 0;
@@ -369,12 +1524,11 @@ void avr_io_in(int port)
 		if(INCR(rdbr_num) < sizeof rdbr_buffer) {
 #  ifndef DELAY_IO
 			OR(avr_IO[UCSR0A], RXC);
-			if(avr_IO[UCSR0B] & RXC)
-				avr_INT = 1;
 #  endif
 		} else {
 			/* fprintf(stderr, "warning: flow control used\n"); */
 		}
+		uart_irq(&uart[0]);
 		break;
 	case UCSR0A:
 		if(rdbr_num < sizeof rdbr_buffer) { /* in case it is cleared by a reset */
@@ -383,35 +1537,97 @@ void avr_io_in(int port)
 #else
 		int c;
 	case UDR0:
-		avr_IO[port] = getchar();
+		avr_IO[port] = uart_getchar();
 		AND(avr_IO[UCSR0A], ~RXC);
 	case UCSR0A:
-		if((avr_IO[UCSR0A] & RXC) == 0 && (c=getchar()) != EOF) {
-			OR(avr_IO[UCSR0A], RXC|UDRE), ungetc(c, stdin);
+		if((avr_IO[UCSR0A] & RXC) == 0 && (c=uart_getchar()) != EOF) {
+			OR(avr_IO[UCSR0A], RXC|UDRE);
+			if(!replaying) ungetc(c, stdin);
 		} else {
 			OR(avr_IO[UCSR0A], UDRE);
 		}
 #endif
-		if(avr_IO[UCSR0A] & avr_IO[UCSR0B] & (RXC|UDRE))
-			avr_INT = 1;
+		uart_irq(&uart[0]);
 		break;
 	case TCNT0:
-		fetch_timer(0);
-		avr_IO[port] = timer[0];
+	case TCNT2:
+		timer_sync(&timers[port == TCNT2? 2 : 0]);
+		avr_IO[port] = timers[port == TCNT2? 2 : 0].count;
 		break;
 	case TCNT1L:
-		fetch_timer(1);
-		avr_IO[port] = timer[1];
-		TEMP         = timer[1] >> 8;
+		timer_sync(&timers[1]);
+		avr_IO[port] = timers[1].count;
+		TEMP         = timers[1].count >> 8;
+		break;
+	case ICR1L:
+		TEMP = avr_IO[ICR1H];
 		break;
 	case TCNT1H:
+	case ICR1H:
 		avr_IO[port] = TEMP;
 		break;
+	case TIFR0:
+	case TIFR1:
+	case TIFR2:
+		timer_sync(&timers[port-TIFR0]);
+		break;
+	case SPSR:
+		spi.clear = avr_IO[port] & SPIF;
+		break;
+	case SPDR:
+		spi_access();
+		avr_IO[port] = spi.rx;
+		break;
+	case ADCL:
+		adc.locked = 1;
+		break;
+	case ADCH:
+		adc.locked = 0;
+		break;
+	case SPMCSR: /* a command that wasn't followed by SPM in time has lapsed */
+		if(!spm.op && avr_IO[port] & SPMEN && avr_cycle-spm.armed > 4) {
+			avr_IO[port] &= ~(RWWSRE|BLBSET|PGWRT|PGERS|SPMEN);
+			spm_irq();
+		}
+		break;
 	}
 }
 
-void avr_io_out(int port, unsigned char prev)
+/* a write to a timer register; let the counter catch up with the old value first */
+static struct timer *timer_write(int n, int port, unsigned char prev)
+{
+	struct timer *t = &timers[n];
+	unsigned char val = avr_IO[port];
+	avr_IO[port] = prev;
+	timer_sync(t);
+	avr_IO[port] = val;
+	return t;
+}
+
+static void io_out(int port, unsigned char prev)
 {
+	struct timer *t;
+	struct uart *u = uart_of(port);
+	int val, k;
+	if(port == UDR0 && board_send(BOARD_UART0, BOARD_NOW, uart_frame(&uart[0]), avr_IO[port])) {
+		OR(avr_IO[UCSR0A], TXC|UDRE);
+		uart_irq(&uart[0]);
+		return;
+	}
+	if(u && port == u->io+UDR && uart_paced(u)) {
+		uart_write(u);
+		return;
+	}
+	if(u && port == u->io+UCSRA) {
+		/* only allow writing the R/W parts */
+		avr_IO[port] = prev&~0x43 | (avr_IO[port]&0x43 | ~prev&TXC) ^ TXC;
+		uart_irq(u);
+		return;
+	}
+	if(u && port == u->io+UCSRB) {
+		io_in(u->io+UCSRA);
+		return;
+	}
 	switch(port) {
 		static unsigned long long last_wdce = -4;
 		static unsigned long long last_eempe = -4;
@@ -424,12 +1640,11 @@ void avr_io_out(int port, unsigned char prev)
 		if(INCR(uart_num) < sizeof uart_buffer) {
 #  ifndef DELAY_IO
 			OR(avr_IO[UCSR0A], TXC|UDRE);
-			if(avr_IO[UCSR0B] & (TXC|UDRE))
-				avr_INT = 1;
 #  endif
 		} else {
 			/* fprintf(stderr, "warning: flow control used\n"); */
 		}
+		uart_irq(&uart[0]);
 		break;
 #else
 		int c;
@@ -437,16 +1652,17 @@ void avr_io_out(int port, unsigned char prev)
 		c = avr_IO[port];
 		assert(putchar(c) != EOF);
 		OR(avr_IO[UCSR0A], TXC|UDRE);
-		if(avr_IO[UCSR0B] & (TXC|UDRE))
-			avr_INT = 1;
+		uart_irq(&uart[0]);
 		break;
 #endif
-	case UCSR0A:
-		/* only allow writing the R/W parts */
-		avr_IO[port] = prev&~0x43 | (avr_IO[port]&0x43 | ~prev&TXC) ^ TXC;
-		break;
-	case UCSR0B:
-		avr_io_in(UCSR0A);
+	case SPMCSR:
+		if(spm.op) /* only SPMIE can be changed while busy */
+			avr_IO[port] = prev & ~SPMIE | avr_IO[port] & SPMIE;
+		else
+			avr_IO[port] = prev & RWWSB | avr_IO[port] & ~RWWSB;
+		if(avr_IO[port] & SPMEN && !spm.op)
+			spm.armed = avr_cycle;
+		spm_irq();
 		break;
 	case EECR:
 		if(avr_cycle-last_eempe <= 4 && avr_IO[port]&EEPE) { /* execute a write */
@@ -463,51 +1679,96 @@ void avr_io_out(int port, unsigned char prev)
 		}
 		if(avr_IO[port] & EEMPE)
 			last_eempe = avr_cycle;
-		if(avr_IO[port] & EERIE)
-			avr_INT = 1;
+		/* the eeprom is always ready */
+		irq_update(IRQ(vec_EERI), avr_IO[port] & EERIE? IRQ(vec_EERI) : 0);
 		break;
 
 	case TIFR0:
 	case TIFR1:
 	case TIFR2:
-		avr_IO[port] = 0; /* any write clears the flag */
+		t = &timers[port-TIFR0];
+		val = avr_IO[port];
+		avr_IO[port] = prev;
+		timer_sync(t);
+		avr_IO[port] &= ~val; /* writing a one clears the flag */
+		timer_irq(t);
+		timer_schedule(t);
 		break;
-	case TCNT0:
-		avr_cycle++;
-		set_timer(0, avr_IO[TCNT0]);
-		avr_cycle--;
+	case TIMSK0:
+	case TIMSK1:
+	case TIMSK2:
+		t = timer_write(port-TIMSK0, port, prev);
+		timer_irq(t);
+		timer_schedule(t);
 		break;
+	case TCNT0:
 	case TCNT2:
-		avr_cycle++;
-		set_timer(2, avr_IO[TCNT2]);
-		avr_cycle--;
+		t = timer_write(port == TCNT2? 2 : 0, port, prev);
+		t->count = avr_IO[port];
+		t->last  = prescaler_clock(t->pre) + 1; /* the counter skips a tick after a write */
+		timer_schedule(t);
 		break;
 	case TCNT1L:
-		avr_cycle++;
-		set_timer(1, avr_IO[TCNT1L]+TEMP*0x100);
-		avr_cycle--;
+		t = timer_write(1, port, prev);
+		t->count = avr_IO[TCNT1L] | TEMP << 8;
+		t->last  = prescaler_clock(t->pre) + 1;
+		timer_schedule(t);
 		break;
 	case TCNT1H:
-		TEMP = avr_IO[TCNT1H];
+	case ICR1H:
+	case OCR1AH:
+	case OCR1BH:
+	case OCR1CH:
+		TEMP = avr_IO[port];
+		avr_IO[port] = prev;
 		break;
-	case TCCR0B:
-		set_timer(0, avr_IO[TCNT0]);
+	case ICR1L:
+	case OCR1AL:
+	case OCR1BL:
+	case OCR1CL:
+		t = timer_write(1, port, prev);
+		avr_IO[port+1] = TEMP;
+		timer_schedule(t);
 		break;
+	case TCCR0B:
 	case TCCR2B:
-		set_timer(2, avr_IO[TCNT2]);
+		avr_IO[port] &= 0x3F; /* FOCnA/B are strobes; waveform output is not emulated */
+	case TCCR0A:
+	case OCR0A:
+	case OCR0B:
+	case TCCR2A:
+	case OCR2A:
+	case OCR2B:
+		t = timer_write(port >= TCCR2A? 2 : 0, port, prev);
+		timer_schedule(t);
 		break;
+	case TCCR1A:
 	case TCCR1B:
-		set_timer(1, avr_IO[TCNT1L]+avr_IO[TCNT1H]*0x100);
+		t = timer_write(1, port, prev);
+		timer_schedule(t);
+		break;
+	case ASSR:
+		val = avr_IO[port];
+		avr_IO[port] = prev;
+		timer_sync(&timers[2]);
+		avr_IO[port] = val & 0x60; /* never busy */
+		if((val ^ prev) & AS2)
+			timers[2].last = prescaler[1].base = prescaler_clock(&prescaler[1]);
+		timer_schedule(&timers[2]);
 		break;
 	case GTCCR:
-		avr_IO[port] ^= prev&(PSRASY|PSRSYNC);
-		PRESCALER01(NULL, GTCCR, 0,0,0, 0, NULL); /* resets the prescaler if demanded */
-		PRESCALER2 (NULL, GTCCR, 0,0,0, 0, NULL);
-		avr_IO[port] ^= prev&(PSRASY|PSRSYNC);
-		PRESCALER01(NULL, GTCCR, 0,0,0, 0, NULL);
-		PRESCALER2 (NULL, GTCCR, 0,0,0, 0, NULL);
-		if(!(avr_IO[port]&TSM))
+		val = avr_IO[port];
+		avr_IO[port] = prev;
+		for(k=0; k < 3; k++)
+			timer_sync(&timers[k]);
+		avr_IO[port] = val;
+		for(k=0; k < 2; k++) /* resets the prescaler if demanded */
+			if(val & prescaler[k].psr)
+				prescaler[k].base = prescaler_clock(&prescaler[k]);
+		if(!(val&TSM))
 			avr_IO[port] = 0;
+		for(k=0; k < 3; k++)
+			timer_schedule(&timers[k]);
 		break;
 	case WDTCSR:
 		if(avr_cycle-last_wdce > 4 || avr_IO[MCUSR]&WDRF) {
@@ -516,111 +1777,435 @@ void avr_io_out(int port, unsigned char prev)
 		if(avr_IO[port]&(WDCE|WDE))
 			last_wdce = avr_cycle;
 		avr_IO[port] &= ~(WDCE | avr_IO[port]&WDIF);
+		irq_update(IRQ(vec_WDIF), (avr_IO[port] & (WDIF|WDIE)) == (WDIF|WDIE)? IRQ(vec_WDIF) : 0);
+		wd_schedule();
 		break;
 
-#define PINA  0x00
-#define PORTA 0x02
-#define PINB  0x03
-#define PORTB 0x05
-#define PINC  0x06
-#define PORTC 0x08
-#define PIND  0x09
-#define PORTD 0x0B
 	case PINA:
 	case PINB:
 	case PINC:
 	case PIND:
 		prev = avr_IO[port+2];
 		avr_IO[port+2] ^= avr_IO[port];
-		avr_IO[port] = 0;
+		avr_IO[port] = gpio_in[port/3];
 		port+=2;
-		int i;
 	case PORTA:
 	case PORTB:
 	case PORTC:
 	case PORTD:
-		for(i=0; i<8; i++) if((avr_IO[port]&~prev)&(1<<i))
-			fprintf(stderr, "<%c%u>", 'A'+(port-2)/3, i);
+		board_send(BOARD_PORTA + port/3, BOARD_NOW, 0, avr_IO[port]);
+	case DDRA:
+	case DDRB:
+	case DDRC:
+	case DDRD:
+		spi_select();
+		break;
+
+	case ADCSRA:
+	case ADCSRB:
+		adc_write(port, prev);
+		break;
+	case ADCL:
+	case ADCH:
+		avr_IO[port] = prev;
+		break;
+
+	case SPCR:
+		spi_irq();
+		spi_receive();
+		break;
+	case SPSR:
+		avr_IO[port] = prev&~SPI2X | avr_IO[port]&SPI2X;
+		break;
+	case SPDR:
+		spi_access();
+		spi_start();
+		break;
+	case TWSR:
+		avr_IO[port] = prev&~3 | avr_IO[port]&3;
+		break;
+	case TWDR:
+		if(avr_IO[TWCR] & TWINT) {
+			AND(avr_IO[TWCR], ~TWWC);
+		} else {
+			avr_IO[port] = prev;
+			OR(avr_IO[TWCR], TWWC);
+		}
+		break;
+	case TWCR:
+		val = avr_IO[port];
+		avr_IO[port] = val&~(TWINT|TWWC) | prev&TWWC | (val&TWINT? 0 : prev&TWINT);
+		if((val & (TWINT|TWEN)) == (TWINT|TWEN)) /* writing a one clears TWINT */
+			twi_start();
+		twi_irq();
 		break;
 	}
 }
 
+/* the ports selected by -iolog are logged, with the values before and after the host handled them;
+   the gpio registers go to the -vcd dump */
+void avr_io_in(int port)
+{
+	unsigned char old = avr_IO[port];
+	io_in(port);
+	if(iolog_selected(port))
+		iolog_record(port, old, avr_IO[port], 0);
+}
+
+void avr_io_out(int port, unsigned char prev)
+{
+	io_out(port, prev);
+	if(iolog_selected(port))
+		iolog_record(port, prev, avr_IO[port], 1);
+	if(vcd_ports[port])
+		vcd_sample(port);
+}
+
 void avr_des_round(unsigned long long* data, unsigned long long* key, int round, int decrypt)
 {
-	extern void des_init(void);
-	extern unsigned long long des_round(unsigned long long block, unsigned long long *key, int round, int decrypt);
-	static char initialized;
-	if(!initialized) des_init(), initialized++;
-	*data = des_round(*data, key, decrypt?15-round:round, decrypt);
+	extern void des_round_cached(unsigned long long *block, unsigned long long *key, int round, int decrypt);
+	des_round_cached(data, key, decrypt?15-round:round, decrypt);
+}
+
+/* called by the emulator when it vectors an interrupt; this clears some of the flags that requested it */
+void avr_interrupt(int n)
+{
+	measure_interrupt();
+	switch(2*n) {
+	case vec_WDIF:
+		fprintf(stderr, "%s\n", "watchdog interrupt");
+		avr_IO[WDTCSR] &= ~WDIF;
+		irq_update(IRQ(vec_WDIF), 0);
+		break;
+	case vec_SPI:
+		avr_IO[SPSR] &= ~SPIF;
+		spi_irq();
+		break;
+	case vec_TWI: /* TWINT has to be cleared by the program */
+		break;
+	case vec_ADC:
+		avr_IO[ADCSRA] &= ~ADIF;
+		adc_irq();
+		break;
+	default:
+		uart_ack(2*n);
+		timer_ack(2*n);
+		break;
+	}
+}
+
+/* after avr_reset(): all i/o registers are cleared, so nothing is pending anymore */
+static void io_reset(void)
+{
+	int k;
+	avr_IRQ = 0;
+	replay_reset();
+	schedule(EV_REPLAY, replay_next());
+	measure_reset();
+	timer_reset();
+	spi.busy = spi.clear = 0;
+	schedule(EV_SPI, NEVER);
+	spi_select();
+	if(twi.dev) twi.dev->stop(twi.dev);
+	twi.dev = NULL;
+	twi.state = TWI_IDLE;
+	avr_IO[TWSR] = 0xF8;
+	schedule(EV_TWI, NEVER);
+	spm.op = 0;
+	spm_clear_buffer();
+	schedule(EV_SPM, NEVER);
+	adc.busy = adc.locked = 0;
+	adc.time += adc.last; /* the recordings go on from the last sample */
+	adc.last = 0;
+	schedule(EV_ADC, NEVER);
+	for(k=0; k < 4; k++)
+		if(uart_paced(&uart[k]))
+			uart_reset(&uart[k]);
+	if(board_mcu >= 0) {
+		for(k=0; k < 4; k++) /* the other mcus still drive these */
+			avr_IO[PINA + 3*k] = gpio_in[k];
+		board_base = board_resume();
+		schedule(EV_BOARD, 0);
+	}
+	vcd_sample_all();
+}
+
+/* -coverage: the coverage core records which instructions and branches the mcu executes */
+extern unsigned char avr_COVER[];
+extern void avr_run_coverage(void) __attribute__((weak));
+static const char *coverage_file;
+
+/* -iolog: see iolog.c */
+static const char *iolog_file;
+
+/* -vcd: see vcd.c */
+static const char *vcd_file;
+
+/* ORs avr_COVER into the file, so that it accumulates the coverage of every run (even parallel
+   ones); in board mode, mcu n writes to file.n */
+static void coverage_save(void)
+{
+	static unsigned char map[0x20000];
+	char name[4096];
+	ssize_t n, pos = 0;
+	int fd;
+	snprintf(name, sizeof name, board_mcu >= 0? "%s.%d" : "%s", coverage_file, board_mcu);
+	if((fd = open(name, O_RDWR|O_CREAT, 0666)) < 0 || flock(fd, LOCK_EX) != 0) {
+		perror(name);
+		return;
+	}
+	memset(map, 0, sizeof map);
+	while(pos < sizeof map && (n = pread(fd, map+pos, sizeof map-pos, pos)) > 0)
+		pos += n;
+	for(pos=0; pos < sizeof map; pos++)
+		map[pos] |= avr_COVER[pos];
+	if(pwrite(fd, map, sizeof map, 0) != sizeof map)
+		perror(name);
+	close(fd);
 }
 
 static void ctrl_handler(int sig)
 {
 	static int count;    /* fallback */
-	INT_reason = sig==SIGINT? XRESET : POWEROFF;
+	mail_reset = sig==SIGINT? XRESET : POWEROFF;
+	avr_MAIL = 1;
 	avr_INT = 1;
-	avr_SREG = 0x80;
+	idle_wake();
 	if(sig==POWEROFF && count++) abort();
 }
 
 static struct termios stdin_termios;
-static const char *pty_link;
 
 static void restore_state()
 {
-	if(pty_link) unlink(pty_link);
+	int n;
+	replay_close();
+	for(n=0; n < 4; n++)
+		if(uart[n].link) unlink(uart[n].link);
+	if(coverage_file) coverage_save();
 	tcsetattr(STDIN_FILENO, TCSANOW, &stdin_termios);
 }
 
+/* has the other side of stdout hung up? recorded (or replayed), as the halted mcu waits for this */
+static int hung_up(void)
+{
+	struct pollfd info[1] = { STDOUT_FILENO, POLLHUP, };
+	long long hup;
+	if(!replay_input(REPLAY_HANGUP, &hup))
+		replay_log(REPLAY_HANGUP, 0, hup = poll(info, 1, 0) != 0);
+	return hup;
+}
+
 static void killed()
 {
 	abort();
 }
 
-static pthread_t signal_thread;
-static volatile char kill_with_fire;
+/* see gdbstub.c */
+static const char *gdb_spec;
+extern int gdb_init(const char *spec, size_t flash_size, unsigned char *eeprom, size_t eeprom_size);
+extern int gdb_stop(int status);
+
+/* sanitizer; the checked core calls avr_fault (see avr_core_x86.s) */
+extern unsigned char avr_CHECKED, avr_SHADOW[] __attribute__((weak));
+extern unsigned short avr_STACK_LIMIT __attribute__((weak));
+static int sanitize;
+
+/* -limit: stop once this many cycles have passed since the last reset */
+static unsigned long long cycle_limit = NEVER;
+static int timed_out;
+static struct { int kind, addr; unsigned long pc; unsigned long long cycle; } fault;
+
+/* data addresses of the registers that exist on the ATmega2560 */
+static const unsigned short mapped_io[][2] = {
+	{0x20,0x48}, {0x4A,0x4E}, {0x50,0x51}, {0x53,0x55}, {0x57,0x57}, {0x5B,0x5F},
+	{0x60,0x61}, {0x64,0x66}, {0x68,0x73}, {0x78,0x7F},
+	{0x80,0x82}, {0x84,0x8D}, {0x90,0x92}, {0x94,0x9D}, {0xA0,0xA2}, {0xA4,0xAD},
+	{0xB0,0xB4}, {0xB6,0xB6}, {0xB8,0xBD},
+	{0xC0,0xC2}, {0xC4,0xC6}, {0xC8,0xCA}, {0xCC,0xCE}, {0xD0,0xD2}, {0xD4,0xD6},
+	{0x100,0x10B}, {0x120,0x122}, {0x124,0x12D}, {0x130,0x132}, {0x134,0x136},
+};
 
-static void *signal_catcher(void *arg)
+static void sanitize_init(unsigned end_of_bss)
 {
-	for(;;)
-		if((kill_with_fire=1), INT_reason != INTR || (kill_with_fire=0))
-			avr_SREG = 0x80; /* force-quit the emulator */
-		else usleep(1000000);
+	unsigned i, a;
+	for(a=0x20; a <= 0x1FF; a++)
+		avr_SHADOW[a] |= 2;
+	for(i=0; i < sizeof mapped_io/sizeof *mapped_io; i++)
+		for(a=mapped_io[i][0]; a <= mapped_io[i][1]; a++)
+			avr_SHADOW[a] &= ~2;
+	avr_STACK_LIMIT = end_of_bss-1;
+	avr_CHECKED = 1;
 }
 
-#define SPMCSR 0x37
-
-void avr_self_program(int addr, int value)
+void avr_fault(int kind, int addr)
 {
-	fprintf(stderr, "%02x: %04X <- %02X\n", avr_IO[SPMCSR], addr, value);
-	if((avr_IO[SPMCSR]&0x3F) == 0x01)
-		avr_FLASH[addr/2&0x1FFFF] = value;
-	avr_IO[SPMCSR] = 0x00; //&= ~0x01;
+	if(!sanitize || fault.kind) return;
+	fault.kind  = kind;
+	fault.addr  = addr;
+	fault.pc    = avr_PC;
+	fault.cycle = avr_cycle;
+	avr_HALT = 1;
+	avr_INT = 1;
 }
 
 int main(int argc, char **argv)
 {
+	struct watch_hit hit;
+	int status;
 	tcgetattr(STDIN_FILENO, &stdin_termios);
 	atexit(restore_state);
 
-	if(argv[1] && strncmp(argv[1], "-pty", 4) == 0) {
-		extern const char* make_stdin_pty(void);
-		const char *pty = make_stdin_pty();
-		const char *sym = argv[1]+5;
-		if(sym[-1] != '\0') {
-			if(symlink(pty, sym) != 0) {
-				fprintf(stderr, "could not create symbolic link %s\n", sym);
+	if(argv[1] && (strncmp(argv[1], "-record:", 8) == 0 || strncmp(argv[1], "-replay:", 8) == 0)) {
+#ifdef THREAD_IO
+		fprintf(stderr, "%s\n", "recording and replaying require the emulator thread to do all i/o");
+		return 2;
+#endif
+		if((argv[1][3] == 'c'? replay_record : replay_open)(argv[1]+8) != 0) {
+			fprintf(stderr, "could not %s %s\n", argv[1][3] == 'c'? "record to" : "replay", argv[1]+8);
+			return 2;
+		}
+		++argv;
+	}
+	if(argv[1] && strncmp(argv[1], "-pty", 4) == 0 && (!argv[1][4] || argv[1][4] == ':')) {
+		if(uart_connect(0, argv[1]+1) != 0) {
+			fprintf(stderr, "could not connect a terminal to USART0\n");
+			return 2;
+		}
+		++argv;
+	}
+	while(argv[1] && strncmp(argv[1], "-usart:", 7) == 0) {
+		/* -usart:n:endpoint */
+		int n = argv[1][7] - '0';
+		if(n < 0 || n > 3 || argv[1][8] != ':' || uart_connect(n, argv[1]+9) != 0) {
+			fprintf(stderr, "could not connect %s\n", argv[1]+1);
+			return 2;
+		}
+		++argv;
+	}
+	if(uart_stdio && !uart[0].bridge) {
+		fprintf(stderr, "stdin and stdout belong to USART0, unless it is connected elsewhere\n");
+		return 2;
+	}
+	if(argv[1] && strncmp(argv[1], "-gdb", 4) == 0) {
+		gdb_spec = argv[1][4]? argv[1]+5 : "";
+		++argv;
+	}
+	if(argv[1] && strncmp(argv[1], "-sanitize", 9) == 0) {
+		extern void avr_run_checked(void) __attribute__((weak));
+		if(!avr_run_checked) {
+			fprintf(stderr, "%s\n", "the sanitizer requires the checked core");
+			return 2;
+		}
+		sanitize_init(argv[1][9]? strtoul(argv[1]+10, NULL, 0) : 0x200);
+		sanitize = 1;
+		++argv;
+	}
+	while(argv[1] && strncmp(argv[1], "-watch:", 7) == 0) {
+		/* -watch:addr[,len][:r|w|a] */
+		char *p;
+		unsigned long addr = strtoul(argv[1]+7, &p, 0), len = 1;
+		int kind = WATCH_WRITE;
+		if(*p == ',') len = strtoul(p+1, &p, 0);
+		if(*p == ':') kind = p[1]=='r'? WATCH_READ : p[1]=='a'? WATCH_ACCESS : WATCH_WRITE;
+		if(watch_add(addr, len, kind) != 0) {
+			fprintf(stderr, "could not set watchpoint %s (requires the checked core)\n", argv[1]+7);
+			return 2;
+		}
+		++argv;
+	}
+	if(argv[1] && strncmp(argv[1], "-coverage:", 10) == 0) {
+		if(!avr_run_coverage) {
+			fprintf(stderr, "%s\n", "coverage requires the coverage core");
+			return 2;
+		}
+		coverage_file = argv[1]+10;
+		if(!avr_CHECKED)
+			avr_CHECKED = 2;
+		++argv;
+	}
+	if(argv[1] && strncmp(argv[1], "-iolog:", 7) == 0) {
+		/* -iolog:file[:ports] */
+		char *p = strchr(iolog_file = argv[1]+7, ':');
+		if(p) {
+			*p++ = '\0';
+			if(iolog_select(p) != 0) {
+				fprintf(stderr, "invalid ports %s\n", p);
 				return 2;
 			}
-			pty_link = pty = sym;
 		}
-		fprintf(stderr, "connecting terminal: %.*s%s\n", (pty[0]!='/')*2, "./", pty_link=pty);
 		++argv;
 	}
+	if(argv[1] && strncmp(argv[1], "-vcd:", 5) == 0) {
+		vcd_file = argv[1]+5;
+		++argv;
+	}
+	if(argv[1] && strncmp(argv[1], "-elf:", 5) == 0) {
+		if(measure_elf(argv[1]+5) != 0) {
+			fprintf(stderr, "could not read the symbols of %s\n", argv[1]+5);
+			return 2;
+		}
+		++argv;
+	}
+	while(argv[1] && strncmp(argv[1], "-measure:", 9) == 0) {
+		/* -measure:start[:stop][/noisr] */
+		if(measure_add(argv[1]+9) != 0) {
+			fprintf(stderr, "could not measure %s\n", argv[1]+9);
+			return 2;
+		}
+		++argv;
+	}
+	if(argv[1] && strncmp(argv[1], "-limit:", 7) == 0) {
+		cycle_limit = strtoull(argv[1]+7, NULL, 0);
+		++argv;
+	}
+	while(argv[1] && (strncmp(argv[1], "-spi:", 5) == 0 || strncmp(argv[1], "-twi:", 5) == 0)) {
+		if(device_add(argv[1]+1) != 0) {
+			fprintf(stderr, "could not attach %s\n", argv[1]+1);
+			return 2;
+		}
+		++argv;
+	}
+	while(argv[1] && strncmp(argv[1], "-adc:", 5) == 0) {
+		/* -adc:channel:file.csv or -adc:channel:file:rate */
+		if(adc_stream(argv[1]+5) != 0) {
+			fprintf(stderr, "could not use %s for the ADC\n", argv[1]+5);
+			return 2;
+		}
+		++argv;
+	}
+	if(argv[1] && strncmp(argv[1], "-board:", 7) == 0) {
+		/* -board:mcus[:quantum] [-wire:src.port>dst.port]... flash.hex... */
+		char *p;
+		int mcus = strtoul(argv[1]+7, &p, 10), i;
+		unsigned long quantum = *p == ':'? strtoul(p+1, NULL, 0) : 1000;
+		if(board_open(mcus, quantum) != 0) {
+			fprintf(stderr, "could not set up a board with %s mcus\n", argv[1]+7);
+			return 2;
+		}
+		++argv;
+		while(argv[1] && strncmp(argv[1], "-wire:", 6) == 0) {
+			if(board_wire(argv[1]+6) != 0) {
+				fprintf(stderr, "invalid wire %s\n", argv[1]+6);
+				return 2;
+			}
+			++argv;
+		}
+		for(i=1; i <= mcus && argv[i]; i++)
+			;
+		if(i > mcus) {
+			i = board_start();
+			argv[1] = argv[1+i];
+			argv[2] = NULL;
+			if(i) gdb_spec = NULL; /* only the first mcu can be debugged */
+			uart_wired = board_inputs(BOARD_UART0);
+			spi_wired  = board_inputs(BOARD_SPI0);
+		}
+	}
 
 	memset(avr_FLASH, 0xFF, 0x40000);
 	if(!argv[1]) {
-		fprintf(stderr, "usage: tester [-pty[:symlink]] flash.hex [eeprom.hex]]\n");
+		fprintf(stderr, "usage: tester [-record:file | -replay:file] [-pty[:symlink]] [-usart:n:stdio|pty[:symlink]|file:out[:in]|unix:path|pipe:command]... [-gdb[:port|socket]] [-sanitize[:end_of_bss]] [-watch:addr[,len][:r|w|a]]... [-coverage:file] [-iolog:file[:ports]] [-vcd:file[.gz|.zst|.xz]] [-elf:file.elf] [-measure:start[:stop][/noisr]]... [-limit:cycles] [-spi:nor|sd:image[:cs] | -twi:eeprom:image[:addr]]... [-adc:channel:file.csv | -adc:channel:file:rate]... [-board:mcus[:quantum] [-wire:src.port>dst.port]...] flash.hex [eeprom.hex | flash.hex...]\n");
 		return 2;
 	} else {
 		int n = ihex_read(argv[1], avr_FLASH, 0x40000, &avr_BOOT_PC);
@@ -643,6 +2228,28 @@ int main(int argc, char **argv)
 		eeprom_nonvolatile = n;
 	}
 
+	if(iolog_file) {
+		/* in board mode, mcu n logs to file.n */
+		char name[4096];
+		snprintf(name, sizeof name, board_mcu >= 0? "%s.%d" : "%s", iolog_file, board_mcu);
+		if(iolog_open(name) != 0) {
+			fprintf(stderr, "could not open %s\n", name);
+			return 2;
+		}
+	}
+	if(vcd_file) {
+		char name[4096];
+		snprintf(name, sizeof name, board_mcu >= 0? "%s.%d" : "%s", vcd_file, board_mcu);
+		if(vcd_open(name, F_CPU) != 0) {
+			fprintf(stderr, "could not open %s\n", name);
+			return 2;
+		}
+	}
+
+	if((wake_fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC)) < 0) {
+		perror("eventfd");
+		return 2;
+	}
 	signal(SIGINT,  ctrl_handler);
 	signal(SIGQUIT, ctrl_handler);
 	signal(SIGABRT, restore_state);
@@ -662,103 +2269,60 @@ int main(int argc, char **argv)
 		tcsetattr(STDIN_FILENO, TCSANOW, &ctrl);
 	}
 
+	if(gdb_spec) {
+		if(gdb_init(gdb_spec, 0x40000, eeprom, sizeof eeprom) != 0) {
+			fprintf(stderr, "could not listen for a debugger on %s\n", *gdb_spec? gdb_spec : "port 1234");
+			return 2;
+		}
+	}
+
 	avr_reset();
+	io_reset();
 	avr_IO[MCUSR]  = PORF;
 	/* avr_IO[WDTCSR] |= WDE; uncomment this to start the watchdog timer by default */
+	if(uart[0].bridge) {
+		/* the bridge does all of it */
+	} else if(replaying) {
+		/* stdin is in the recording */
+	} else {
 #ifdef THREAD_IO
-	pthread_create(&tty_thread, NULL, fake_console, NULL);
-	pthread_create(&rbr_thread, NULL, fake_receiver, NULL);
+		avr_ASYNC = 1; /* these write to UCSR0A themselves */
+		pthread_create(&tty_thread, NULL, fake_console, NULL);
+		pthread_create(&rbr_thread, NULL, fake_receiver, NULL);
 #else
-	signal(SIGIO, io_input_handler);
-	fcntl(STDIN_FILENO, F_SETOWN, getpid());
-	fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_ASYNC | O_NONBLOCK);
-#endif
-	pthread_create(&signal_thread, NULL, signal_catcher, NULL);
-#ifdef THREAD_TIMER
-	{
-		/* block the main CPU thread from getting bogged down with the timer */
-		sigset_t set;
-		sigemptyset(&set);
-		sigaddset(&set, SIGALRM);
-		sigaddset(&set, SIGVTALRM);
-		pthread_sigmask(SIG_BLOCK, &set, NULL);
-	}
-	signal(SIGALRM, timer_poll_handler);
-	ualarm(THREAD_TIMER, THREAD_TIMER);
+		signal(SIGIO, io_input_handler);
+		fcntl(STDIN_FILENO, F_SETOWN, getpid());
+		fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) | O_ASYNC | O_NONBLOCK);
 #endif
-	signal(SIGVTALRM, watchdog);
-	uvalarm(1024*1000000ull/(WD_FREQ), 1024*1000000ull/(WD_FREQ));
+	}
 	do {
 		avr_IO[WDTCSR] |= avr_IO[MCUSR]&WDRF;
-		switch( avr_run() ) {
+		wd_schedule();
+		status = avr_run_until(cycle_limit);
+		if(status == 2 && (status = measure_break()) == 0)
+			continue;
+		switch(status) {
 		case 0:
+			/* the emulator vectors all other interrupts by itself */
+			assert(avr_IRQ & IRQ(vec_RESET));
 			if(INT_reason == POWEROFF) {
 				fprintf(stderr, "%s\n", "powered down");
 				avr_reset();
+				io_reset();
 				avr_IO[MCUSR] = BORF;
 				break;
 			} else if(INT_reason == XRESET) {
 				fprintf(stderr, "%s\n", "external reset");
 				avr_reset();
+				io_reset();
 				avr_IO[MCUSR] = EXTRF;
 				reset;
 			} else if(INT_reason == WDRESET) {
 				fprintf(stderr, "%s\n", "watchdog reset");
 				avr_reset();
+				io_reset();
 				avr_IO[MCUSR] = WDRF;
 				reset;
-			} else if(avr_IO[WDTCSR] & WDIF) {
-				fprintf(stderr, "%s\n", "watchdog interrupt");
-				avr_PC = vec_WDIF;
-				avr_IO[WDTCSR] &=~WDIF;
-				continue;
-			} else if(timer_overflows[0]) {
-				avr_IO[TIFR0] &= ~TOV;
-				avr_PC = vec_TOV0;
-				if(--timer_overflows[0]) avr_INT = 1;
-				continue;
-			} else if(timer_overflows[1]) {
-				avr_IO[TIFR1] &= ~TOV;
-				avr_PC = vec_TOV1;
-				if(--timer_overflows[1]) avr_INT = 1;
-				continue;
-			} else if(timer_overflows[2]) {
-				avr_IO[TIFR2] &= ~TOV;
-				avr_PC = vec_TOV2;
-				if(--timer_overflows[2]) avr_INT = 1;
-				continue;
-			} else if(avr_IO[EECR] & EERIE) {
-				avr_INT = 1; /* always see if EERIE is resolved */
-				avr_PC = vec_EERI;
-				continue;
-			} else { /* must be a serial-related interrupt... */
-				avr_io_in(UCSR0A);
-				switch(avr_IO[UCSR0B] & avr_IO[UCSR0A] & (TXC|UDRE)) {
-				case UDRE: /* UDR empty - do not clear flag */
-				case TXC|UDRE:
-					avr_INT = 1; /* there might be more IO-related interrupts */
-					avr_PC = vec_UDRE;
-					continue;
-				case TXC:  /* TX complete - clear flag, set UDRE */
-					avr_INT = 1;
-					avr_PC = vec_TXC;
-					AND(avr_IO[UCSR0A], ~TXC);
-					continue;
-				default:
-					if(avr_IO[UCSR0B] & avr_IO[UCSR0A] & RXC) {
-						avr_INT = 1;
-						avr_PC = vec_RXC;
-						continue;
-					}
-					goto ignore;
-				};
-			ignore: /* everything ok, perform an IRET (kind of kludgy) */
-				avr_SREG |= 0x80;
-				avr_PC  = avr_ADDR[++avr_SP] << 16;
-				avr_PC |= avr_ADDR[++avr_SP] << 8;
-				avr_PC |= avr_ADDR[++avr_SP];
-				avr_cycle -= 5;
-				continue;
 			}
 			break;
 		case 1:
@@ -766,13 +2330,14 @@ int main(int argc, char **argv)
 			fprintf(stderr, "%s\n", "mcu idle");
 			if(!(avr_SREG & 0x80)) goto wait_for_reset;
 			do {
-				avr_cycle+=2;
 			wait_for_interrupt:
-				timer_poll_handler(SIGALRM);
-				sched_yield();
+				timer_idle(0, -1);
+				if(mail_waiting())
+					take_mail();
 			} while(!avr_INT);
 			continue;
 		case 2:
+			if(gdb_stop(2)) continue;
 			fprintf(stderr, "%s\n", "breakpoint");
 			do {
 				avr_debug(avr_PC);
@@ -784,31 +2349,64 @@ int main(int argc, char **argv)
 			if(avr_SREG & 0x80) goto wait_for_interrupt;
 			wait_for_reset:
 			fprintf(stderr, "%s\n", "halted");
-			if(!pty_link) break;
+			board_halt();
+			if(!uart[0].bridge && event_at[EV_WDT] == NEVER) break;
 #ifdef HALT_QUIT
 			/* this keeps a named terminal alive until someone can read from it */
+			if(uart[0].bridge) {
+				uart_flush();
+				break;
+			}
 			fcntl(STDIN_FILENO, F_SETFL, fcntl(STDIN_FILENO, F_GETFL) & ~O_NONBLOCK);
-			while(getchar()!=EOF) sched_yield();
+			while(getchar()!=EOF)
+				;
 			break;
 #else
 			while(!(avr_INT && INT_reason != INTR)) { /* wait for a hard reset */
 #    ifndef NOHUP
-				struct pollfd info[1] = { STDOUT_FILENO, POLLHUP, };
-				if(poll(info, 1, 0) != 0) { /* exception: stop if no-one is listening */
+				if(hung_up()) { /* exception: stop if no-one is listening */
 					/* exception: ignore the HUP of the programmer */
 					static int hup_count = 0;
 					if(avr_BOOT_PC && hup_count++ == 0) {
-						while(!avr_INT && poll(info, 1, 0) != 0) sched_yield();
+						/* the end of a hangup can't be waited for, so look every 10ms */
+						while(INT_reason == INTR && hung_up()) {
+							idle_wait(10000000, 1, -1);
+							if(mail_waiting())
+								take_mail();
+						}
 						continue;
 					}
 					fprintf(stderr, "%s\n", "hangup");
 					goto halt;
 				}
+				timer_idle(1, uart_stdio? STDOUT_FILENO : -1); /* the watchdog may still be running */
+#    else
+				timer_idle(1, -1);
 #    endif
-				sched_yield();
+				if(mail_waiting()) /* a reset comes by mail */
+					take_mail();
 			}
 			continue;
 #endif
+		case 4:
+			if(gdb_stop(4)) continue;
+			if(watch_triggered(&hit)) {
+				fprintf(stderr, "watchpoint: %04x %s, stopped at PC=%04lx, cycle %lld: %02x -> %02x\n",
+					hit.addr, hit.kind==WATCH_WRITE? "written" : "read", avr_PC, avr_cycle, hit.old, hit.new);
+				break;
+			}
+			if(fault.kind) {
+				static const char *what[] = { "", "read of uninitialised memory", "access above RAMEND",
+					"access to unmapped i/o", "stack overflow", "stack underflow" };
+				fprintf(stderr, "sanitizer: %s at %04x, PC=%04lx, cycle %lld\n",
+					what[fault.kind], fault.addr, fault.pc, fault.cycle);
+				break;
+			}
+			continue;
+		case 5:
+			fprintf(stderr, "cycle limit reached: PC=%04lx, cycle %lld\n", avr_PC, avr_cycle);
+			timed_out = 1;
+			break;
 		default:
 			fprintf(stderr, "unexpected situation: PC=%04lx instruction=%04x\n", avr_PC-1, avr_FLASH[avr_PC-1]);
 			break;
@@ -816,10 +2414,16 @@ int main(int argc, char **argv)
 		break;
 	} while(1);
 #ifdef THREAD_IO
-	while(uart_num) sched_yield();
+	{
+		unsigned n;
+		uart_draining = 1;
+		while((n = uart_num) != 0)
+			syscall(SYS_futex, &uart_num, FUTEX_WAIT_PRIVATE, n, NULL, NULL, 0);
+	}
 #endif
+	uart_flush();
 halt:	fprintf(stderr, "%s\n", "done");
 
 	avr_debug(avr_PC-1);
-	return 0;
+	return fault.kind || timed_out? 1 : 0;
 }
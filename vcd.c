@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "vcd.h"
+#include "logring.h"
+
+/* a value change dump (for gtkwave and the like) of the PINx, DDRx and PORTx registers of every
+   gpio port of the ATmega2560, timed by avr_cycle.
+
+   the host calls vcd_sample after the mcu writes to one of these (or after changing a PINx
+   itself), which compares the three registers of that port with their last values and puts any
+   change into a ring; a thread turns the ring into text and writes it in blocks of a megabyte
+   (see logring.c). if the name of the file ends in .gz, .zst or .xz, the text goes through that
+   compressor first, which runs as a process of its own.
+
+   after a reset, avr_cycle starts from 0 again; the time in the dump continues from the last
+   change before it */
+
+extern volatile unsigned long long avr_cycle;
+extern volatile unsigned char avr_IO[];
+
+#define BLOCK     (1<<20)
+
+static const struct gpio {
+	char name;
+	unsigned short pin;           /* PINx; DDRx and PORTx follow it */
+} gpio[] = {
+	{ 'A', 0x00 }, { 'B', 0x03 }, { 'C', 0x06 }, { 'D', 0x09 }, { 'E', 0x0C }, { 'F', 0x0F },
+	{ 'G', 0x12 }, { 'H', 0xE0 }, { 'J', 0xE3 }, { 'K', 0xE6 }, { 'L', 0xE9 },
+};
+#define GPIOS (sizeof gpio/sizeof *gpio)
+
+unsigned char vcd_ports[0x200];
+
+static unsigned char value[3*GPIOS];
+static unsigned long long base, last_cycle;
+
+struct change {
+	unsigned long long time;
+	unsigned char sig, value;
+};
+
+static int out_fd = -1;
+static pid_t compressor;
+static unsigned long long num, den;   /* picoseconds per cycle, as a fraction */
+
+static char block[BLOCK];
+static size_t used;
+
+static void emit(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+static void emit(const char *fmt, ...)
+{
+	va_list ap;
+	if(used > BLOCK-256) {
+		write_all(out_fd, block, used, "vcd");
+		used = 0;
+	}
+	va_start(ap, fmt);
+	used += vsnprintf(block+used, BLOCK-used, fmt, ap);
+	va_end(ap);
+}
+
+static void emit_change(unsigned sig, unsigned char v)
+{
+	char *p;
+	int i;
+	if(used > BLOCK-256) {
+		write_all(out_fd, block, used, "vcd");
+		used = 0;
+	}
+	p = block+used;
+	*p++ = 'b';
+	for(i=7; i >= 0; i--)
+		*p++ = '0' + (v >> i & 1);
+	*p++ = ' ';
+	*p++ = '!' + sig;
+	*p++ = '\n';
+	used = p - block;
+}
+
+static void vcd_write(const void *changes, unsigned n)
+{
+	static unsigned long long time;
+	const struct change *c = changes;
+	for(; n--; c++) {
+		if(c->time != time) {
+			time = c->time;
+			emit("#%llu\n", time / den * num + time % den * num / den);
+		}
+		emit_change(c->sig, c->value);
+	}
+}
+
+/* nothing is happening; let the output catch up */
+static void vcd_flush(void)
+{
+	if(used) {
+		write_all(out_fd, block, used, "vcd");
+		used = 0;
+	}
+}
+
+static struct logring ring = {
+	.record  = sizeof(struct change),
+	.size    = 65536,
+	.chunk   = 4096,            /* the thread is woken when this many are waiting */
+	.consume = vcd_write,
+	.flush   = vcd_flush,
+};
+
+/* runs the compressor that the name asks for, if any, between a pipe and the file */
+static int open_output(const char *file)
+{
+	static const char *suffix[][2] = { { ".gz", "gzip" }, { ".zst", "zstd" }, { ".xz", "xz" } };
+	size_t len = strlen(file), i;
+	int fd = open(file, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0666), p[2];
+	if(fd < 0)
+		return -1;
+	for(i=0; i < sizeof suffix/sizeof *suffix; i++) {
+		size_t n = strlen(suffix[i][0]);
+		if(len <= n || strcmp(file+len-n, suffix[i][0]) != 0)
+			continue;
+		if(pipe2(p, O_CLOEXEC) != 0 || (compressor = fork()) < 0) {
+			close(fd);
+			return -1;
+		}
+		if(compressor == 0) {
+			dup2(p[0], STDIN_FILENO);
+			dup2(fd, STDOUT_FILENO);
+			execlp(suffix[i][1], suffix[i][1], "-c", (char*)NULL);
+			perror(suffix[i][1]);
+			_exit(127);
+		}
+		close(p[0]);
+		close(fd);
+		return p[1];
+	}
+	return fd;
+}
+
+static unsigned long long gcd(unsigned long long a, unsigned long long b)
+{
+	while(b) {
+		unsigned long long t = a % b;
+		a = b, b = t;
+	}
+	return a;
+}
+
+/* freq is the clock of the mcu, to give the time in picoseconds */
+int vcd_open(const char *file, unsigned long freq)
+{
+	size_t g;
+	int k;
+	if((out_fd = open_output(file)) < 0)
+		return -1;
+	num = 1000000000000ull / gcd(1000000000000ull, freq);
+	den = freq / gcd(1000000000000ull, freq);
+	emit("$version fastavr $end\n$timescale 1 ps $end\n$scope module atmega2560 $end\n");
+	for(g=0; g < GPIOS; g++)
+		for(k=0; k < 3; k++) {
+			emit("$var wire 8 %c %s%c $end\n", '!' + 3*(int)g+k, k == 0? "PIN" : k == 1? "DDR" : "PORT", gpio[g].name);
+			vcd_ports[gpio[g].pin + k] = g+1;
+		}
+	emit("$upscope $end\n$enddefinitions $end\n#0\n$dumpvars\n");
+	for(k=0; k < 3*GPIOS; k++)
+		emit_change(k, value[k]);
+	emit("$end\n");
+	if(logring_start(&ring) != 0) {
+		close(out_fd);
+		return -1;
+	}
+	atexit(vcd_close);
+	return 0;
+}
+
+static void put(unsigned long long time, int sig, unsigned char v)
+{
+	struct change *c = logring_slot(&ring);
+	c->time  = time;
+	c->sig   = sig;
+	c->value = v;
+	logring_commit(&ring);
+}
+
+/* called by the emulator thread only, with a port for which vcd_ports is set */
+void vcd_sample(int port)
+{
+	int g = vcd_ports[port]-1, k;
+	if(avr_cycle < last_cycle) /* there has been a reset */
+		base += last_cycle;
+	last_cycle = avr_cycle;
+	for(k=0; k < 3; k++) {
+		unsigned char v = avr_IO[gpio[g].pin + k];
+		if(v != value[3*g+k])
+			put(base + avr_cycle, 3*g+k, value[3*g+k] = v);
+	}
+}
+
+void vcd_sample_all(void)
+{
+	size_t g;
+	if(out_fd >= 0)
+		for(g=0; g < GPIOS; g++)
+			vcd_sample(gpio[g].pin);
+}
+
+/* writes out what is left, and waits for the compressor; called at exit */
+void vcd_close(void)
+{
+	if(out_fd < 0)
+		return;
+	logring_stop(&ring);
+	close(out_fd);
+	out_fd = -1;
+	if(compressor > 0)
+		waitpid(compressor, NULL, 0);
+}
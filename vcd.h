@@ -0,0 +1,9 @@
+/* value change dumps of the gpio ports (see vcd.c) */
+
+/* for every i/o port (as passed to avr_io_out): 1 + the number of the gpio port it belongs to, or 0 */
+extern unsigned char vcd_ports[0x200];
+
+extern int vcd_open(const char *file, unsigned long freq);
+extern void vcd_sample(int port);
+extern void vcd_sample_all(void);
+extern void vcd_close(void);
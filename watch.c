@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include "watch.h"
+
+/* data watchpoints; these need a core assembled with WATCH=1 -- avr_WATCH marks the 256-byte
+   blocks that contain a watchpoint, so that the emulator only calls avr_watch for those;
+   if that is the checked core, it gets switched on by setting a watchpoint */
+
+extern unsigned char avr_WATCH[] __attribute__((weak));
+extern void avr_run_checked(void) __attribute__((weak));
+extern unsigned char avr_CHECKED;
+extern unsigned char avr_ADDR[];
+extern volatile unsigned char avr_INT;
+extern volatile unsigned char avr_HALT;
+
+#define MAX_WATCHPOINTS 16
+
+static struct watchpoint {
+	unsigned addr, len;
+	int kind;
+} wp[MAX_WATCHPOINTS];
+static int wp_num;
+
+static struct watch_hit last_hit;
+static volatile char triggered;
+
+static void watch_update(void)
+{
+	int i;
+	unsigned blk;
+	for(blk=0; blk < 256; blk++)
+		avr_WATCH[blk] = 0;
+	for(i=0; i < wp_num; i++)
+		for(blk=wp[i].addr>>8; blk <= (wp[i].addr+wp[i].len-1)>>8 && blk < 256; blk++)
+			avr_WATCH[blk] |= wp[i].kind;
+}
+
+int watch_add(unsigned addr, unsigned len, int kind)
+{
+	if(!avr_WATCH || wp_num == MAX_WATCHPOINTS || len == 0 || addr+len > 0x10000)
+		return -1;
+	wp[wp_num].addr = addr;
+	wp[wp_num].len  = len;
+	wp[wp_num].kind = kind;
+	wp_num++;
+	watch_update();
+	if(avr_run_checked) avr_CHECKED = 1;
+	return 0;
+}
+
+int watch_remove(unsigned addr, unsigned len, int kind)
+{
+	int i;
+	for(i=0; i < wp_num; i++)
+		if(wp[i].addr == addr && wp[i].len == len && wp[i].kind == kind) {
+			wp[i] = wp[--wp_num];
+			watch_update();
+			return 0;
+		}
+	return -1;
+}
+
+void watch_clear(void)
+{
+	wp_num = 0;
+	if(avr_WATCH) watch_update();
+}
+
+/* called by the emulator, before an access to a marked block */
+void avr_watch(int addr, int kind)
+{
+	int i;
+	if(triggered) return;
+	for(i=0; i < wp_num; i++)
+		if(addr - wp[i].addr < wp[i].len && wp[i].kind & kind) {
+			last_hit.addr = addr;
+			last_hit.kind = kind;
+			last_hit.old  = avr_ADDR[addr];
+			triggered = 1;
+			avr_HALT = 1;
+			avr_INT = 1;
+			return;
+		}
+}
+
+/* after the emulator has stopped; the new value is the current contents */
+int watch_triggered(struct watch_hit *hit)
+{
+	if(!triggered) return 0;
+	triggered = 0;
+	*hit = last_hit;
+	hit->new = avr_ADDR[hit->addr];
+	return 1;
+}
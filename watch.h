@@ -0,0 +1,16 @@
+/* data watchpoints (see watch.c) */
+
+enum watch_kind {
+	WATCH_READ = 1, WATCH_WRITE = 2, WATCH_ACCESS = 3
+};
+
+struct watch_hit {
+	unsigned addr;
+	int kind;
+	unsigned char old, new;
+};
+
+extern int watch_add(unsigned addr, unsigned len, int kind);
+extern int watch_remove(unsigned addr, unsigned len, int kind);
+extern void watch_clear(void);
+extern int watch_triggered(struct watch_hit *hit);